@@ -8,15 +8,34 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 #define ACORN_VERSION "0.0.1"
@@ -24,6 +43,31 @@
 #define ACORN_QUIT_TIMES 3
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define MAX_KEY_HISTORY 256
+#define REGISTER_COUNT 27 //unnamed register plus a-z
+#define ACORN_CACHE_BUDGET (64 * 1024 * 1024) //bytes of render/hl kept for inactive buffers (change with :set cachebudget=MB)
+#define ACORN_LARGE_FILE_SIZE (256 * 1024 * 1024) //bigger files are paged in read-only (change with :set largefile=MB)
+#define ACORN_PAGE_LINES 1024 //lines per page (and between checkpoints in the line index)
+#define ACORN_PAGE_CACHE 32 //pages of a large file kept in memory
+#define ACORN_PAGED_LINE_MAX (64 * 1024) //longer lines in a large file are cut off
+#define ACORN_LOAD_CHUNK (1024 * 1024) //smallest piece of a file worth splitting into lines on its own thread
+#define ACORN_LOAD_FIRST (64 * 1024) //bytes of a file read before its first paint, the rest is loaded in the background
+#define ACORN_LOAD_BATCH 4096 //rows appended at a time while a file loads in the background
+#define ACORN_DECOMPRESS_BLOCK (4 * 1024 * 1024) //decompressed text is split into rows this much at a time
+#define ACORN_LOAD_THREADS 64
+#define ACORN_HIGHLIGHT_CHUNK 16384 //fewest rows worth highlighting on their own thread
+#define ACORN_HL_CACHE_ENTRIES (1024 * 1024) //rows of highlighting kept in the highlight cache (change with :set hlcache=N)
+#define ACORN_PERF_SAMPLES 256 //keys kept for the :perf histograms
+#define ACORN_TRACE_EVENTS (1 << 16) //spans kept while tracing (older ones are overwritten), must be a power of two
+#define ACORN_TRACE_PENDING 64 //keys waiting for a frame to show them
+#define ACORN_FILTER_READ (64 * 1024) //bytes read from a filter's output at a time
+#define ACORN_DIFF_MAX_EDITS 1024 //a reload with more changed lines than this replaces everything between the first and last change
+#define ACORN_REPLAY_ROWS 24 //terminal size used by --replay unless the script sets one
+#define ACORN_REPLAY_COLS 80
+#define ACORN_SERVER_ROWS 24 //terminal size of --server until a client says how big its terminal is
+#define ACORN_SERVER_COLS 80
+#define ACORN_SERVER_MESSAGE_MAX 65536 //biggest message a client may send (it sends keys 256 bytes at a time)
+#define ACORN_SHARE_INTERVAL 16 //ms between batches of edits sent to the others in a shared session (about a frame)
+#define ACORN_SESSION_SAMPLE (1024 * 1024) //bytes hashed at each end of a large file to check it's the one in a session
 
 #define COLOR_BACKGROUND "\x1b[48;2;30;30;30m\0"
 #define COLOR_FOREGROUND "\x1b[38;2;134;214;247m\0"
@@ -71,10 +115,26 @@ enum EditorHighlight {
     HL_MATCH
 };
 
+enum RegisterType {
+    REGISTER_CHARWISE,
+    REGISTER_LINEWISE,
+    REGISTER_BLOCKWISE
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
 /*** data ***/
+//compressed files are recognised by their first bytes and streamed through an external tool in a child process
+struct Compressor {
+    char* name;
+    char* extension;
+    char* magic;
+    int magic_len;
+    char* decompress[4]; //argv - reads the file on stdin, writes the text to stdout
+    char* compress[4];
+};
+
 struct EditorSyntax {
     char* file_type; //this will display in editor status bar
     char** file_match; //an array of char* extensions for this filetype
@@ -85,6 +145,15 @@ struct EditorSyntax {
     int flags;
 };
 
+//Fenwick tree over the screen lines every row takes with :set wrap
+struct WrapIndex {
+    int* tree; //1-based, tree[i] sums the wrap_lines of rows (i - (i & -i), i]
+    int capacity;
+    int num_rows; //rows the tree was last brought up to date for
+    int cols; //screen width the counts are for - 0 if there's no tree
+    int stale_from; //rows from here on were inserted, deleted or moved since, their part of the tree needs rebuilding
+};
+
 struct EditorBuffer {
     //NOTE: cursor_x and cursor_y now refers to position in file, NOT position on screen
     int cursor_x, cursor_y;
@@ -94,19 +163,333 @@ struct EditorBuffer {
     int col_offset;
     int num_rows;
     int dirty;
+    unsigned int edits; //bumped with every change to the rows like dirty, but never reset (saving clears dirty)
     struct EditorRow* row;
     char* filename;
     struct EditorSyntax* syntax;
+    int row_capacity;
+    struct RowArena* text_arena; //row chars (shared with registers)
+    struct RowArena* derived_arena; //render and hl - thrown away as a whole when the buffer is evicted
+    struct PagedFile* paged; //not NULL for large files - rows live in a page cache instead of 'row'
+    struct LoadingFile* loading; //not NULL while the rest of the file is still being read in
+    unsigned long last_used; //for picking which inactive buffer to evict first
+    size_t derived_bytes; //render + hl bytes, measured when the buffer was last made inactive
+    int evicted; //render/hl were dropped and need to be rebuilt before drawing
+    int watch; //inotify watch on the file, -1 if it isn't watched
+    struct timespec mtime; //of the file when it was last read or written
+    off_t file_size;
+    int disk_changed; //the file changed on disk while there were unsaved changes
+    int follow; //:follow - bytes appended to the file are appended to the buffer
+    off_t follow_offset; //bytes of the file that are in the buffer
+    ino_t follow_inode; //of the file being followed, a different one means it was rotated
+    int follow_partial; //the last row hasn't had its newline yet
+    struct Compressor* compressor; //the file is compressed (and saved compressed again) with this, NULL if it isn't
+    struct WrapIndex wrap;
+    int wrap_offset; //screen lines of row 'row_offset' scrolled off the top (with :set wrap)
+    int match_row; //search match drawn on top of the syntax highlighting (-1 if none)
+    int match_start;
+    int match_len;
+};
+
+//a run of highlighted render columns (HL_NORMAL runs aren't stored)
+struct HighlightSpan {
+    int start;
+    int len;
+    unsigned char hl;
+};
+
+//a row's highlight runs are refcounted and shared through the highlight cache (rows point at 'spans')
+struct HighlightRuns {
+    int refs;
+    int count;
+    struct HighlightSpan spans[];
+};
+
+#define HL_RUNS(hl) ((struct HighlightRuns*) ((char*) (hl) - offsetof(struct HighlightRuns, spans)))
+
+struct HighlightCacheEntry {
+    uint64_t hash; //of the row's chars
+    struct EditorSyntax* syntax;
+    int len;
+    unsigned char in_comment;
+    unsigned char open_comment;
+    struct HighlightSpan* hl; //NULL if the row has nothing highlighted
+    int hl_count;
+    int lru_prev;
+    int lru_next;
+};
+
+//open addressed with linear probing - the tag lets most probes skip the entry itself
+struct HighlightCacheSlot {
+    uint32_t tag;
+    int entry; //-1 if empty
+};
+
+struct HighlightCache {
+    pthread_mutex_t lock;
+    struct RowArena* arena; //every row's highlight runs live here
+    struct HighlightCacheEntry* entries; //grows up to 'capacity' as rows are cached
+    struct HighlightCacheSlot* slots;
+    int num_slots; //power of two, at least twice the entries allocated
+    int allocated;
+    int capacity;
+    int count;
+    int lru_head; //most recently used
+    int lru_tail; //evicted first
 };
 
 struct EditorRow {
-    int idx;
     int size;
     int render_size;
     char* chars;
-    char* render;
-    unsigned char* hl;
+    char* render; //only allocated for rows with tabs - otherwise the row is drawn straight from chars
+    struct HighlightSpan* hl;
+    int hl_count;
     int hl_open_comment;
+    int width; //screen columns of render - equal to render_size when every byte takes one column (eg, ASCII)
+    int wrap_lines; //screen lines the row takes with :set wrap (only kept up to date while the buffer has a wrap index)
+};
+
+#define ROW_RENDER(row) ((row)->render ? (row)->render : (row)->chars)
+
+struct EditorPage {
+    int index; //-1 if this cache slot is empty
+    int num_rows;
+    struct EditorRow* row;
+    unsigned long last_used;
+};
+
+//large files only keep a sparse line index (one offset every ACORN_PAGE_LINES lines)
+//rows are read back from disk a page at a time around whatever is being looked at
+//the index is built by a background thread - 'lock' guards everything it writes
+struct PagedFile {
+    int fd;
+    off_t size;
+    int num_pages; //pages the editor can see (only complete pages while indexing)
+    struct EditorPage pages[ACORN_PAGE_CACHE];
+    unsigned long clock;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t indexed; //signalled every time a checkpoint is added and when indexing finishes
+    off_t* checkpoints; //checkpoints[p] is the file offset of row p * ACORN_PAGE_LINES
+    int num_checkpoints;
+    off_t indexed_bytes;
+    long long total_rows; //only valid once 'indexing' is 0
+    int indexing;
+    int cancel;
+};
+
+//every other regular file opens with the rows of its first block, while a thread reads and splits the rest
+//the main thread appends those rows between keys, or all at once when something needs the whole file
+struct LoadingFile {
+    int fd;
+    off_t offset; //where the thread starts reading (just after the last full line of the first block)
+    off_t size;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready; //signalled when 'lines' is ready
+    int split;
+    char* data;
+    struct RegisterSlice* lines; //point into 'data'
+    int num_lines;
+    int next_line; //first line not appended yet
+};
+
+//a register slice holds a reference to a row's chars (not a copy)
+//the row text is only copied once the buffer (or the register) writes to it
+struct RegisterSlice {
+    char* text;
+    int start;
+    int len;
+};
+
+struct EditorRegister {
+    unsigned char type;
+    int num_slices;
+    struct RegisterSlice* slices;
+    struct RowArena* arena; //text arena of the buffer the slices were yanked from
+};
+
+//text typed after 'I', 'A' or 'c' in visual block mode is only recorded (and previewed on visible rows)
+//it is spliced into every row of the block in one pass when leaving insert mode
+struct BlockInsert {
+    int active;
+    int top, bottom;
+    int col;
+    int delete_len; //chars replaced at 'col' on each row (for 'c')
+    int pad_short_rows; //'A' pads rows shorter than 'col' with spaces, 'I' and 'c' skip them
+    char* text;
+    int len;
+    int capacity;
+};
+
+enum PerfCounter {
+    PERF_KEYPRESS,
+    PERF_SYNTAX,
+    PERF_DRAW,
+    PERF_WRITE,
+    PERF_COUNTERS
+};
+
+//time spent per key in each of the PerfCounter spans (ns), kept for the last ACORN_PERF_SAMPLES keys
+//a key's sample covers handling it and every frame drawn until the next key comes in
+struct Perf {
+    int hud; //show the last key's timings in the status bar
+    int key_open; //a key is being handled (or drawn)
+    int keys; //keys recorded so far - the newest sample is at (keys - 1) % ACORN_PERF_SAMPLES
+    int depth[PERF_COUNTERS]; //nested spans are only timed by the outermost one
+    uint64_t start[PERF_COUNTERS];
+    uint64_t current[PERF_COUNTERS]; //the key being handled
+    uint64_t current_bytes;
+    uint64_t current_rows;
+    uint64_t waited; //time blocked on input while handling a key (eg, in a prompt), not counted against it
+    uint64_t samples[PERF_COUNTERS][ACORN_PERF_SAMPLES];
+    uint64_t bytes[ACORN_PERF_SAMPLES]; //written to the terminal
+    uint64_t rows[ACORN_PERF_SAMPLES]; //re-highlighted
+    uint64_t allocs[ACORN_PERF_SAMPLES]; //calls to malloc, calloc and realloc
+    unsigned long alloc_base; //allocation count when the current key came in
+};
+
+struct TraceEvent {
+    unsigned long seq; //index + 1 once the slot is completely written
+    const char* name;
+    uint64_t start; //ns
+    uint64_t duration; //ns
+    int tid;
+    int key; //keystroke being handled when the span ended
+};
+
+//spans for chrome://tracing (or perfetto), enabled with ACORN_TRACE=file or ':trace start [file]'
+//any thread can add a span: writers claim slots with an atomic increment, and the ring wraps around
+struct Trace {
+    int enabled;
+    char* path;
+    struct TraceEvent* events;
+    unsigned long head;
+    int key; //keys read so far
+    int pending; //keys not drawn yet
+    int first_pending; //id of the oldest one
+    uint64_t pending_time[ACORN_TRACE_PENDING]; //when each pending key arrived
+};
+
+//:{range}!cmd pipes rows [start, end) through 'cmd' while the editor keeps running
+//output rows are inserted after the range as they arrive, and the range is only deleted once 'cmd' succeeds
+struct Filter {
+    pid_t pid; //0 when no filter is running
+    struct EditorBuffer* buffer;
+    int to_child; //-1 once all input is written
+    int from_child;
+    int start, end;
+    int next_row; //next row to write
+    int row_offset; //bytes of 'next_row' already written (its newline comes at offset 'size')
+    int inserted; //output rows inserted after the range so far
+    int dirty; //the buffer's dirty count before the filter started, put back if it fails or is cancelled
+    char* partial; //output line still waiting for its newline
+    int partial_len;
+    int partial_capacity;
+    uint64_t last_refresh;
+};
+
+//acorn --replay runs a script of keystrokes without a terminal (see editor_replay_load for the format)
+//frames go to an in-memory sink and every key is timed from the moment it's read until the next key is asked for
+struct Replay {
+    const char* script;
+    char* keys;
+    int num_keys;
+    int next_key;
+    int key_open; //a key has been handed out and not measured yet
+    int rows, cols;
+    char* temp_file; //generated for the script, removed on exit
+    double* latency; //per key, in ms (includes the redraw the key caused)
+    unsigned long* allocs; //per key
+    size_t* output; //per key, bytes written to the "terminal"
+    struct timespec start;
+    struct timespec key_time;
+    unsigned long key_allocs;
+    size_t output_bytes;
+    double load_ms;
+    char* frame; //the last frame written
+    int frame_len;
+    int frame_capacity;
+};
+
+//acorn --server keeps the editor (buffers, line indexes, highlight cache) running between sessions, and
+//acorn --client attaches a terminal to it over a unix socket. One client is attached at a time
+struct Server {
+    int running;
+    int listen_fd;
+    int client; //-1 if no client is attached
+    char* keys; //sent by the client and not read yet
+    int num_keys;
+    int next_key;
+    int key_capacity;
+    char* frame; //the last frame the client was sent, to diff the next one against
+    int frame_len;
+};
+
+//messages on the socket are a header and 'len' bytes of payload
+//client to server: 'h' hello (rows, cols and the file to open), 'k' keys, 'r' resize (rows, cols)
+//server to client: 'f' output for the terminal, 'x' exit (status)
+struct ServerMessage {
+    char type;
+    int len;
+};
+
+//an edit in a shared session, made on the buffer's text as one string (rows joined by newlines)
+//'i' inserts 'text' at (row, col) and the text ends at (end_row, end_col). 'd' deletes [(row, col), (end_row, end_col))
+//an edit that loses out to someone else's (an insert into text they deleted) becomes a no-op, kind 0
+struct ShareOp {
+    char kind;
+    int row;
+    int col;
+    int end_row;
+    int end_col;
+    char* text;
+    int len;
+};
+
+struct ShareBatch {
+    struct ShareOp* ops;
+    int count;
+    int capacity;
+};
+
+//a socket with messages (ServerMessage headers) queued both ways, so a big paste never blocks the editor
+struct ShareConnection {
+    int fd;
+    int revision; //on the host: the last revision this guest is known to have
+    char* out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_capacity;
+    char* in;
+    size_t in_len;
+    size_t in_capacity;
+};
+
+//:share hosts a buffer, :join edits it from another acorn. The host puts every batch of edits in one order
+//(its revisions) and guests transform what they haven't had acknowledged yet over whatever came first (Jupiter-style OT)
+//edits are found by diffing the buffer against 'shadow' - the rows (shared, copy-on-write) as of the last batch
+struct Share {
+    char role; //0 when not sharing, 'h' hosting, 'g' a guest
+    struct EditorBuffer* buffer;
+    int listen_fd;
+    char* socket_path; //unlinked when the host stops
+    struct ShareConnection* connections; //a guest only has the host
+    int num_connections;
+    struct RegisterSlice* shadow;
+    int shadow_rows;
+    int shadow_capacity;
+    unsigned int shadow_edits; //buffer->edits when 'shadow' was last brought up to date
+    int revision;
+    uint64_t last_batch;
+    struct ShareBatch* history; //host: the batches since the oldest revision a guest may still build on
+    int history_start;
+    int history_count;
+    struct ShareBatch sent; //guest: sent to the host and not acknowledged yet
+    struct ShareBatch waiting; //guest: found while 'sent' was out
+    int reported; //guest: the last revision the host was told about
 };
 
 struct EditorConfig {
@@ -118,12 +501,86 @@ struct EditorConfig {
     unsigned char mode;
     //int active_buffer;
     struct EditorBuffer* active_buffer;
-    struct EditorBuffer* buffers;
+    struct EditorBuffer** buffers;
     int buffer_count;
+    int buffer_capacity;
+    unsigned long buffer_clock;
+    size_t cache_budget;
+    off_t large_file_size;
+    int wrap; //:set wrap - rows wider than the screen carry on on the next line instead of scrolling sideways
+    struct EditorRegister registers[REGISTER_COUNT];
+    int register_name; //register selected with '"', used by the next yank/put
+    int last_register; //register used by the last yank - 'p' without a name pastes from here
+    struct BlockInsert block_insert;
+    struct HighlightCache hl_cache;
+    unsigned char* draw_hl; //per-column highlights of the row being drawn, grown as needed and kept between frames
+    int draw_hl_capacity;
+    struct Perf perf;
+    struct Trace trace;
+    struct Filter filter;
+    char* queued_keys; //read before the terminal while not NULL
+    int inotify_fd; //-1 if files can't be watched
+    size_t frame_bytes; //append buffer of the last frame
+    size_t prompt_bytes; //buffer of the open prompt
+    int prompting; //a prompt is open - files that change on disk wait for it to close
+    int headless;
+    struct Replay replay;
+    struct Server server;
+    struct Share share;
 };
 
 struct EditorConfig e;
 
+/*** allocations ***/
+//the acorn_bench and acorn_replay builds (ACORN_BENCH) count every malloc so --replay and :mem can report allocations
+//per key. glibc lets a program replace malloc, so the counters are just wrapped around the real allocator.
+//The editor itself isn't built with it - it puts an atomic add in front of every allocation
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define ACORN_SANITIZED //sanitizers bring their own malloc
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define ACORN_SANITIZED
+#endif
+#endif
+
+#if defined(ACORN_BENCH) && defined(__GLIBC__) && !defined(ACORN_SANITIZED)
+#define ACORN_COUNTS_ALLOCS 1
+unsigned long acorn_allocs;
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void __libc_free(void* p);
+
+void* malloc(size_t size) {
+    __atomic_fetch_add(&acorn_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&acorn_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    __atomic_fetch_add(&acorn_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+    __libc_free(p);
+}
+
+unsigned long editor_alloc_count() {
+    return __atomic_load_n(&acorn_allocs, __ATOMIC_RELAXED);
+}
+#else
+#define ACORN_COUNTS_ALLOCS 0
+unsigned long editor_alloc_count() {
+    return 0;
+}
+#endif
+
 /*** filetypes ***/
 char* C_HL_extensions[] =  { ".c", ".h", ".c", NULL };
 char* C_HL_keywords[] = {
@@ -145,6 +602,13 @@ char* PY_HL_keywords[] = {
     "None|", "True|", "False|"
 };
 
+struct Compressor COMPRESSORS[] = {
+    { "gzip", ".gz", "\x1f\x8b", 2, { "gzip", "-dc", NULL }, { "gzip", "-c", NULL } },
+    { "zstd", ".zst", "\x28\xb5\x2f\xfd", 4, { "zstd", "-dcq", NULL }, { "zstd", "-cq", NULL } },
+};
+
+#define COMPRESSOR_ENTRIES (sizeof(COMPRESSORS) / sizeof(COMPRESSORS[0]))
+
 struct EditorSyntax HLDB[] = {
     {
         "c",
@@ -168,11 +632,194 @@ struct EditorSyntax HLDB[] = {
 void editor_set_status_message(const char* fmt, ...);
 void editor_refresh_screen();
 char* editor_prompt(char* prompt, void (*callback)(char*, int));
+void editor_switch_mode(int mode);
+void editor_free_pages(struct EditorBuffer* buffer);
+void editor_idle();
+void editor_process_key(int c);
+void editor_watch_buffer(struct EditorBuffer* buffer);
+void editor_unwatch_buffer(struct EditorBuffer* buffer);
+void editor_record_file(struct EditorBuffer* buffer);
+void editor_follow_update(struct EditorBuffer* buffer);
+struct Compressor* editor_detect_compressor(char* filename);
+struct Compressor* editor_compressor_for_name(char* filename);
+int editor_load_compressed(char* filename, struct Compressor* compressor);
+char* editor_read_compressed(char* filename, struct Compressor* compressor, size_t* len);
+int editor_save_compressed(char* filename, struct Compressor* compressor, int* len);
+void editor_filter_cancel();
+int editor_load_append(struct EditorBuffer* buffer, int count, int wait);
+void editor_load_finish(struct EditorBuffer* buffer);
+void editor_load_close(struct EditorBuffer* buffer);
+int editor_replay_next_key();
+void editor_server_send_frame(const char* frame, int len);
+int editor_server_key(char* c);
+int editor_server_poll();
+int editor_input_fd();
+void editor_server_detach(int status);
+int editor_poll();
+void editor_share(char* address);
+void editor_join(char* address);
+void editor_share_stop();
+void editor_replay_finish();
+
+/*** perf ***/
+//monotonic clock in ns - a vdso call, cheap enough to wrap around every key, frame and highlight pass
+uint64_t perf_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//returns the start time of a span, or 0 if tracing is off (then trace_end does nothing)
+uint64_t trace_begin() {
+    return __atomic_load_n(&e.trace.enabled, __ATOMIC_RELAXED) ? perf_now() : 0;
+}
+
+//'key' is the id of the key the span belongs to
+void trace_span_key(const char* name, uint64_t start, uint64_t end, int key) {
+    static int next_tid = 0;
+    static __thread int tid = 0;
+    if (tid == 0) tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+
+    unsigned long i = __atomic_fetch_add(&e.trace.head, 1, __ATOMIC_RELAXED);
+    struct TraceEvent* event = &e.trace.events[i & (ACORN_TRACE_EVENTS - 1)];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->tid = tid;
+    event->key = key;
+    __atomic_store_n(&event->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+//the span belongs to the key being handled - only the main thread writes e.trace.key, and it does so atomically
+//so highlight and index threads can read it here
+void trace_span(const char* name, uint64_t start, uint64_t end) {
+    trace_span_key(name, start, end, __atomic_load_n(&e.trace.key, __ATOMIC_RELAXED));
+}
+
+void trace_end(const char* name, uint64_t start) {
+    if (start && __atomic_load_n(&e.trace.enabled, __ATOMIC_RELAXED)) trace_span(name, start, perf_now());
+}
+
+void perf_begin(int counter) {
+    if (e.perf.depth[counter]++ == 0) e.perf.start[counter] = perf_now();
+}
+
+void perf_end(int counter) {
+    static const char* names[PERF_COUNTERS] = { "keypress", "highlight", "draw_rows", "write" };
+    if (--e.perf.depth[counter] == 0) {
+        uint64_t now = perf_now();
+        e.perf.current[counter] += now - e.perf.start[counter];
+        if (e.trace.enabled) trace_span(names[counter], e.perf.start[counter], now);
+    }
+}
+
+//files the counters of the key that was just finished and starts on the next one (called when it arrives)
+void perf_end_key() {
+    struct Perf* perf = &e.perf;
+    if (perf->key_open) {
+        int i = perf->keys++ % ACORN_PERF_SAMPLES;
+        for (int c = 0; c < PERF_COUNTERS; c++) perf->samples[c][i] = perf->current[c];
+        perf->bytes[i] = perf->current_bytes;
+        perf->rows[i] = perf->current_rows;
+        perf->allocs[i] = editor_alloc_count() - perf->alloc_base;
+    }
+    perf->alloc_base = editor_alloc_count();
+    for (int c = 0; c < PERF_COUNTERS; c++) perf->current[c] = 0;
+    perf->current_bytes = 0;
+    perf->current_rows = 0;
+    perf->waited = 0;
+    perf->key_open = 1;
+}
+
+void trace_start(const char* path) {
+    struct Trace* trace = &e.trace;
+    if (trace->enabled) return;
+    free(trace->path);
+    trace->path = strdup(path);
+    if (trace->events == NULL) trace->events = malloc(sizeof(struct TraceEvent) * ACORN_TRACE_EVENTS);
+    for (int i = 0; i < ACORN_TRACE_EVENTS; i++) trace->events[i].seq = 0;
+    trace->head = 0;
+    trace->pending = 0;
+    __atomic_store_n(&trace->enabled, 1, __ATOMIC_RELEASE);
+}
+
+//a key has been read - it's timed until the frame that shows it is written
+void trace_key(int c) {
+    struct Trace* trace = &e.trace;
+    __atomic_store_n(&trace->key, trace->key + 1, __ATOMIC_RELAXED);
+    if (!trace->enabled) return;
+    uint64_t now = perf_now();
+    trace_span(c == '\x1b' ? "input ESC" : "input", now, now);
+    if (trace->pending == 0) trace->first_pending = trace->key;
+    if (trace->pending < ACORN_TRACE_PENDING) trace->pending_time[trace->pending++] = now;
+}
+
+//a frame has been written - every key since the last frame gets a key_to_paint span ending here
+void trace_paint() {
+    struct Trace* trace = &e.trace;
+    if (!trace->enabled || trace->pending == 0) return;
+    uint64_t now = perf_now();
+    for (int i = 0; i < trace->pending; i++)
+        trace_span_key("key_to_paint", trace->pending_time[i], now, trace->first_pending + i);
+    trace->pending = 0;
+}
+
+//writes the spans in the ring as chrome trace_event json and stops tracing
+//returns the number of spans written, or -1 if the file couldn't be opened
+int trace_stop() {
+    struct Trace* trace = &e.trace;
+    if (!trace->enabled) return 0;
+    __atomic_store_n(&trace->enabled, 0, __ATOMIC_RELEASE);
+
+    FILE* fp = fopen(trace->path, "w");
+    if (!fp) return -1;
+    unsigned long head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > ACORN_TRACE_EVENTS ? head - ACORN_TRACE_EVENTS : 0;
+    int written = 0;
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (unsigned long i = first; i < head; i++) {
+        struct TraceEvent* event = &trace->events[i & (ACORN_TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != i + 1) continue; //still being written (or overwritten)
+        //key_to_paint spans get their own row so they nest instead of overlapping the work they cover
+        int tid = strcmp(event->name, "key_to_paint") ? event->tid : 0;
+        fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"key\": %d}}",
+                written ? ",\n" : "", event->name, event->duration ? "X" : "i", event->start / 1000.0, event->duration / 1000.0, tid, event->key);
+        written++;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return written;
+}
+
+void trace_stop_at_exit() {
+    trace_stop();
+}
 
 /*** terminal ***/
+//everything meant for the terminal goes through here - without one (--replay) it lands in the frame sink
+void editor_write(const char* s, int len) {
+    if (e.server.running) {
+        editor_server_send_frame(s, len);
+        return;
+    }
+    if (!e.headless) {
+        write(STDOUT_FILENO, s, len);
+        return;
+    }
+    struct Replay* r = &e.replay;
+    if (len > r->frame_capacity) {
+        r->frame_capacity = len;
+        r->frame = realloc(r->frame, r->frame_capacity);
+    }
+    memcpy(r->frame, s, len);
+    r->frame_len = len;
+    r->output_bytes += len;
+}
+
 void die(const char* s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4); //clear screen
-    write(STDOUT_FILENO, "\x1b[H", 3); //reposition cursor to top-left of screen
+    editor_write("\x1b[2J", 4); //clear screen
+    editor_write("\x1b[H", 3); //reposition cursor to top-left of screen
 
     perror(s);
     exit(1);
@@ -204,11 +851,27 @@ void enable_raw_mode() {
 }
 
 int editor_read_key() {
+    //keys queued by ':g/pattern/normal' - a prompt that wants more than were queued gets escape, like vim
+    if (e.queued_keys) return *e.queued_keys ? (unsigned char) *e.queued_keys++ : '\x1b';
+    if (e.headless) return editor_replay_next_key();
+
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+    uint64_t start = perf_now();
+    while (1) {
+        if (e.server.running && editor_server_key(&c)) break;
+        //a running filter and a shared session are pumped until a key comes in
+        if ((e.filter.pid || e.share.role) && !editor_poll()) continue;
+        if (e.server.running) {
+            if (editor_server_poll()) continue;
+        } else if ((nread = read(STDIN_FILENO, &c, 1)) == 1) {
+            break;
+        } else if (nread == -1 && errno != EAGAIN) {
+            die("read");
+        }
+        editor_idle();
     }
+    e.perf.waited += perf_now() - start;
 
     return c;
 }
@@ -246,49 +909,464 @@ int get_window_size(int* rows, int* cols) {
     }
 }
 
+/*** arena ***/
+
+//NOTE: each buffer carves row text and highlight runs out of big chunks instead of malloc'ing them one by one.
+//      Block sizes are rounded up to a size class (4 classes per power of two, so there's spare room to grow into)
+//      and freed blocks go on a free list for their class. Releasing the arena frees every chunk at once.
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define ARENA_CLASSES 56 //largest class is 256KB (ARENA_CHUNK_SIZE) - bigger blocks get a chunk of their own
+
+struct ArenaChunk {
+    struct ArenaChunk* next;
+    struct ArenaChunk* prev; //so an oversized block can unlink its own chunk when it's freed
+    size_t size;
+    size_t used;
+};
+
+struct ArenaFreeBlock {
+    struct ArenaFreeBlock* next;
+};
+
+struct RowArena {
+    int refs;
+    size_t live; //bytes handed out and not freed yet (in whole size classes)
+    size_t reserved; //bytes malloc'd for chunks
+    struct ArenaChunk* chunks;
+    struct ArenaFreeBlock* free_list[ARENA_CLASSES];
+};
+
+#define ARENA_CHUNK_DATA(chunk) ((char*)(chunk) + sizeof(struct ArenaChunk))
+
+//classes go 8, 16, 24, 32, then 40, 48, 56, 64, then 80, 96, 112, 128, ... (all multiples of 8)
+int arena_class(size_t size) {
+    if (size <= 32) return size == 0 ? 0 : (size + 7) / 8 - 1;
+    int k = 0;
+    while (((size_t) 64 << k) < size) k++;
+    return 4 + 4 * k + (size - ((size_t) 32 << k) - 1) / ((size_t) 8 << k);
+}
+
+size_t arena_class_size(int class) {
+    if (class < 4) return (class + 1) * 8;
+    int k = (class - 4) / 4;
+    return ((size_t) 32 << k) + ((class - 4) % 4 + 1) * ((size_t) 8 << k);
+}
+
+struct RowArena* arena_new() {
+    struct RowArena* arena = calloc(1, sizeof(struct RowArena));
+    arena->refs = 1;
+    return arena;
+}
+
+struct RowArena* arena_retain(struct RowArena* arena) {
+    arena->refs++;
+    return arena;
+}
+
+void arena_release(struct RowArena* arena) {
+    if (arena == NULL || --arena->refs > 0) return;
+    struct ArenaChunk* chunk = arena->chunks;
+    while (chunk) {
+        struct ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+//new blocks are bumped out of the chunk at the head of the list, so oversized blocks are linked in behind it
+struct ArenaChunk* arena_add_chunk(struct RowArena* arena, size_t size, int at_head) {
+    struct ArenaChunk* chunk = malloc(sizeof(struct ArenaChunk) + size);
+    chunk->size = size;
+    chunk->used = 0;
+    arena->reserved += sizeof(struct ArenaChunk) + size;
+    struct ArenaChunk** link = (at_head || arena->chunks == NULL) ? &arena->chunks : &arena->chunks->next;
+    chunk->prev = link == &arena->chunks ? NULL : arena->chunks;
+    chunk->next = *link;
+    if (chunk->next) chunk->next->prev = chunk;
+    *link = chunk;
+    return chunk;
+}
+
+//returns a block of at least 'size' bytes - '*usable' (if not NULL) is set to the real size of the block
+void* arena_alloc(struct RowArena* arena, size_t size, size_t* usable) {
+    int class = arena_class(size);
+    if (class >= ARENA_CLASSES) {
+        if (usable) *usable = size;
+        struct ArenaChunk* chunk = arena_add_chunk(arena, size, 0);
+        chunk->used = size;
+        arena->live += size;
+        return ARENA_CHUNK_DATA(chunk);
+    }
+
+    size_t class_size = arena_class_size(class);
+    if (usable) *usable = class_size;
+    arena->live += class_size;
+
+    struct ArenaFreeBlock* block = arena->free_list[class];
+    if (block) {
+        arena->free_list[class] = block->next;
+        return block;
+    }
+
+    struct ArenaChunk* chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < class_size) {
+        chunk = arena_add_chunk(arena, ARENA_CHUNK_SIZE, 1);
+    }
+    void* p = ARENA_CHUNK_DATA(chunk) + chunk->used;
+    chunk->used += class_size;
+    return p;
+}
+
+//'size' is either the size passed to arena_alloc or the usable size it returned
+void arena_free(struct RowArena* arena, void* p, size_t size) {
+    if (p == NULL) return;
+    int class = arena_class(size);
+    if (class >= ARENA_CLASSES) {
+        //an oversized block is the only thing in its chunk, so the chunk header sits right in front of it
+        struct ArenaChunk* chunk = (struct ArenaChunk*) ((char*) p - sizeof(struct ArenaChunk));
+        if (chunk->prev) chunk->prev->next = chunk->next;
+        else arena->chunks = chunk->next;
+        if (chunk->next) chunk->next->prev = chunk->prev;
+        arena->live -= chunk->size;
+        arena->reserved -= sizeof(struct ArenaChunk) + chunk->size;
+        free(chunk);
+        return;
+    }
+
+    arena->live -= arena_class_size(class);
+    struct ArenaFreeBlock* block = p;
+    block->next = arena->free_list[class];
+    arena->free_list[class] = block;
+}
+
+//moves every chunk (and free block) of 'src' into 'dst' and frees 'src'
+//lets a thread fill a private arena and hand the blocks over to a buffer afterwards
+void arena_adopt(struct RowArena* dst, struct RowArena* src) {
+    dst->live += src->live;
+    dst->reserved += src->reserved;
+    if (src->chunks) {
+        struct ArenaChunk* last = src->chunks;
+        while (last->next) last = last->next;
+        struct ArenaChunk** link = dst->chunks ? &dst->chunks->next : &dst->chunks;
+        src->chunks->prev = dst->chunks;
+        last->next = *link;
+        if (last->next) last->next->prev = last;
+        *link = src->chunks;
+    }
+    for (int class = 0; class < ARENA_CLASSES; class++) {
+        while (src->free_list[class]) {
+            struct ArenaFreeBlock* block = src->free_list[class];
+            src->free_list[class] = block->next;
+            block->next = dst->free_list[class];
+            dst->free_list[class] = block;
+        }
+    }
+    free(src);
+}
+
+/*** highlight cache ***/
+
+//NOTE: rows with the same text (blank lines, '}', repeated log prefixes) get the same highlighting, so highlight runs are
+//      interned by (syntax, incoming comment state, hash of the row) and shared by every row (in any buffer) that uses them.
+//      The cache keeps one reference to each entry's runs and drops the least recently used entry when full.
+//      Highlighting threads look up and insert while holding 'lock', but rows only release runs on the main thread
+//      while no highlighting threads are running.
+//      The cache isn't free: every lexed row also pays for a hash, a locked lookup and an insert. A first open of a
+//      file whose rows are mostly distinct gets almost no hits, so it highlights about 20% slower than lexing alone;
+//      the cache pays off on repeated rows, reopened files and re-highlighting after edits.
+
+uint64_t hl_hash(const char* s, int len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t k;
+        memcpy(&k, &s[i], 8);
+        h = (h ^ k) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    uint64_t k = 0;
+    memcpy(&k, &s[i], len - i);
+    h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//stores a per-column highlight array as runs allocated from 'arena' (returns NULL if nothing is highlighted)
+struct HighlightSpan* hl_runs_new(struct RowArena* arena, unsigned char* hl, int render_size, int* count) {
+    int n = 0;
+    for (int i = 0; i < render_size; i++)
+        if (hl[i] != HL_NORMAL && (i == 0 || hl[i] != hl[i - 1])) n++;
+    *count = n;
+    if (n == 0) return NULL;
+
+    struct HighlightRuns* runs = arena_alloc(arena, sizeof(struct HighlightRuns) + sizeof(struct HighlightSpan) * n, NULL);
+    runs->refs = 1;
+    runs->count = n;
+
+    struct HighlightSpan* spans = runs->spans;
+    n = 0;
+    for (int i = 0; i < render_size; i++) {
+        if (hl[i] == HL_NORMAL) continue;
+        if (i == 0 || hl[i] != hl[i - 1]) {
+            spans[n].start = i;
+            spans[n].len = 0;
+            spans[n].hl = hl[i];
+            n++;
+        }
+        spans[n - 1].len++;
+    }
+    return spans;
+}
+
+//runs from 'arena' holding a copy of 'count' spans (eg, read back from a session)
+struct HighlightSpan* hl_runs_copy(struct RowArena* arena, struct HighlightSpan* spans, int count) {
+    if (count == 0) return NULL;
+    struct HighlightRuns* runs = arena_alloc(arena, sizeof(struct HighlightRuns) + sizeof(struct HighlightSpan) * count, NULL);
+    runs->refs = 1;
+    runs->count = count;
+    memcpy(runs->spans, spans, sizeof(struct HighlightSpan) * count);
+    return runs->spans;
+}
+
+void hl_runs_release(struct HighlightSpan* hl) {
+    if (hl == NULL) return;
+    struct HighlightRuns* runs = HL_RUNS(hl);
+    if (--runs->refs > 0) return;
+    arena_free(e.hl_cache.arena, runs, sizeof(struct HighlightRuns) + sizeof(struct HighlightSpan) * runs->count);
+}
+
+uint64_t hl_cache_key(struct EditorSyntax* syntax, int in_comment, uint64_t hash) {
+    uint64_t h = hash ^ ((uintptr_t) syntax * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) in_comment;
+    return h ^ (h >> 29);
+}
+
+void hl_cache_place(int i) {
+    struct HighlightCache* cache = &e.hl_cache;
+    struct HighlightCacheEntry* entry = &cache->entries[i];
+    uint64_t key = hl_cache_key(entry->syntax, entry->in_comment, entry->hash);
+    int mask = cache->num_slots - 1;
+    int slot = key & mask;
+    while (cache->slots[slot].entry != -1) slot = (slot + 1) & mask;
+    cache->slots[slot].tag = key >> 32;
+    cache->slots[slot].entry = i;
+}
+
+//doubles the entries (up to 'capacity') and rehashes them into twice as many slots
+void hl_cache_grow() {
+    struct HighlightCache* cache = &e.hl_cache;
+    cache->allocated = cache->allocated ? cache->allocated * 2 : 1024;
+    if (cache->allocated > cache->capacity) cache->allocated = cache->capacity;
+    cache->entries = realloc(cache->entries, sizeof(struct HighlightCacheEntry) * cache->allocated);
+
+    while (cache->num_slots < cache->allocated * 2) cache->num_slots = cache->num_slots ? cache->num_slots * 2 : 1;
+    free(cache->slots);
+    cache->slots = malloc(sizeof(struct HighlightCacheSlot) * cache->num_slots);
+    for (int i = 0; i < cache->num_slots; i++) cache->slots[i].entry = -1;
+    for (int i = 0; i < cache->count; i++) hl_cache_place(i);
+}
+
+//drops every entry and sets a new capacity (rows keep the runs they're using)
+void hl_cache_resize(int capacity) {
+    struct HighlightCache* cache = &e.hl_cache;
+    for (int i = 0; i < cache->count; i++) hl_runs_release(cache->entries[i].hl);
+    free(cache->entries);
+    free(cache->slots);
+
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->entries = NULL;
+    cache->slots = NULL;
+    cache->num_slots = 0;
+    cache->allocated = 0;
+    cache->count = 0;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+}
+
+void hl_cache_init(int capacity) {
+    struct HighlightCache* cache = &e.hl_cache;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->arena = arena_new();
+    cache->entries = NULL;
+    cache->slots = NULL;
+    cache->count = 0;
+    hl_cache_resize(capacity);
+}
+
+void hl_cache_unlink_lru(int i) {
+    struct HighlightCache* cache = &e.hl_cache;
+    struct HighlightCacheEntry* entry = &cache->entries[i];
+    if (entry->lru_prev != -1) cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next != -1) cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+}
+
+void hl_cache_push_lru(int i) {
+    struct HighlightCache* cache = &e.hl_cache;
+    cache->entries[i].lru_prev = -1;
+    cache->entries[i].lru_next = cache->lru_head;
+    if (cache->lru_head != -1) cache->entries[cache->lru_head].lru_prev = i;
+    cache->lru_head = i;
+    if (cache->lru_tail == -1) cache->lru_tail = i;
+}
+
+//returns the slot holding the key, or the empty slot it would go in - must hold the lock
+int hl_cache_find(struct EditorSyntax* syntax, int in_comment, uint64_t hash, int len) {
+    struct HighlightCache* cache = &e.hl_cache;
+    uint64_t key = hl_cache_key(syntax, in_comment, hash);
+    uint32_t tag = key >> 32;
+    int mask = cache->num_slots - 1;
+    int slot = key & mask;
+    while (cache->slots[slot].entry != -1) {
+        if (cache->slots[slot].tag == tag) {
+            struct HighlightCacheEntry* entry = &cache->entries[cache->slots[slot].entry];
+            if (entry->hash == hash && entry->syntax == syntax && entry->in_comment == in_comment && entry->len == len) return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+//empties a slot, then shifts back later slots of the same probe run so lookups don't stop early
+void hl_cache_remove_slot(int slot) {
+    struct HighlightCache* cache = &e.hl_cache;
+    int mask = cache->num_slots - 1;
+    int next = slot;
+    cache->slots[slot].entry = -1;
+    while (1) {
+        next = (next + 1) & mask;
+        if (cache->slots[next].entry == -1) return;
+        struct HighlightCacheEntry* entry = &cache->entries[cache->slots[next].entry];
+        int home = hl_cache_key(entry->syntax, entry->in_comment, entry->hash) & mask;
+        //move it into the hole unless its home is cyclically within (slot, next]
+        if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+            cache->slots[slot] = cache->slots[next];
+            cache->slots[next].entry = -1;
+            slot = next;
+        }
+    }
+}
+
+//on a hit, 'hl' gets a new reference to the shared runs
+int hl_cache_lookup(struct EditorSyntax* syntax, int in_comment, uint64_t hash, int len, struct HighlightSpan** hl, int* hl_count, int* open_comment) {
+    struct HighlightCache* cache = &e.hl_cache;
+    pthread_mutex_lock(&cache->lock);
+    int i = cache->count ? cache->slots[hl_cache_find(syntax, in_comment, hash, len)].entry : -1;
+    if (i != -1) {
+        struct HighlightCacheEntry* entry = &cache->entries[i];
+        *hl = entry->hl;
+        *hl_count = entry->hl_count;
+        *open_comment = entry->open_comment;
+        if (entry->hl) HL_RUNS(entry->hl)->refs++;
+        hl_cache_unlink_lru(i);
+        hl_cache_push_lru(i);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return i != -1;
+}
+
+//'can_evict' is 0 on highlight threads: while they run, entries may point into arenas that haven't been
+//adopted yet, and freeing those runs would put another arena's blocks on the cache arena's free list
+//so a full cache only takes new entries on the main thread, once every chunk arena has been adopted
+void hl_cache_insert(struct EditorSyntax* syntax, int in_comment, uint64_t hash, int len, struct HighlightSpan* hl, int hl_count, int open_comment, int can_evict) {
+    struct HighlightCache* cache = &e.hl_cache;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->count == cache->allocated && cache->allocated < cache->capacity) hl_cache_grow();
+    if (cache->slots[hl_cache_find(syntax, in_comment, hash, len)].entry != -1 || //another thread got here first
+        (cache->count == cache->allocated && !can_evict)) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    int i;
+    if (cache->count < cache->allocated) {
+        i = cache->count++;
+    } else {
+        //reuse the least recently used entry
+        i = cache->lru_tail;
+        struct HighlightCacheEntry* old = &cache->entries[i];
+        hl_cache_remove_slot(hl_cache_find(old->syntax, old->in_comment, old->hash, old->len));
+        hl_cache_unlink_lru(i);
+        hl_runs_release(old->hl);
+    }
+
+    struct HighlightCacheEntry* entry = &cache->entries[i];
+    entry->hash = hash;
+    entry->syntax = syntax;
+    entry->len = len;
+    entry->in_comment = in_comment;
+    entry->open_comment = open_comment;
+    entry->hl = hl;
+    entry->hl_count = hl_count;
+    if (hl) HL_RUNS(hl)->refs++;
+
+    hl_cache_place(i);
+    hl_cache_push_lru(i);
+    pthread_mutex_unlock(&cache->lock);
+}
+
 /*** syntax highlighting ***/
 int is_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:", c) != NULL;
 }
 
-void editor_update_syntax(struct EditorRow* row) {
-    row->hl = realloc(row->hl, row->render_size);
-    memset(row->hl, HL_NORMAL, row->render_size);
+void editor_row_release_hl(struct EditorRow* row) {
+    hl_runs_release(row->hl);
+    row->hl = NULL;
+    row->hl_count = 0;
+}
+
+//fills 'hl' with the highlight of render columns [start, start + len)
+void editor_row_expand_hl(struct EditorRow* row, int start, int len, unsigned char* hl) {
+    memset(hl, HL_NORMAL, len);
+    for (int i = 0; i < row->hl_count; i++) {
+        int from = row->hl[i].start > start ? row->hl[i].start : start;
+        int to = row->hl[i].start + row->hl[i].len < start + len ? row->hl[i].start + row->hl[i].len : start + len;
+        if (from < to) memset(&hl[from - start], row->hl[i].hl, to - from);
+    }
+}
 
-    if (e.active_buffer->syntax == NULL) return;
+//fills 'hl' (at least render_size long) with the highlight of each render column and returns the open comment state at the end of the row
+//'in_comment' is the open comment state of the row above. Only reads 'syntax' and 'row', so it's safe to call from any thread
+int editor_lex_row(struct EditorSyntax* syntax, struct EditorRow* row, int in_comment, unsigned char* hl) {
+    memset(hl, HL_NORMAL, row->render_size);
+    if (syntax == NULL) return 0;
 
-    char** keywords = e.active_buffer->syntax->keywords;
+    char** keywords = syntax->keywords;
 
     //check if comment characters were set in EditorSyntax
-    char* scs = e.active_buffer->syntax->singleline_comment_start;
-    char* mcs = e.active_buffer->syntax->multiline_comment_start;
-    char* mce = e.active_buffer->syntax->multiline_comment_end;
+    char* scs = syntax->singleline_comment_start;
+    char* mcs = syntax->multiline_comment_start;
+    char* mce = syntax->multiline_comment_end;
 
     int scs_len = scs ? strlen(scs) : 0;
     int mcs_len = mcs ? strlen(mcs) : 0;
     int mce_len = mce ? strlen(mce) : 0;
 
+    char* render = ROW_RENDER(row);
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->idx > 0 && e.active_buffer->row[row->idx - 1].hl_open_comment);
 
     int i = 0;
     while (i < row->render_size) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        char c = render[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
         if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->render_size - i);
+            if (!strncmp(&render[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, row->render_size - i);
                 break;
             }
         }
 
         if (mcs_len && mce_len && !in_string) {
             if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                hl[i] = HL_MLCOMMENT;
+                if (!strncmp(&render[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -297,19 +1375,19 @@ void editor_update_syntax(struct EditorRow* row) {
                     i++;
                     continue;
                 }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+            } else if (!strncmp(&render[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
             }
         }
 
-        if (e.active_buffer->syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (in_string) {
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 if (c == '\\' && i + 1 < row->render_size) {
-                    row->hl[i + 1] = HL_STRING;
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -320,17 +1398,17 @@ void editor_update_syntax(struct EditorRow* row) {
             } else {
                 if (c == '"' || c == '\'') {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
             }
         }
 
-        if (e.active_buffer->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
             if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
                    (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = 0; //0 means we are currently highlighting a number
                 continue;
@@ -344,9 +1422,9 @@ void editor_update_syntax(struct EditorRow* row) {
                 int kw2 = keywords[j][klen - 1] == '|';
                 if (kw2) klen--;
 
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                        is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                if (!strncmp(&render[i], keywords[j], klen) &&
+                        is_separator(render[i + klen])) {
+                    memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
                     i += klen;
                     break;
                 }
@@ -363,10 +1441,135 @@ void editor_update_syntax(struct EditorRow* row) {
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < e.active_buffer->num_rows)
-        editor_update_syntax(&e.active_buffer->row[row->idx + 1]);
+    return in_comment;
+}
+
+//takes the row's highlighting from the cache, or lexes it into new runs from 'arena' (and caches those)
+//sets row->hl without releasing the old runs, and returns the open comment state at the end of the row
+//'hl' is the caller's scratch column buffer, so this can run on any thread
+//(anything but the cache arena is taken to be a highlight thread's private arena)
+int editor_highlight_cached(struct EditorSyntax* syntax, struct EditorRow* row, int in_comment, struct RowArena* arena, unsigned char** hl, int* hl_capacity) {
+    uint64_t hash = hl_hash(row->chars, row->size);
+    int open_comment;
+    if (hl_cache_lookup(syntax, in_comment, hash, row->size, &row->hl, &row->hl_count, &open_comment)) return open_comment;
+
+    if (row->render_size + 1 > *hl_capacity) {
+        *hl_capacity = row->render_size + 1;
+        *hl = realloc(*hl, *hl_capacity);
+    }
+    open_comment = editor_lex_row(syntax, row, in_comment, *hl);
+    row->hl = hl_runs_new(arena, *hl, row->render_size, &row->hl_count);
+    hl_cache_insert(syntax, in_comment, hash, row->size, row->hl, row->hl_count, open_comment, arena == e.hl_cache.arena);
+    return open_comment;
+}
+
+//highlights a single row of 'buffer' and returns 1 if its open comment state changed (so the next row needs it too)
+int editor_highlight_row(struct EditorBuffer* buffer, struct EditorRow* row, int in_comment) {
+    static unsigned char* hl = NULL;
+    static int hl_capacity = 0;
+    e.perf.current_rows++;
+
+    struct HighlightSpan* old_hl = row->hl;
+    int open_comment = editor_highlight_cached(buffer->syntax, row, in_comment, e.hl_cache.arena, &hl, &hl_capacity);
+    hl_runs_release(old_hl);
+
+    int changed = (row->hl_open_comment != open_comment);
+    row->hl_open_comment = open_comment;
+    return changed;
+}
+
+int editor_prev_open_comment(struct EditorBuffer* buffer, struct EditorRow* row) {
+    return row > buffer->row ? row[-1].hl_open_comment : 0;
+}
+
+//'in_comment' is the open comment state coming into 'row'
+void editor_update_syntax(struct EditorBuffer* buffer, struct EditorRow* row, int in_comment) {
+    //keep going while the comment state changes (eg, typing '/*' re-highlights everything after it)
+    perf_begin(PERF_SYNTAX);
+    struct EditorRow* end = &buffer->row[buffer->num_rows];
+    while (editor_highlight_row(buffer, row, in_comment) && row + 1 < end) {
+        in_comment = row->hl_open_comment;
+        row++;
+    }
+    perf_end(PERF_SYNTAX);
+}
+
+struct HighlightChunk {
+    struct EditorSyntax* syntax;
+    struct EditorRow* row;
+    int num_rows;
+    struct RowArena* arena;
+};
+
+//highlights a chunk of rows into a private arena, guessing that the chunk doesn't start inside a comment
+void* editor_highlight_chunk(void* arg) {
+    struct HighlightChunk* chunk = arg;
+    uint64_t trace = trace_begin();
+    unsigned char* hl = NULL;
+    int hl_capacity = 0;
+    int in_comment = 0;
+    for (int j = 0; j < chunk->num_rows; j++) {
+        struct EditorRow* row = &chunk->row[j];
+        in_comment = editor_highlight_cached(chunk->syntax, row, in_comment, chunk->arena, &hl, &hl_capacity);
+        row->hl_open_comment = in_comment;
+    }
+    free(hl);
+    trace_end("highlight_chunk", trace);
+    return NULL;
+}
+
+//highlights rows [start, end) of 'buffer' on all cores
+//each chunk is highlighted as if it doesn't start inside a comment, then chunks that guessed wrong are
+//re-highlighted from the top until their rows agree with the guess again (usually after a few rows)
+void editor_highlight_rows(struct EditorBuffer* buffer, int start, int end) {
+    if (start >= end) return;
+    perf_begin(PERF_SYNTAX);
+    int in_comment = start > 0 ? buffer->row[start - 1].hl_open_comment : 0;
+    int old_open_comment = buffer->row[end - 1].hl_open_comment;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_chunks = (end - start) / ACORN_HIGHLIGHT_CHUNK + 1;
+    if (num_chunks > cpus) num_chunks = cpus > 0 ? cpus : 1;
+    if (num_chunks > ACORN_LOAD_THREADS) num_chunks = ACORN_LOAD_THREADS;
+
+    if (num_chunks == 1) {
+        for (int j = start; j < end; j++) {
+            editor_highlight_row(buffer, &buffer->row[j], in_comment);
+            in_comment = buffer->row[j].hl_open_comment;
+        }
+    } else {
+        //old runs are released first - the threads only allocate new runs from their own arenas
+        for (int j = start; j < end; j++)
+            editor_row_release_hl(&buffer->row[j]);
+
+        struct HighlightChunk chunks[ACORN_LOAD_THREADS];
+        pthread_t threads[ACORN_LOAD_THREADS];
+        for (int i = 0; i < num_chunks; i++) {
+            int from = start + (long long) (end - start) * i / num_chunks;
+            int to = start + (long long) (end - start) * (i + 1) / num_chunks;
+            chunks[i] = (struct HighlightChunk) { buffer->syntax, &buffer->row[from], to - from, arena_new() };
+            if (i > 0 && pthread_create(&threads[i], NULL, editor_highlight_chunk, &chunks[i]) != 0) die("pthread_create");
+        }
+        editor_highlight_chunk(&chunks[0]);
+        for (int i = 1; i < num_chunks; i++) pthread_join(threads[i], NULL);
+        e.perf.current_rows += end - start;
+
+        for (int i = 0; i < num_chunks; i++) {
+            arena_adopt(e.hl_cache.arena, chunks[i].arena);
+            if (in_comment) { //guessed wrong
+                for (int j = 0; j < chunks[i].num_rows; j++) {
+                    int changed = editor_highlight_row(buffer, &chunks[i].row[j], in_comment);
+                    in_comment = chunks[i].row[j].hl_open_comment;
+                    if (!changed) break; //back in step with the guess, so the rest of the chunk is right
+                }
+            }
+            in_comment = chunks[i].row[chunks[i].num_rows - 1].hl_open_comment;
+        }
+    }
+
+    if (in_comment != old_open_comment && end < buffer->num_rows)
+        editor_update_syntax(buffer, &buffer->row[end], in_comment);
+    perf_end(PERF_SYNTAX);
 }
 
 int editor_syntax_to_color(int hl) {
@@ -399,6 +1602,18 @@ void editor_select_syntax_highlight() {
 
     char* ext = strrchr(e.active_buffer->filename, '.');
 
+    //foo.c.gz is highlighted as C
+    char uncompressed_ext[32];
+    if (ext && e.active_buffer->compressor && !strcmp(ext, e.active_buffer->compressor->extension)) {
+        char* inner = ext;
+        while (inner > e.active_buffer->filename && inner[-1] != '.' && inner[-1] != '/') inner--;
+        int len = ext - inner + 1;
+        if (inner > e.active_buffer->filename && inner[-1] == '.' && len < (int) sizeof(uncompressed_ext)) {
+            snprintf(uncompressed_ext, len + 1, ".%s", inner);
+            ext = uncompressed_ext;
+        }
+    }
+
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
         struct EditorSyntax* s = &HLDB[j];
         unsigned int i = 0;
@@ -409,10 +1624,8 @@ void editor_select_syntax_highlight() {
                 e.active_buffer->syntax = s;
 
                 //highlight current file for when user saves as an extension
-                int filerow;
-                for (filerow = 0; filerow < e.active_buffer->num_rows; filerow++) {
-                    editor_update_syntax(&e.active_buffer->row[filerow]);
-                }
+                if (e.active_buffer->paged) editor_free_pages(e.active_buffer); //pages get highlighted as they're read back in
+                else editor_highlight_rows(e.active_buffer, 0, e.active_buffer->num_rows);
 
                 return;
             }
@@ -421,129 +1634,623 @@ void editor_select_syntax_highlight() {
     }
 }
 
+/*** row text ***/
 
-/*** row operations ***/
-int editor_row_cursor_x_to_render_x(struct EditorRow* row, int cursor_x) {
-    int render_x = 0;
-    int j;
-    for (j = 0; j < cursor_x; j++) {
-        if (row->chars[j] == '\t')
-            render_x += (ACORN_TAB_STOP - 1) - (render_x % ACORN_TAB_STOP);
-        render_x++;
-    }
+//NOTE: row chars live in refcounted blocks so registers can share them with the buffer.
+//      Anything that writes to row->chars must go through row_text_make_writable first (copy on write)
+struct RowText {
+    int refs;
+    int capacity;
+    char chars[];
+};
 
-    return render_x;
+#define ROW_TEXT(c) ((struct RowText*)((c) - offsetof(struct RowText, chars)))
+
+//text is allocated from the buffer's arena, and gets whatever spare room its size class has
+char* row_text_new(struct RowArena* arena, const char* s, int len, int capacity) {
+    if (capacity < len + 1) capacity = len + 1;
+    size_t usable;
+    struct RowText* text = arena_alloc(arena, sizeof(struct RowText) + capacity, &usable);
+    text->refs = 1;
+    text->capacity = usable - sizeof(struct RowText);
+    if (len > 0) memcpy(text->chars, s, len);
+    text->chars[len] = '\0';
+    return text->chars;
 }
 
-int editor_row_render_x_to_cursor_x(struct EditorRow* row, int render_x) {
-    int current_render_x = 0;
-    int cursor_x;
-    for (cursor_x = 0; cursor_x < row->size; cursor_x++) {
-        if (row->chars[cursor_x] == '\t')
-            current_render_x += (ACORN_TAB_STOP - 1) - (current_render_x % ACORN_TAB_STOP);
-        current_render_x++;
+char* row_text_retain(char* chars) {
+    ROW_TEXT(chars)->refs++;
+    return chars;
+}
 
-        if (current_render_x > render_x) return cursor_x;
-    }
+void row_text_release(struct RowArena* arena, char* chars) {
+    if (chars == NULL) return;
+    struct RowText* text = ROW_TEXT(chars);
+    if (--text->refs == 0) arena_free(arena, text, sizeof(struct RowText) + text->capacity);
+}
+
+//returns text with room for 'capacity' bytes that isn't shared with anyone else
+char* row_text_make_writable(struct RowArena* arena, char* chars, int size, int capacity) {
+    struct RowText* text = ROW_TEXT(chars);
+    if (text->refs == 1 && text->capacity >= capacity) return chars;
+
+    char* copy = row_text_new(arena, chars, size, capacity);
+    row_text_release(arena, chars);
+    return copy;
+}
+
+/*** utf-8 ***/
+
+//length of the leading run of ASCII bytes - checks 16 bytes at a time with SSE2, or 8 at a time in a 64-bit word
+int utf8_ascii_prefix(const char* s, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) &s[i]));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, &s[i], 8);
+        if (word & 0x8080808080808080ULL) break;
+    }
+    while (i < len && (unsigned char) s[i] < 0x80) i++;
+    return i;
+}
+
+//decodes the code point at 's' and returns its length in bytes
+//invalid sequences (stray continuation bytes, overlong forms, surrogates, cut off at 'len') come back as one byte with '*cp' set to -1
+int utf8_decode(const char* s, int len, int* cp) {
+    unsigned char c = s[0];
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+
+    int n, min, v;
+    if ((c & 0xe0) == 0xc0) { n = 2; min = 0x80; v = c & 0x1f; }
+    else if ((c & 0xf0) == 0xe0) { n = 3; min = 0x800; v = c & 0x0f; }
+    else if ((c & 0xf8) == 0xf0) { n = 4; min = 0x10000; v = c & 0x07; }
+    else { *cp = -1; return 1; }
+
+    if (n > len) { *cp = -1; return 1; }
+    for (int i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) { *cp = -1; return 1; }
+        v = (v << 6) | (s[i] & 0x3f);
+    }
+    if (v < min || v > 0x10ffff || (v >= 0xd800 && v <= 0xdfff)) { *cp = -1; return 1; }
+    *cp = v;
+    return n;
+}
+
+//screen columns taken by a code point - invalid bytes (-1) and control characters are drawn as one inverted symbol
+int utf8_width(int cp) {
+    if (cp < 0x300) return 1;
+
+    //combining marks and zero width characters
+    if ((cp <= 0x36f) || (cp >= 0x1ab0 && cp <= 0x1aff) || (cp >= 0x1dc0 && cp <= 0x1dff) ||
+            (cp >= 0x200b && cp <= 0x200f) || (cp >= 0x20d0 && cp <= 0x20ff) ||
+            (cp >= 0xfe00 && cp <= 0xfe0f) || (cp >= 0xfe20 && cp <= 0xfe2f)) return 0;
+
+    //east asian wide and fullwidth ranges (CJK, hangul, fullwidth forms, emoji)
+    if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0x303e) || (cp >= 0x3041 && cp <= 0x33ff) ||
+            (cp >= 0x3400 && cp <= 0x4dbf) || (cp >= 0x4e00 && cp <= 0x9fff) || (cp >= 0xa000 && cp <= 0xa4cf) ||
+            (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) || (cp >= 0xfe30 && cp <= 0xfe4f) ||
+            (cp >= 0xff00 && cp <= 0xff60) || (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x1f300 && cp <= 0x1f64f) ||
+            (cp >= 0x1f900 && cp <= 0x1f9ff) || (cp >= 0x20000 && cp <= 0x3fffd)) return 2;
+
+    return 1;
+}
+
+//moves 'x' back to the first byte of the code point it's in
+int utf8_char_start(const char* s, int x) {
+    int start = x;
+    while (start > 0 && x - start < 3 && ((unsigned char) s[start] & 0xc0) == 0x80) start--;
+    int cp;
+    return utf8_decode(&s[start], x - start + 4, &cp) > x - start ? start : x; //stray continuation bytes stand alone
+}
+
+//bytes in the code point starting at 'x' (one for invalid bytes)
+int utf8_char_len(const char* s, int len, int x) {
+    int cp;
+    return x < len ? utf8_decode(&s[x], len - x, &cp) : 1;
+}
+
+/*** soft wrap ***/
+//:set wrap carries rows that are wider than the screen on over the next screen lines. Every row knows how many lines
+//it takes (wrap_lines), and a Fenwick tree over those counts gives the screen line of any row (or the row on any screen
+//line) in O(log n), so scrolling and G cost the same in a million rows as in a hundred. A row that changes updates the
+//tree in place. Inserted or deleted rows only mark where the tree went stale, and it's rebuilt from there the next
+//time it's used (moving the row array cost that much already). A different screen width rebuilds it from scratch.
+//Large (paged) files don't wrap, their rows aren't all in memory to be counted.
+
+int editor_wrapping(struct EditorBuffer* buffer) {
+    return e.wrap && buffer->paged == NULL;
+}
+
+//screen line of the row that render column 'rx' is on, and the column that line starts at
+//a wide character that doesn't fit at the end of a line goes on the next one
+int editor_wrap_segment(struct EditorRow* row, int cols, int rx, int* start) {
+    if (row->width == row->render_size) { //every byte is one column
+        *start = rx / cols * cols;
+        return rx / cols;
+    }
+    char* render = ROW_RENDER(row);
+    int line = 0;
+    int line_start = 0;
+    int column = 0;
+    for (int j = 0; j < row->render_size; ) {
+        int cp;
+        j += utf8_decode(&render[j], row->render_size - j, &cp);
+        int width = utf8_width(cp);
+        if (column + width - line_start > cols && column > line_start) {
+            line++;
+            line_start = column;
+        }
+        if (column + width > rx) break;
+        column += width;
+    }
+    *start = line_start;
+    return line;
+}
+
+//render column that screen line 'line' of the row starts at
+int editor_wrap_line_start(struct EditorRow* row, int cols, int line) {
+    if (line <= 0) return 0;
+    if (row->width == row->render_size) return line * cols;
+    char* render = ROW_RENDER(row);
+    int n = 0;
+    int line_start = 0;
+    int column = 0;
+    for (int j = 0; j < row->render_size; ) {
+        int cp;
+        j += utf8_decode(&render[j], row->render_size - j, &cp);
+        int width = utf8_width(cp);
+        if (column + width - line_start > cols && column > line_start) {
+            if (++n == line) return column;
+            line_start = column;
+        }
+        column += width;
+    }
+    return line_start;
+}
+
+int editor_row_wrap_lines(struct EditorRow* row, int cols) {
+    if (row->width == row->render_size) return row->width > 0 ? (row->width - 1) / cols + 1 : 1;
+    int start;
+    return editor_wrap_segment(row, cols, INT_MAX, &start) + 1;
+}
+
+void wrap_add(struct WrapIndex* wrap, int at, int delta) {
+    for (int i = at + 1; i <= wrap->num_rows; i += i & -i) wrap->tree[i] += delta;
+}
+
+//screen lines taken by rows [0, at)
+int wrap_prefix(struct WrapIndex* wrap, int at) {
+    int lines = 0;
+    for (int i = at; i > 0; i -= i & -i) lines += wrap->tree[i];
+    return lines;
+}
+
+//row that screen line 'line' (counted from the first row) is on - 'offset' gets the line within that row
+//returns num_rows if the line is past the last row
+int wrap_find(struct WrapIndex* wrap, int line, int* offset) {
+    int at = 0;
+    int step = 1;
+    while (step * 2 <= wrap->num_rows) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (at + step <= wrap->num_rows && wrap->tree[at + step] <= line) {
+            at += step;
+            line -= wrap->tree[at];
+        }
+    }
+    *offset = line;
+    return at;
+}
+
+//rows from 'at' on were inserted, deleted or moved
+void editor_wrap_moved(struct EditorBuffer* buffer, int at) {
+    if (at < buffer->wrap.stale_from) buffer->wrap.stale_from = at;
+}
+
+//counts the lines of a row that was just rendered and updates the tree by the difference
+void editor_wrap_row_changed(struct EditorBuffer* buffer, struct EditorRow* row) {
+    struct WrapIndex* wrap = &buffer->wrap;
+    if (wrap->cols == 0 || buffer->paged) return;
+    if ((uintptr_t) row < (uintptr_t) buffer->row || (uintptr_t) row >= (uintptr_t) &buffer->row[buffer->num_rows]) return;
+
+    int lines = editor_row_wrap_lines(row, wrap->cols);
+    int at = row - buffer->row;
+    if (lines == row->wrap_lines) return;
+    if (at < wrap->stale_from && at < wrap->num_rows) wrap_add(wrap, at, lines - row->wrap_lines);
+    row->wrap_lines = lines;
+}
+
+//brings the tree up to date with the rows and the screen width (nothing to do unless rows moved or the screen resized)
+struct WrapIndex* editor_wrap_sync(struct EditorBuffer* buffer) {
+    struct WrapIndex* wrap = &buffer->wrap;
+    int cols = e.screencols > 0 ? e.screencols : 1;
+    if (wrap->cols != cols) {
+        for (int j = 0; j < buffer->num_rows; j++) buffer->row[j].wrap_lines = editor_row_wrap_lines(&buffer->row[j], cols);
+        wrap->cols = cols;
+        wrap->stale_from = 0;
+    }
+    if (wrap->num_rows != buffer->num_rows) {
+        if (buffer->num_rows + 1 > wrap->capacity) {
+            wrap->capacity = buffer->num_rows + 1 > wrap->capacity * 2 ? buffer->num_rows + 1 : wrap->capacity * 2;
+            wrap->tree = realloc(wrap->tree, sizeof(int) * wrap->capacity);
+        }
+        if (wrap->stale_from > wrap->num_rows) wrap->stale_from = wrap->num_rows;
+        wrap->num_rows = buffer->num_rows;
+    }
+    if (wrap->stale_from > wrap->num_rows) wrap->stale_from = wrap->num_rows;
+
+    //node i covers rows up to i, so the nodes before the first stale row are still right
+    for (int i = wrap->stale_from + 1; i <= wrap->num_rows; i++) {
+        wrap->tree[i] = buffer->row[i - 1].wrap_lines;
+        for (int child = i - 1; child > i - (i & -i); child -= child & -child) wrap->tree[i] += wrap->tree[child];
+    }
+    wrap->stale_from = wrap->num_rows;
+    return wrap;
+}
+
+//row a screen further up (direction -1) or down (1) than the top of the screen, counted in screen lines
+int editor_wrap_page(struct EditorBuffer* buffer, int direction) {
+    struct WrapIndex* wrap = editor_wrap_sync(buffer);
+    int top = wrap_prefix(wrap, buffer->row_offset) + buffer->wrap_offset;
+    int line = direction < 0 ? top - e.screenrows : top + 2 * e.screenrows - 1;
+    int offset;
+    int y = wrap_find(wrap, line > 0 ? line : 0, &offset);
+    return y < buffer->num_rows ? y : buffer->num_rows - 1;
+}
+
+void editor_wrap_free(struct EditorBuffer* buffer) {
+    free(buffer->wrap.tree);
+    buffer->wrap = (struct WrapIndex) { NULL, 0, 0, 0, 0 };
+    buffer->wrap_offset = 0;
+}
+
+//screen line of the cursor (counted from the first row) and its column on that line
+void editor_wrap_cursor(struct EditorBuffer* buffer, int* line, int* column) {
+    struct WrapIndex* wrap = &buffer->wrap;
+    *line = wrap_prefix(wrap, buffer->cursor_y < buffer->num_rows ? buffer->cursor_y : buffer->num_rows);
+    *column = buffer->render_x;
+    if (buffer->cursor_y >= buffer->num_rows) return;
+
+    struct EditorRow* row = &buffer->row[buffer->cursor_y];
+    int start;
+    int segment = editor_wrap_segment(row, wrap->cols, buffer->render_x, &start);
+    if (segment >= row->wrap_lines) { //just past the end of a row that fills its last line
+        segment = row->wrap_lines - 1;
+        start = editor_wrap_line_start(row, wrap->cols, segment);
+    }
+    *line += segment;
+    *column = buffer->render_x - start < wrap->cols ? buffer->render_x - start : wrap->cols - 1;
+}
+
+/*** row operations ***/
+//screen column where the code point at 'cursor_x' starts
+int editor_row_cursor_x_to_render_x(struct EditorRow* row, int cursor_x) {
+    if (row->render == NULL && row->width == row->render_size) return cursor_x; //every byte is one column
+
+    int render_x = 0;
+    int j = 0;
+    while (j < cursor_x) {
+        int cp;
+        int n = utf8_decode(&row->chars[j], row->size - j, &cp);
+        if (cp == '\t') render_x += ACORN_TAB_STOP - (render_x % ACORN_TAB_STOP);
+        else render_x += utf8_width(cp);
+        j += n;
+    }
+
+    return render_x;
+}
+
+//code point covering screen column 'render_x'
+int editor_row_render_x_to_cursor_x(struct EditorRow* row, int render_x) {
+    if (row->render == NULL && row->width == row->render_size) return render_x < row->size ? render_x : row->size;
+
+    int current_render_x = 0;
+    int cursor_x = 0;
+    while (cursor_x < row->size) {
+        int cp;
+        int n = utf8_decode(&row->chars[cursor_x], row->size - cursor_x, &cp);
+        if (cp == '\t') current_render_x += ACORN_TAB_STOP - (current_render_x % ACORN_TAB_STOP);
+        else current_render_x += utf8_width(cp);
+
+        if (current_render_x > render_x) return cursor_x;
+        cursor_x += n;
+    }
 
     return cursor_x;
 }
 
-void editor_update_row(struct EditorRow* row) {
-    //count tabs
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
+//byte offset in render of the char at 'cursor_x' (only tabs make them differ)
+int editor_row_cursor_x_to_render_offset(struct EditorRow* row, int cursor_x) {
+    if (row->render == NULL) return cursor_x;
+
+    int offset = 0;
+    int column = 0;
+    for (int j = 0; j < cursor_x; ) {
+        int cp;
+        int n = utf8_decode(&row->chars[j], row->size - j, &cp);
+        int spaces = ACORN_TAB_STOP - (column % ACORN_TAB_STOP);
+        offset += cp == '\t' ? spaces : n;
+        column += cp == '\t' ? spaces : utf8_width(cp);
+        j += n;
+    }
+    return offset;
+}
+
+//char in chars that the byte at 'offset' in render came from
+int editor_row_render_offset_to_cursor_x(struct EditorRow* row, int offset) {
+    if (row->render == NULL) return offset < row->size ? offset : row->size;
+
+    int current = 0;
+    int column = 0;
+    int cursor_x = 0;
+    while (cursor_x < row->size) {
+        int cp;
+        int n = utf8_decode(&row->chars[cursor_x], row->size - cursor_x, &cp);
+        int spaces = ACORN_TAB_STOP - (column % ACORN_TAB_STOP);
+        current += cp == '\t' ? spaces : n;
+        if (current > offset) return cursor_x;
+        column += cp == '\t' ? spaces : utf8_width(cp);
+        cursor_x += n;
+    }
+    return cursor_x;
+}
+
+void editor_render_row(struct EditorRow* row) {
+    if (row->render) arena_free(e.active_buffer->derived_arena, row->render, row->render_size + 1);
+    row->render = NULL;
+    row->render_size = row->size;
+    row->width = row->size;
+
+    //ASCII rows without tabs (nearly all of them in source code) don't need anything else
+    int ascii = utf8_ascii_prefix(row->chars, row->size);
+    int tabs = memchr(row->chars, '\t', row->size) != NULL;
+    if (ascii == row->size && !tabs) return;
+
+    if (ascii == row->size) {
+        int render_size = 0;
+        for (int j = 0; j < row->size; j++)
+            render_size += row->chars[j] == '\t' ? ACORN_TAB_STOP - (render_size % ACORN_TAB_STOP) : 1;
+        row->render_size = render_size;
+        row->width = render_size;
+        row->render = arena_alloc(e.active_buffer->derived_arena, row->render_size + 1, NULL);
+
+        int idx = 0;
+        for (int j = 0; j < row->size; j++) {
+            if (row->chars[j] == '\t') {
+                row->render[idx++] = ' ';
+                while (idx % ACORN_TAB_STOP != 0) row->render[idx++] = ' ';
+            } else {
+                row->render[idx++] = row->chars[j];
+            }
+        }
+        row->render[idx] = '\0';
+        return;
+    }
+
+    //tabs are expanded to the next tab stop on screen, so wide characters before them count double
+    int width = 0;
+    int render_size = 0;
+    for (int j = 0; j < row->size; ) {
+        int cp;
+        int n = utf8_decode(&row->chars[j], row->size - j, &cp);
+        if (cp == '\t') {
+            int spaces = ACORN_TAB_STOP - (width % ACORN_TAB_STOP);
+            width += spaces;
+            render_size += spaces;
+        } else {
+            width += utf8_width(cp);
+            render_size += n;
+        }
+        j += n;
+    }
+    row->width = width;
+    if (!tabs) return;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (ACORN_TAB_STOP - 1) + 1);
+    row->render_size = render_size;
+    row->render = arena_alloc(e.active_buffer->derived_arena, row->render_size + 1, NULL);
 
     int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % ACORN_TAB_STOP != 0) row->render[idx++] = ' ';
+    int column = 0;
+    for (int j = 0; j < row->size; ) {
+        int cp;
+        int n = utf8_decode(&row->chars[j], row->size - j, &cp);
+        if (cp == '\t') {
+            int spaces = ACORN_TAB_STOP - (column % ACORN_TAB_STOP);
+            memset(&row->render[idx], ' ', spaces);
+            idx += spaces;
+            column += spaces;
         } else {
-            row->render[idx++] = row->chars[j];
+            memcpy(&row->render[idx], &row->chars[j], n);
+            idx += n;
+            column += utf8_width(cp);
         }
+        j += n;
     }
     row->render[idx] = '\0';
-    row->render_size = idx;
+}
+
+void editor_update_render(struct EditorRow* row) {
+    editor_render_row(row);
+    editor_wrap_row_changed(e.active_buffer, row);
+}
+
+void editor_update_row(struct EditorRow* row) {
+    editor_update_render(row);
+    editor_update_syntax(e.active_buffer, row, editor_prev_open_comment(e.active_buffer, row));
+}
+
+//batched version of editor_update_row for a range of rows [start, end)
+//every row is rendered and highlighted once, and highlighting only continues past 'end' if the comment state changed
+void editor_update_rows(int start, int end) {
+    for (int j = start; j < end; j++)
+        editor_update_render(&e.active_buffer->row[j]);
+    editor_highlight_rows(e.active_buffer, start, end);
+}
 
-    editor_update_syntax(row);
+//grows the row array geometrically so appending rows (eg, while loading a file) doesn't realloc every time
+void editor_reserve_rows(struct EditorBuffer* buffer, int num_rows) {
+    if (num_rows <= buffer->row_capacity) return;
+    int capacity = buffer->row_capacity ? buffer->row_capacity : 64;
+    while (capacity < num_rows) capacity *= 2;
+    buffer->row = realloc(buffer->row, sizeof(struct EditorRow) * capacity);
+    buffer->row_capacity = capacity;
 }
 
 void editor_insert_row(int at, char* s, size_t len) {
     if (at < 0 || at > e.active_buffer->num_rows) return;
+    uint64_t trace = trace_begin();
 
-    e.active_buffer->row = realloc(e.active_buffer->row, sizeof(struct EditorRow) * (e.active_buffer->num_rows + 1));
+    editor_reserve_rows(e.active_buffer, e.active_buffer->num_rows + 1);
     memmove(&e.active_buffer->row[at + 1], &e.active_buffer->row[at], sizeof(struct EditorRow) * (e.active_buffer->num_rows - at));
-    for (int j = at + 1; j <= e.active_buffer->num_rows; j++) e.active_buffer->row[j].idx++;
-
-    e.active_buffer->row[at].idx = at;
+    editor_wrap_moved(e.active_buffer, at);
 
     e.active_buffer->row[at].size = len;
-    e.active_buffer->row[at].chars = malloc(len + 1);
-    memcpy(e.active_buffer->row[at].chars, s, len);
-    e.active_buffer->row[at].chars[len] = '\0';
+    e.active_buffer->row[at].chars = row_text_new(e.active_buffer->text_arena, s, len, len + 1);
     
     e.active_buffer->row[at].render_size = 0;
     e.active_buffer->row[at].render = NULL;
     e.active_buffer->row[at].hl = NULL;
+    e.active_buffer->row[at].hl_count = 0;
     e.active_buffer->row[at].hl_open_comment = 0;
+    e.active_buffer->row[at].wrap_lines = 1;
+    //counted before it's rendered, so the wrap index (and comment state running on past it) sees the whole buffer
+    e.active_buffer->num_rows++;
     editor_update_row(&e.active_buffer->row[at]);
 
-    e.active_buffer->num_rows++;
     e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+    trace_end("insert_row", trace);
+}
+
+//makes room for the slices with a single realloc/memmove of the row array and fills in their text (nothing is rendered)
+//slices covering a whole row of this buffer share that row's text instead of copying it ('arena' is where the slices live)
+void editor_place_rows(int at, struct RowArena* arena, struct RegisterSlice* slices, int count) {
+    editor_reserve_rows(e.active_buffer, e.active_buffer->num_rows + count);
+    memmove(&e.active_buffer->row[at + count], &e.active_buffer->row[at], sizeof(struct EditorRow) * (e.active_buffer->num_rows - at));
+    editor_wrap_moved(e.active_buffer, at);
+
+    for (int j = 0; j < count; j++) {
+        struct EditorRow* row = &e.active_buffer->row[at + j];
+        struct RegisterSlice* slice = &slices[j];
+        row->size = slice->len;
+        if (arena == e.active_buffer->text_arena && slice->start == 0 && slice->text[slice->len] == '\0') {
+            row->chars = row_text_retain(slice->text);
+        } else {
+            row->chars = row_text_new(e.active_buffer->text_arena, &slice->text[slice->start], slice->len, slice->len + 1);
+        }
+        row->render_size = 0;
+        row->render = NULL;
+        row->hl = NULL;
+        row->hl_count = 0;
+        row->hl_open_comment = 0;
+        row->wrap_lines = 1;
+    }
+    e.active_buffer->num_rows += count;
+}
+
+//inserts all slices as new rows, then renders and highlights them in one batch
+void editor_insert_rows(int at, struct RowArena* arena, struct RegisterSlice* slices, int count) {
+    if (at < 0 || at > e.active_buffer->num_rows || count <= 0) return;
+    uint64_t trace = trace_begin();
+
+    editor_place_rows(at, arena, slices, count);
+    editor_update_rows(at, at + count);
+
+    e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+    trace_end("insert_rows", trace);
 }
 
 void editor_free_row(struct EditorRow* row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    if (row->render) arena_free(e.active_buffer->derived_arena, row->render, row->render_size + 1);
+    editor_row_release_hl(row);
+    row_text_release(e.active_buffer->text_arena, row->chars);
 }
 
 void editor_del_row(int at) {
     if (at < 0 || at >= e.active_buffer->num_rows) return;
+    uint64_t trace = trace_begin();
     editor_free_row(&e.active_buffer->row[at]);
     memmove(&e.active_buffer->row[at], &e.active_buffer->row[at + 1], sizeof(struct EditorRow) * (e.active_buffer->num_rows - at - 1));
-    for (int j = at; j < e.active_buffer->num_rows - 1; j++) e.active_buffer->row[j].idx--;
     e.active_buffer->num_rows--;
+    editor_wrap_moved(e.active_buffer, at);
     e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+    trace_end("del_row", trace);
 }
 
 void editor_row_insert_char(struct EditorRow* row, int at, int c) {
     if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2); //one for inserted character and one for null terminator
+    uint64_t trace = trace_begin();
+    row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + 2); //one for inserted character and one for null terminator
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at] = c;
     editor_update_row(row);
     e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+    trace_end("insert_char", trace);
 }
 
 void editor_row_replace_char(struct EditorRow* row, int at, int c) {
+    if (at < 0 || at >= row->size) return;
+    row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + 1);
     row->chars[at] = c;
     editor_update_row(row);
     e.active_buffer->dirty++;
+    e.active_buffer->edits++;
 }
 
 void editor_row_append_string(struct EditorRow* row, char* s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
+    row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
     editor_update_row(row);
     e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+}
+
+void editor_row_insert_string(struct EditorRow* row, int at, char* s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editor_update_row(row);
+    e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+}
+
+void editor_row_truncate(struct EditorRow* row, int at) {
+    if (at < 0 || at >= row->size) return;
+    row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + 1);
+    row->size = at;
+    row->chars[row->size] = '\0';
+    editor_update_row(row);
+    e.active_buffer->dirty++;
+    e.active_buffer->edits++;
 }
 
+//deletes the whole character (code point) starting at 'at'
 void editor_row_del_char(struct EditorRow* row, int at) {
     if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
+    uint64_t trace = trace_begin();
+    int n = utf8_char_len(row->chars, row->size, at);
+    row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + 1);
+    memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+    row->size -= n;
     editor_update_row(row);
     e.active_buffer->dirty++;
+    e.active_buffer->edits++;
+    trace_end("del_char", trace);
 }
 
 /*** editor operations ***/
@@ -568,9 +2275,7 @@ void editor_insert_new_line() {
         struct EditorRow* row = &e.active_buffer->row[e.active_buffer->cursor_y];
         editor_insert_row(e.active_buffer->cursor_y + 1, &row->chars[e.active_buffer->cursor_x], row->size - e.active_buffer->cursor_x);
         row = &e.active_buffer->row[e.active_buffer->cursor_y]; //need to reassigned row in case realloc in 'editor_insert_row' moved some memory
-        row->size = e.active_buffer->cursor_x;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+        editor_row_truncate(row, e.active_buffer->cursor_x);
     }
     e.active_buffer->cursor_y++;
     e.active_buffer->cursor_x = 0;
@@ -582,8 +2287,9 @@ void editor_del_char() {
 
     struct EditorRow* row = &e.active_buffer->row[e.active_buffer->cursor_y];
     if (e.active_buffer->cursor_x > 0) {
-        editor_row_del_char(row, e.active_buffer->cursor_x - 1);
-        e.active_buffer->cursor_x--;
+        int at = utf8_char_start(row->chars, e.active_buffer->cursor_x - 1);
+        editor_row_del_char(row, at);
+        e.active_buffer->cursor_x = at;
     } else {
         e.active_buffer->cursor_x = e.active_buffer->row[e.active_buffer->cursor_y - 1].size;
         editor_row_append_string(&e.active_buffer->row[e.active_buffer->cursor_y - 1], row->chars, row->size);
@@ -592,856 +2298,5265 @@ void editor_del_char() {
     }
 }
 
-/*** file i/o ***/
-char* editor_rows_to_string(int* buffer_length) {
-    int total_length = 0;
-    int j;
-    for (j = 0; j < e.active_buffer->num_rows; j++)
-        total_length += e.active_buffer->row[j].size + 1;
-    *buffer_length = total_length;
+/*** large files ***/
 
-    char* buffer_str = malloc(total_length);
-    char* p = buffer_str;
-    for (j = 0; j < e.active_buffer->num_rows; j++) {
-        memcpy(p, e.active_buffer->row[j].chars, e.active_buffer->row[j].size);
-        p += e.active_buffer->row[j].size;
-        *p = '\n';
-        p++;
+//large files are paged in from disk, so they can't be edited
+int editor_read_only() {
+    editor_load_finish(e.active_buffer); //edits only start once the whole file is in
+    if (e.filter.pid && e.filter.buffer == e.active_buffer) {
+        editor_set_status_message("Filter running (Ctrl-C cancels)");
+        return 1;
     }
-    return buffer_str;
+    if (e.active_buffer->follow) {
+        editor_set_status_message("Following the file (:follow stops)");
+        return 1;
+    }
+    if (e.active_buffer->paged == NULL) return 0;
+    editor_set_status_message("Large file is read-only");
+    return 1;
 }
 
-void editor_init_buffer(struct EditorBuffer* buffer) {
-    buffer->cursor_x = 0;
-    buffer->cursor_y = 0;
-    buffer->anchor_x = 0;
-    buffer->anchor_y = 0;
-    buffer->render_x = 0;
-    buffer->row_offset = 0;
-    buffer->col_offset = 0;
-    buffer->num_rows = 0;
-    buffer->dirty = 0;
-    buffer->row = NULL;
-    buffer->filename = NULL;
-    buffer->syntax = NULL;
+//counts rows from 'offset' (where row 'rows' starts) to the end of the file, with a checkpoint every ACORN_PAGE_LINES rows
+//returns the number of rows that ended in a newline, 'last' is set to the last byte scanned
+long long editor_index_scan(struct PagedFile* paged, off_t offset, long long rows, char* last) {
+    size_t block_size = 1 << 20;
+    char* block = malloc(block_size);
+    ssize_t n;
+    while ((n = pread(paged->fd, block, block_size, offset)) > 0) {
+        char* p = block;
+        char* end = block + n;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            rows++;
+            if (rows % ACORN_PAGE_LINES == 0) {
+                pthread_mutex_lock(&paged->lock);
+                if (paged->num_checkpoints % 64 == 0)
+                    paged->checkpoints = realloc(paged->checkpoints, sizeof(off_t) * (paged->num_checkpoints + 64));
+                paged->checkpoints[paged->num_checkpoints++] = offset + (p - block);
+                pthread_cond_broadcast(&paged->indexed);
+                pthread_mutex_unlock(&paged->lock);
+            }
+        }
+        *last = block[n - 1];
+        offset += n;
+
+        pthread_mutex_lock(&paged->lock);
+        paged->indexed_bytes = offset;
+        int cancel = paged->cancel;
+        pthread_mutex_unlock(&paged->lock);
+        if (cancel) break;
+    }
+    free(block);
+    return rows;
 }
 
-void editor_close_buffer(int index) {
-    //close buffer and free any necessary memory
+//builds the sparse line index with a single pass over the file
+//runs on its own thread so the first screen can be drawn while the rest of the file is scanned
+void* editor_index_thread(void* arg) {
+    struct PagedFile* paged = arg;
+    if (!paged->indexing) return NULL; //the index came from a session, there's nothing to scan
+    char last = '\n';
+    long long rows = editor_index_scan(paged, 0, 0, &last);
+    if (last != '\n') rows++; //last line has no newline
+
+    pthread_mutex_lock(&paged->lock);
+    paged->total_rows = rows > 0x7fffffff ? 0x7fffffff : rows;
+    paged->indexing = 0;
+    pthread_cond_broadcast(&paged->indexed);
+    pthread_mutex_unlock(&paged->lock);
+    return NULL;
 }
 
-void editor_open_buffer(char* filename) {
-    if (e.buffer_count >= 16) {
-        return; //TODO: should print out message on status bar telling user they hit max buffer limit
+//'checkpoints' is a finished index of the file (eg, from a session) or NULL to build one in the background
+struct PagedFile* editor_index_file(int fd, off_t size, off_t* checkpoints, int num_checkpoints, long long total_rows) {
+    struct PagedFile* paged = calloc(1, sizeof(struct PagedFile));
+    paged->fd = fd;
+    paged->size = size;
+    for (int i = 0; i < ACORN_PAGE_CACHE; i++) paged->pages[i].index = -1;
+
+    if (checkpoints) {
+        //rounded up to a multiple of 64 like the index thread grows it
+        paged->checkpoints = malloc(sizeof(off_t) * ((num_checkpoints + 63) / 64 * 64));
+        memcpy(paged->checkpoints, checkpoints, sizeof(off_t) * num_checkpoints);
+        paged->num_checkpoints = num_checkpoints;
+        paged->indexed_bytes = size;
+        paged->total_rows = total_rows;
+        paged->indexing = 0;
+    } else {
+        paged->checkpoints = malloc(sizeof(off_t) * 64);
+        paged->checkpoints[0] = 0;
+        paged->num_checkpoints = 1;
+        paged->indexing = 1;
     }
+    pthread_mutex_init(&paged->lock, NULL);
+    pthread_cond_init(&paged->indexed, NULL);
+    if (pthread_create(&paged->thread, NULL, editor_index_thread, paged) != 0) die("pthread_create");
+    return paged;
+}
 
-    e.active_buffer = e.buffers + e.buffer_count;
-    editor_init_buffer(e.active_buffer);
-    e.active_buffer->filename = filename == NULL ? NULL : strdup(filename);
-    editor_select_syntax_highlight();
-
-    if (filename != NULL && access(filename, F_OK) == 0) {
-        FILE* fp = fopen(filename, "r");
-        if (!fp) die("fopen");
+//picks up whatever the index thread has found since last time - returns 1 if the buffer grew
+int editor_index_sync(struct EditorBuffer* buffer) {
+    struct PagedFile* paged = buffer->paged;
+    if (paged == NULL) return 0;
 
-        char* line = NULL;
-        size_t line_capacity = 0;
-        ssize_t linelen;
-        while ((linelen = getline(&line, &line_capacity, fp)) != -1) {
-            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] =='\r'))
-                linelen--;
-            editor_insert_row(e.active_buffer->num_rows, line, linelen);
-        }
-        free(line);
-        fclose(fp);
+    int old_rows = buffer->num_rows;
+    pthread_mutex_lock(&paged->lock);
+    if (paged->indexing) {
+        paged->num_pages = paged->num_checkpoints - 1;
+        buffer->num_rows = paged->num_pages * ACORN_PAGE_LINES;
     } else {
-        editor_insert_row(0, "", 0);
-    } 
-
-    e.active_buffer->dirty = 0;
-    e.buffer_count++;
-
-    //where ever the 10 buffer properties are set/get, use e.buffers[e.active_buffer] to get EditorBuffer
+        buffer->num_rows = paged->total_rows;
+        paged->num_pages = (paged->total_rows + ACORN_PAGE_LINES - 1) / ACORN_PAGE_LINES;
+    }
+    pthread_mutex_unlock(&paged->lock);
+    return buffer->num_rows != old_rows;
 }
 
+//blocks until row 'at' has been indexed (or the whole file if 'at' is past the end)
+void editor_index_wait(struct EditorBuffer* buffer, int at) {
+    while (buffer->loading && buffer->num_rows <= at) editor_load_append(buffer, ACORN_LOAD_BATCH, 1);
+    struct PagedFile* paged = buffer->paged;
+    if (paged == NULL) return;
+
+    pthread_mutex_lock(&paged->lock);
+    while (paged->indexing && (long long) (paged->num_checkpoints - 1) * ACORN_PAGE_LINES <= at)
+        pthread_cond_wait(&paged->indexed, &paged->lock);
+    pthread_mutex_unlock(&paged->lock);
+    editor_index_sync(buffer);
+}
 
-void editor_save() {
-    if (e.active_buffer->filename == NULL) {
-        editor_set_status_message("Save using :w [filename]");
-        return;
-        /*
-        e.active_buffer->filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-        if (e.active_buffer->filename == NULL) {
-            editor_set_status_message("Save aborted");
-            return;
-        }*/
+//percentage of the file scanned (or loaded) so far, or -1 once indexing is done
+int editor_index_progress(struct EditorBuffer* buffer) {
+    struct LoadingFile* loading = buffer->loading;
+    if (loading) {
+        pthread_mutex_lock(&loading->lock);
+        int percent = loading->split && loading->num_lines ? (int) ((long long) loading->next_line * 100 / loading->num_lines) : 0;
+        pthread_mutex_unlock(&loading->lock);
+        return percent;
     }
-    editor_select_syntax_highlight();
+    struct PagedFile* paged = buffer->paged;
+    if (paged == NULL) return -1;
 
-    int len;
-    char* buffer_str = editor_rows_to_string(&len);
-
-    int fd = open(e.active_buffer->filename, O_RDWR | O_CREAT, 0644); //0644 is standard permissions - owner gets read/write, otherwise only read
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buffer_str, len) == len) {
-                close(fd);
-                free(buffer_str);
-                e.active_buffer->dirty = 0;
-                editor_set_status_message("%d bytes written to disk", len);
-                return;
+    pthread_mutex_lock(&paged->lock);
+    int percent = paged->indexing ? (int) (paged->indexed_bytes * 100 / paged->size) : -1;
+    pthread_mutex_unlock(&paged->lock);
+    return percent;
+}
+
+//calls 'line_fn' for every line in a page (without the newline)
+//the page is streamed in blocks, so memory stays bounded even if a page is huge
+void editor_read_page(struct PagedFile* paged, int page, void (*line_fn)(char*, int, int, void*), void* data) {
+    pthread_mutex_lock(&paged->lock);
+    off_t offset = paged->checkpoints[page];
+    off_t end = page + 1 < paged->num_checkpoints ? paged->checkpoints[page + 1] : paged->size;
+    pthread_mutex_unlock(&paged->lock);
+
+    size_t block_size = 1 << 20;
+    char* block = malloc(block_size);
+    char* line = malloc(ACORN_PAGED_LINE_MAX);
+    int line_len = 0;
+    int row = page * ACORN_PAGE_LINES;
+
+    while (offset < end) {
+        size_t want = end - offset < (off_t) block_size ? (size_t) (end - offset) : block_size;
+        ssize_t n = pread(paged->fd, block, want, offset);
+        if (n <= 0) break;
+        for (ssize_t i = 0; i < n; i++) {
+            if (block[i] == '\n') {
+                if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+                line_fn(line, line_len, row++, data);
+                line_len = 0;
+            } else if (line_len < ACORN_PAGED_LINE_MAX) {
+                line[line_len++] = block[i];
             }
         }
-        close(fd);
+        offset += n;
     }
-    free(buffer_str);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    if (line_len > 0) line_fn(line, line_len, row, data); //last line of the file has no newline
+
+    free(line);
+    free(block);
 }
 
-/*** find ***/
-void editor_find_callback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1; //1 is forward, -1 is backwards
+void editor_page_add_row(char* line, int len, int row, void* data) {
+    struct EditorPage* page = data;
+    struct EditorRow* r = &page->row[page->num_rows++];
+    (void) row;
+    r->size = len;
+    r->chars = row_text_new(e.active_buffer->text_arena, line, len, len + 1);
+    r->render = NULL;
+    r->render_size = 0;
+    r->hl = NULL;
+    r->hl_count = 0;
+    r->hl_open_comment = 0;
+}
 
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
+void editor_free_page(struct EditorBuffer* buffer, struct EditorPage* page) {
+    for (int j = 0; j < page->num_rows; j++) {
+        struct EditorRow* row = &page->row[j];
+        if (row->render) arena_free(buffer->derived_arena, row->render, row->render_size + 1);
+        editor_row_release_hl(row);
+        row_text_release(buffer->text_arena, row->chars);
+    }
+    free(page->row);
+    page->row = NULL;
+    page->num_rows = 0;
+    page->index = -1;
+}
+
+void editor_free_pages(struct EditorBuffer* buffer) {
+    for (int i = 0; i < ACORN_PAGE_CACHE; i++)
+        if (buffer->paged->pages[i].index != -1) editor_free_page(buffer, &buffer->paged->pages[i]);
+}
 
-    if (saved_hl) {
-        memcpy(e.active_buffer->row[saved_hl_line].hl, saved_hl, e.active_buffer->row[saved_hl_line].render_size);
-        free(saved_hl);
-        saved_hl = NULL;
+//finds the page in the cache, or reads it into the least recently used slot
+//comment state isn't carried across pages - each page is highlighted as if it starts outside a comment
+struct EditorPage* editor_load_page(struct EditorBuffer* buffer, int index) {
+    struct PagedFile* paged = buffer->paged;
+    struct EditorPage* lru = &paged->pages[0];
+    for (int i = 0; i < ACORN_PAGE_CACHE; i++) {
+        struct EditorPage* page = &paged->pages[i];
+        if (page->index == index) {
+            page->last_used = ++paged->clock;
+            return page;
+        }
+        if (page->index == -1 || (lru->index != -1 && page->last_used < lru->last_used)) lru = page;
     }
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
+    if (lru->index != -1) editor_free_page(buffer, lru);
+    lru->index = index;
+    lru->last_used = ++paged->clock;
+    lru->row = malloc(sizeof(struct EditorRow) * ACORN_PAGE_LINES);
+    editor_read_page(paged, index, editor_page_add_row, lru);
+
+    int in_comment = 0;
+    for (int j = 0; j < lru->num_rows; j++) {
+        editor_update_render(&lru->row[j]);
+        editor_highlight_row(buffer, &lru->row[j], in_comment);
+        in_comment = lru->row[j].hl_open_comment;
     }
+    return lru;
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < e.active_buffer->num_rows; i++) {
-        //loop 'current'
-        current += direction;
-        if (current == -1) current = e.active_buffer->num_rows - 1;
-        else if (current == e.active_buffer->num_rows) current = 0;
+//NOTE: rows of a paged buffer are only valid until the next call to editor_row - it may evict their page
+struct EditorRow* editor_row(struct EditorBuffer* buffer, int at) {
+    if (buffer->paged == NULL) return &buffer->row[at];
+
+    struct EditorPage* page = editor_load_page(buffer, at / ACORN_PAGE_LINES);
+    int j = at % ACORN_PAGE_LINES;
+    if (j >= page->num_rows) {
+        //file changed under us - hand back an empty row rather than reading past the page
+        static char empty[1] = "";
+        static struct EditorRow empty_row = { 0, 0, empty, NULL, NULL, 0, 0, 0, 1 };
+        return &empty_row;
+    }
+    return &page->row[j];
+}
 
-        struct EditorRow* row = &e.active_buffer->row[current];
-        char* match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            e.active_buffer->cursor_y = current;
-            e.active_buffer->cursor_x = editor_row_render_x_to_cursor_x(row, match - row->render);
-            e.active_buffer->row_offset = e.active_buffer->num_rows; //setting offset so that next screen refresh will scroll up so query is at top of screen
+struct PagedSearch {
+    char* query;
+    int query_len;
+    int from;
+    int direction;
+    int num_rows;
+    int first_pass; //only rows after 'from' count on the first visit to its page
+    int best;
+    int best_distance;
+};
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->render_size);
-            memcpy(saved_hl, row->hl, row->render_size);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+void editor_paged_search_line(char* line, int len, int row, void* data) {
+    struct PagedSearch* search = data;
+    int distance = ((row - search->from) * search->direction + search->num_rows) % search->num_rows;
+    if (distance == 0) distance = search->num_rows;
+    if (search->first_pass && (row - search->from) * search->direction <= 0) return;
+    if (distance >= search->best_distance) return;
+    if (memmem(line, len, search->query, search->query_len)) {
+        search->best = row;
+        search->best_distance = distance;
     }
 }
 
-void editor_find() {
-    int saved_cx = e.active_buffer->cursor_x;
-    int saved_cy = e.active_buffer->cursor_y;
-    int saved_coloff = e.active_buffer->col_offset;
-    int saved_rowoff = e.active_buffer->row_offset;
+//searches the raw file a page at a time (without building rows) for the next row after 'from' containing 'query'
+int editor_paged_find(struct EditorBuffer* buffer, char* query, int from, int direction) {
+    editor_index_wait(buffer, INT_MAX); //the search may wrap around, so it needs the whole index
 
-    char* query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+    struct PagedFile* paged = buffer->paged;
+    struct PagedSearch search = { query, strlen(query), from, direction, buffer->num_rows, 1, -1, buffer->num_rows + 1 };
+    if (from < 0) {
+        search.from = direction == 1 ? -1 : buffer->num_rows;
+        search.num_rows = buffer->num_rows + 1;
+    }
 
-    if (query) {
-        free(query);
-    } else {
-        e.active_buffer->cursor_x = saved_cx;
-        e.active_buffer->cursor_y = saved_cy;
-        e.active_buffer->col_offset = saved_coloff;
-        e.active_buffer->row_offset = saved_rowoff;
+    int start_page = (from < 0 ? (direction == 1 ? 0 : paged->num_pages - 1) : from / ACORN_PAGE_LINES);
+    for (int k = 0; k <= paged->num_pages; k++) {
+        int page = ((start_page + k * direction) % paged->num_pages + paged->num_pages) % paged->num_pages;
+        search.first_pass = (k == 0);
+        editor_read_page(paged, page, editor_paged_search_line, &search);
+        if (search.best != -1) return search.best;
     }
+    return -1;
 }
 
-/*** append buffer ***/
-
-struct AppendBuffer {
-    char* buffer;
-    int len;
-};
+void editor_open_paged(int fd, off_t size) {
+    struct EditorBuffer* b = e.active_buffer;
+    b->paged = editor_index_file(fd, size, NULL, 0, 0);
+    editor_index_wait(b, e.screenrows); //only the first screen has to be indexed before we can draw
+    editor_set_status_message("Large file (%lld MB) opened read-only, rows appear as it's indexed", (long long) (size / (1024 * 1024)));
+}
 
-#define APPEND_BUFFER_INIT {NULL, 0}
+void editor_close_paged(struct EditorBuffer* buffer) {
+    if (buffer->paged == NULL) return;
+
+    pthread_mutex_lock(&buffer->paged->lock);
+    buffer->paged->cancel = 1;
+    pthread_mutex_unlock(&buffer->paged->lock);
+    pthread_join(buffer->paged->thread, NULL);
+    pthread_mutex_destroy(&buffer->paged->lock);
+    pthread_cond_destroy(&buffer->paged->indexed);
+
+    editor_free_pages(buffer);
+    close(buffer->paged->fd);
+    free(buffer->paged->checkpoints);
+    free(buffer->paged);
+    buffer->paged = NULL;
+}
 
-void append_buffer_append(struct AppendBuffer* ab, const char* s, int len) {
-    char* new = realloc(ab->buffer, ab->len + len);
+//'y' can be past the end of the file (INT_MAX for the last line)
+void editor_goto_line(int y) {
+    struct EditorBuffer* b = e.active_buffer;
+    editor_index_wait(b, y);
+    if (y >= b->num_rows) y = b->num_rows - 1;
+    if (y < 0) y = 0;
+    b->cursor_y = y;
+    int rowlen = b->num_rows > 0 ? editor_row(b, y)->size : 0;
+    if (b->cursor_x >= rowlen) b->cursor_x = rowlen - 1 > 0 ? rowlen - 1 : 0;
+}
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->buffer = new;
-    ab->len += len;
+/*** registers ***/
+int editor_register_index(int name) {
+    if (name == '"') return 0;
+    if (name >= 'a' && name <= 'z') return name - 'a' + 1;
+    if (name >= 'A' && name <= 'Z') return name - 'A' + 1;
+    return -1;
 }
 
-void append_buffer_free(struct AppendBuffer* ab) {
-    free(ab->buffer);
+void editor_clear_register(struct EditorRegister* reg) {
+    for (int i = 0; i < reg->num_slices; i++)
+        row_text_release(reg->arena, reg->slices[i].text);
+    free(reg->slices);
+    arena_release(reg->arena);
+    reg->slices = NULL;
+    reg->num_slices = 0;
+    reg->arena = NULL;
 }
 
-/*** output ***/
-void editor_scroll() {
-    e.active_buffer->render_x = 0;
-    if (e.active_buffer->cursor_y < e.active_buffer->num_rows) {
-        e.active_buffer->render_x = editor_row_cursor_x_to_render_x(&e.active_buffer->row[e.active_buffer->cursor_y], e.active_buffer->cursor_x);
+//called before a buffer's arena goes away: registers still pointing into it get their own copy of the text
+void editor_detach_registers(struct RowArena* arena) {
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        struct EditorRegister* reg = &e.registers[i];
+        if (reg->arena != arena) continue;
+
+        struct RowArena* copy = arena_new();
+        for (int j = 0; j < reg->num_slices; j++) {
+            struct RegisterSlice* slice = &reg->slices[j];
+            char* text = row_text_new(copy, &slice->text[slice->start], slice->len, slice->len + 1);
+            row_text_release(arena, slice->text);
+            slice->text = text;
+            slice->start = 0;
+        }
+        arena_release(arena);
+        reg->arena = copy;
     }
+}
 
-    if (e.active_buffer->cursor_y < e.active_buffer->row_offset) {
-        e.active_buffer->row_offset = e.active_buffer->cursor_y;
-    }
-    if (e.active_buffer->cursor_y >= e.active_buffer->row_offset + e.screenrows) {
-        e.active_buffer->row_offset = e.active_buffer->cursor_y - e.screenrows + 1;
-    }
-    if (e.active_buffer->render_x < e.active_buffer->col_offset) {
-        e.active_buffer->col_offset = e.active_buffer->render_x;
-    }
-    if (e.active_buffer->render_x >= e.active_buffer->col_offset + e.screencols) {
-        e.active_buffer->col_offset = e.active_buffer->render_x - e.screencols + 1;
-    }
+//empties the register selected with '"' (or the unnamed one) and makes room for 'count' slices
+struct EditorRegister* editor_begin_yank(int type, int count) {
+    int index = editor_register_index(e.register_name);
+    if (index == -1) index = 0;
+    e.register_name = '"';
+    e.last_register = index;
+
+    struct EditorRegister* reg = &e.registers[index];
+    editor_clear_register(reg);
+    reg->type = type;
+    reg->num_slices = count;
+    reg->slices = malloc(sizeof(struct RegisterSlice) * count);
+    reg->arena = arena_retain(e.active_buffer->text_arena);
+    return reg;
 }
 
-void invert_colors(struct AppendBuffer* ab) {
-    append_buffer_append(ab, "\x1b[7m", 4);
+//only bumps the refcount on the row text - nothing is copied until somebody writes to the row
+void editor_set_slice(struct RegisterSlice* slice, struct EditorRow* row, int start, int end) {
+    if (start > row->size) start = row->size;
+    if (end > row->size) end = row->size;
+    if (end < start) end = start;
+    slice->text = row_text_retain(row->chars);
+    slice->start = start;
+    slice->len = end - start;
 }
 
-void revert_colors(struct AppendBuffer* ab) {
-    append_buffer_append(ab, "\x1b[m", 3);
-    append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
-    append_buffer_append(ab, COLOR_BACKGROUND, strlen(COLOR_BACKGROUND));
+//selection in file coordinates (start comes before end)
+void editor_get_selection(int* start_x, int* start_y, int* end_x, int* end_y) {
+    struct EditorBuffer* b = e.active_buffer;
+    if (b->anchor_y < b->cursor_y || (b->anchor_y == b->cursor_y && b->anchor_x <= b->cursor_x)) {
+        *start_x = b->anchor_x;
+        *start_y = b->anchor_y;
+        *end_x = b->cursor_x;
+        *end_y = b->cursor_y;
+    } else {
+        *start_x = b->cursor_x;
+        *start_y = b->cursor_y;
+        *end_x = b->anchor_x;
+        *end_y = b->anchor_y;
+    }
 }
 
-void editor_draw_buffer_tabs(struct AppendBuffer* ab) {
-    append_buffer_append(ab, "\x1b[K", 3); //clear to end of line
-    int tab_width = e.buffer_count <= 6 ? e.screencols / 6 : e.screencols / e.buffer_count;
+void editor_yank_lines(int start_y, int end_y) {
+    struct EditorRegister* reg = editor_begin_yank(REGISTER_LINEWISE, end_y - start_y + 1);
+    for (int y = start_y; y <= end_y; y++) {
+        struct EditorRow* row = editor_row(e.active_buffer, y);
+        editor_set_slice(&reg->slices[y - start_y], row, 0, row->size);
+    }
+}
 
-    invert_colors(ab);
+void editor_yank_selection() {
+    int start_x, start_y, end_x, end_y;
+    editor_get_selection(&start_x, &start_y, &end_x, &end_y);
+    int count = end_y - start_y + 1;
+
+    if (e.mode == MODE_VISUAL_LINE) {
+        editor_yank_lines(start_y, end_y);
+    } else if (e.mode == MODE_VISUAL_BLOCK) {
+        int left = e.active_buffer->anchor_x < e.active_buffer->cursor_x ? e.active_buffer->anchor_x : e.active_buffer->cursor_x;
+        int right = e.active_buffer->anchor_x < e.active_buffer->cursor_x ? e.active_buffer->cursor_x : e.active_buffer->anchor_x;
+        struct EditorRegister* reg = editor_begin_yank(REGISTER_BLOCKWISE, count);
+        for (int y = start_y; y <= end_y; y++)
+            editor_set_slice(&reg->slices[y - start_y], editor_row(e.active_buffer, y), left, right + 1);
+        start_x = left;
+    } else {
+        struct EditorRegister* reg = editor_begin_yank(REGISTER_CHARWISE, count);
+        for (int y = start_y; y <= end_y; y++) {
+            struct EditorRow* row = editor_row(e.active_buffer, y);
+            int start = y == start_y ? start_x : 0;
+            int end = y == end_y ? end_x + 1 : row->size;
+            editor_set_slice(&reg->slices[y - start_y], row, start, end);
+        }
+    }
 
-    int current_count = 0;
+    e.active_buffer->cursor_x = start_x;
+    e.active_buffer->cursor_y = start_y;
+    editor_set_status_message("%d line%s yanked", count, count == 1 ? "" : "s");
+}
 
+void editor_put(int before) {
+    int index = editor_register_index(e.register_name);
+    if (index <= 0) index = e.last_register;
+    e.register_name = '"';
+
+    struct EditorRegister* reg = &e.registers[index];
+    if (reg->num_slices == 0 || editor_read_only()) return;
+
+    struct EditorBuffer* b = e.active_buffer;
+    if (reg->type == REGISTER_LINEWISE) {
+        int at = before ? b->cursor_y : b->cursor_y + 1;
+        if (at > b->num_rows) at = b->num_rows;
+        editor_insert_rows(at, reg->arena, reg->slices, reg->num_slices);
+        b->cursor_y = at;
+        b->cursor_x = 0;
+        return;
+    }
 
-    int len = 0;
-    while (len < e.screencols) {
-        if (len >= tab_width * (e.active_buffer - e.buffers) && len < tab_width * (e.active_buffer - e.buffers + 1)) {
-            append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
-        } else {
-            append_buffer_append(ab, COLOR_BLUE, strlen(COLOR_BLUE));
+    if (b->num_rows == 0) editor_insert_row(0, "", 0);
+    struct EditorRow* row = &b->row[b->cursor_y];
+    int at = (before || row->size == 0) ? b->cursor_x : b->cursor_x + 1;
+    if (at > row->size) at = row->size;
+
+    if (reg->type == REGISTER_BLOCKWISE) {
+        for (int i = 0; i < reg->num_slices; i++) {
+            struct RegisterSlice* slice = &reg->slices[i];
+            if (b->cursor_y + i >= b->num_rows) editor_insert_row(b->num_rows, "", 0);
+            row = &b->row[b->cursor_y + i];
+            while (row->size < at) editor_row_append_string(row, " ", 1);
+            editor_row_insert_string(row, at, &slice->text[slice->start], slice->len);
         }
+        b->cursor_x = at;
+    } else if (reg->num_slices == 1) {
+        struct RegisterSlice* slice = &reg->slices[0];
+        editor_row_insert_string(row, at, &slice->text[slice->start], slice->len);
+        b->cursor_x = slice->len > 0 ? at + slice->len - 1 : at;
+    } else {
+        //split the cursor row: the first slice is appended to the head and the tail goes after the last slice
+        //holding a reference to the row text makes truncating it copy, so the tail stays readable
+        int n = reg->num_slices;
+        int tail_len = row->size - at;
+        char* tail = row_text_retain(row->chars);
+
+        editor_insert_rows(b->cursor_y + 1, reg->arena, &reg->slices[1], n - 1);
+        row = &b->row[b->cursor_y];
+        editor_row_truncate(row, at);
+        editor_row_append_string(row, &reg->slices[0].text[reg->slices[0].start], reg->slices[0].len);
+        editor_row_append_string(&b->row[b->cursor_y + n - 1], &tail[at], tail_len);
+        row_text_release(b->text_arena, tail);
+        b->cursor_x = at;
+    }
+}
 
-        if (len % tab_width == 0) {
-            current_count++;
-            if (current_count > e.buffer_count) break;
-            append_buffer_append(ab, "|", 1);
-        } else {
-            append_buffer_append(ab, " ", 1);
-        }
-        len++;
+/*** visual block ***/
+void editor_begin_block_insert(int key) {
+    struct EditorBuffer* b = e.active_buffer;
+    struct BlockInsert* bi = &e.block_insert;
+    int left = b->anchor_x < b->cursor_x ? b->anchor_x : b->cursor_x;
+    int right = b->anchor_x < b->cursor_x ? b->cursor_x : b->anchor_x;
+
+    bi->top = b->anchor_y < b->cursor_y ? b->anchor_y : b->cursor_y;
+    bi->bottom = b->anchor_y < b->cursor_y ? b->cursor_y : b->anchor_y;
+    bi->col = key == 'A' ? right + 1 : left;
+    bi->delete_len = key == 'c' ? right - left + 1 : 0;
+    bi->pad_short_rows = key == 'A';
+    bi->len = 0;
+    bi->active = 1;
+
+    editor_switch_mode(MODE_INSERT);
+    b->cursor_y = bi->top;
+    b->cursor_x = bi->col < b->row[bi->top].size ? utf8_char_start(b->row[bi->top].chars, bi->col) : b->row[bi->top].size;
+}
+
+void editor_block_insert_char(int c) {
+    struct BlockInsert* bi = &e.block_insert;
+    if (bi->len + 1 > bi->capacity) {
+        bi->capacity = bi->capacity ? bi->capacity * 2 : 32;
+        bi->text = realloc(bi->text, bi->capacity);
     }
-    revert_colors(ab);
-    append_buffer_append(ab, "\r\n", 2);
+    bi->text[bi->len++] = c;
 }
 
-//TODO: This might be bugged if line goes off the screen (eg, column offset is not zero)
-void editor_get_borders(int* left_x, int* left_y, int* right_x, int* right_y) {
-    if (e.active_buffer->anchor_y > e.active_buffer->cursor_y) {
-        *left_x = e.active_buffer->render_x;
-        *left_y = e.active_buffer->cursor_y;
-        *right_x = e.active_buffer->anchor_x;
-        *right_y = e.active_buffer->anchor_y;
-    } else if (e.active_buffer->anchor_y < e.active_buffer->cursor_y) {
-        *left_x = e.active_buffer->anchor_x;
-        *left_y = e.active_buffer->anchor_y;
-        *right_x = e.active_buffer->render_x;
-        *right_y = e.active_buffer->cursor_y;
-    } else { //anchor and cursor on same row
-        *left_y = e.active_buffer->anchor_y;
-        *right_y = *left_y;
-        *left_x = e.active_buffer->anchor_x < e.active_buffer->render_x ? e.active_buffer->anchor_x : e.active_buffer->render_x;
-        *right_x = e.active_buffer->anchor_x < e.active_buffer->render_x ? e.active_buffer->render_x : e.active_buffer->anchor_x;
+//the block column is a byte offset, so on rows with multibyte text it is snapped back to a character start
+//and the replaced range is widened to whole characters
+void editor_block_range(struct EditorRow* row, int* col, int* del_end) {
+    struct BlockInsert* bi = &e.block_insert;
+    *col = bi->col < row->size ? utf8_char_start(row->chars, bi->col) : bi->col;
+    *del_end = *col + bi->delete_len < row->size ? *col + bi->delete_len : row->size;
+    if (*del_end < *col) *del_end = *col;
+    if (*del_end < row->size && *del_end > *col) {
+        int last = utf8_char_start(row->chars, *del_end - 1);
+        *del_end = last + utf8_char_len(row->chars, row->size, last);
     }
 }
 
-int editor_char_between_anchors(int file_row, int j, int left_x, int left_y, int right_x, int right_y) {
-    int same_line = left_y == file_row && right_y == file_row && left_x <= j && j <= right_x;
-    int middle_rows = left_y < file_row && file_row < right_y;
-    int right_of_start = right_y > left_y && file_row == left_y && left_x <= j;
-    int left_of_end = right_y > left_y && file_row == right_y && j <= right_x;
+void editor_apply_block_insert() {
+    struct EditorBuffer* b = e.active_buffer;
+    struct BlockInsert* bi = &e.block_insert;
+    bi->active = 0;
+    uint64_t trace = trace_begin();
+
+    for (int y = bi->top; y <= bi->bottom; y++) {
+        struct EditorRow* row = &b->row[y];
+        if (row->size < bi->col && !bi->pad_short_rows) continue;
+
+        int col, del_end;
+        editor_block_range(row, &col, &del_end);
+        int pad = row->size < col ? col - row->size : 0;
+        int del = del_end - col > 0 ? del_end - col : 0;
+        row->chars = row_text_make_writable(e.active_buffer->text_arena, row->chars, row->size, row->size + pad + bi->len - del + 1);
+        if (pad) {
+            memset(&row->chars[row->size], ' ', pad);
+            row->size += pad;
+            row->chars[row->size] = '\0';
+        }
+        memmove(&row->chars[col + bi->len], &row->chars[col + del], row->size - col - del + 1);
+        memcpy(&row->chars[col], bi->text, bi->len);
+        row->size += bi->len - del;
+    }
+    editor_update_rows(bi->top, bi->bottom + 1);
+    b->dirty++;
+    b->edits++;
+    trace_end("block_insert", trace);
 
-    int visual_highlight = e.mode == MODE_VISUAL && (same_line || middle_rows || right_of_start || left_of_end);
+    b->cursor_y = bi->top;
+    b->cursor_x = bi->col < b->row[bi->top].size ? utf8_char_start(b->row[bi->top].chars, bi->col) : b->row[bi->top].size;
+}
 
-    int visual_line = e.mode == MODE_VISUAL_LINE && left_y <= file_row && file_row <= right_y;
+//'d'/'x' on a block: yank it (so 'p' puts it back) and replace it with nothing
+void editor_delete_block() {
+    struct BlockInsert* bi = &e.block_insert;
+    editor_begin_block_insert('c');
+
+    struct EditorRegister* reg = editor_begin_yank(REGISTER_BLOCKWISE, bi->bottom - bi->top + 1);
+    for (int y = bi->top; y <= bi->bottom; y++) {
+        int col, del_end;
+        struct EditorRow* row = editor_row(e.active_buffer, y);
+        editor_block_range(row, &col, &del_end);
+        editor_set_slice(&reg->slices[y - bi->top], row, col, del_end);
+    }
 
-    int left = left_x < right_x ? left_x : right_x;
-    int right = left_x < right_x ? right_x : left_x;
-    int top = left_y;
-    int bottom = right_y;
-    int visual_block = e.mode == MODE_VISUAL_BLOCK && left <= j && j <= right && top <= file_row && file_row <= bottom;
+    editor_apply_block_insert();
+    editor_switch_mode(MODE_COMMAND);
+}
 
-    return visual_block || visual_highlight || visual_line;
+//builds the render/hl arrays of a row as it will look after editor_apply_block_insert
+//only called while drawing, so only visible rows of the block pay for the preview
+int editor_block_preview_row(struct EditorRow* row, char** render, unsigned char** hl) {
+    struct BlockInsert* bi = &e.block_insert;
+    *render = NULL;
+    *hl = NULL;
+    if (row->size < bi->col && !bi->pad_short_rows) return row->render_size;
+
+    int col, del_end;
+    editor_block_range(row, &col, &del_end);
+    int pad = row->size < col ? col - row->size : 0;
+    int start = pad ? row->render_size : editor_row_cursor_x_to_render_offset(row, col);
+    int end = pad ? row->render_size : editor_row_cursor_x_to_render_offset(row, del_end);
+    int size = start + pad + bi->len + (row->render_size - end);
+
+    *render = malloc(size + 1);
+    *hl = malloc(size + 1);
+    memcpy(*render, ROW_RENDER(row), start);
+    editor_row_expand_hl(row, 0, start, *hl);
+    memset(*render + start, ' ', pad);
+    memcpy(*render + start + pad, bi->text, bi->len);
+    memset(*hl + start, HL_NORMAL, pad + bi->len);
+    memcpy(*render + start + pad + bi->len, ROW_RENDER(row) + end, row->render_size - end);
+    editor_row_expand_hl(row, end, row->render_size - end, *hl + start + pad + bi->len);
+    (*render)[size] = '\0';
+    return size;
 }
 
-void editor_draw_rows(struct AppendBuffer* ab) {
-    int y;
-    for (y = 0; y < e.screenrows; y++) {
-        int file_row = y + e.active_buffer->row_offset;
-        if (file_row >= e.active_buffer->num_rows) { //draw empty lines
-            if (e.active_buffer->num_rows == 0 && y == e.screenrows / 3) {
-                char welcome[80];
-                int welcome_len = snprintf(welcome, sizeof(welcome),
-                        "80s Sci-Fi Editor -- version %s", ACORN_VERSION);
-                if (welcome_len > e.screencols) welcome_len = e.screencols;
-                int padding = (e.screencols - welcome_len) / 2;
-                if (padding) {
-                    append_buffer_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) append_buffer_append(ab, " ", 1);
-                append_buffer_append(ab, welcome, welcome_len);
-            } else {
-                append_buffer_append(ab, "~", 1);
-            }
-        } else { //draw text in buffer
-            int len = e.active_buffer->row[file_row].render_size - e.active_buffer->col_offset;
-            if (len < 0) len = 0;
-            if (len > e.screencols) len = e.screencols;
-            char* c = &e.active_buffer->row[file_row].render[e.active_buffer->col_offset];
-            unsigned char* hl = &e.active_buffer->row[file_row].hl[e.active_buffer->col_offset];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                int left_x, left_y, right_x, right_y;
-                editor_get_borders(&left_x, &left_y, &right_x, &right_y);
-                int visual_highlight = editor_char_between_anchors(file_row, j, left_x, left_y, right_x, right_y);
-                int is_cursor_block = e.mode == MODE_COMMAND && e.active_buffer->render_x == j && e.active_buffer->cursor_y == file_row;
-
-                if (visual_highlight || is_cursor_block) {
-                    invert_colors(ab);
-                    append_buffer_append(ab, &c[j], 1);
-                    revert_colors(ab);
-                    //reset current color
-                    if (current_color != -1) {
-                        char* c = editor_color_to_string(current_color);
-                        append_buffer_append(ab, c, strlen(c)); 
-                    }
-                } else if (iscntrl(c[j])) { //TODO: combine this and above blocks into one (they share mostly same code except for symbol conversion)
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    invert_colors(ab);
-                    append_buffer_append(ab, &sym, 1);
-                    revert_colors(ab);
-                    //reset current color
-                    if (current_color != -1) {
-                        char* c = editor_color_to_string(current_color);
-                        append_buffer_append(ab, c, strlen(c)); 
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
-                        current_color = -1;
-                    }
-                    append_buffer_append(ab, &c[j], 1);
-                } else {
-                    int color = editor_syntax_to_color(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                      
-                        char* c = editor_color_to_string(current_color);
-                        append_buffer_append(ab, c, strlen(c)); 
-                    }
-                    append_buffer_append(ab, &c[j], 1);
-                }
-            }
-            append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+/*** global command ***/
+//:g/pattern/cmd runs 'cmd' on every row containing 'pattern' (:v/pattern/cmd and :g!/pattern/cmd on every row without it)
+//'cmd' is 'd' or 'normal KEYS'. The pattern is matched literally, like '/' does.
+//rows are marked in one scan first, so the command never sees rows created by running it
+
+//deletes the marked rows by compacting the row array in a single pass instead of one memmove per row
+//a row that ends up after a different row than before is only re-highlighted if its comment state coming in changed
+int editor_delete_marked_rows(unsigned char* marked) {
+    struct EditorBuffer* b = e.active_buffer;
+    int* seams = malloc(sizeof(int) * (b->num_rows + 1)); //rows that lost the row before them
+    unsigned char* seam_comment = malloc(b->num_rows + 1); //comment state they were highlighted with
+    int num_seams = 0;
+
+    int kept = 0;
+    int first = b->num_rows; //rows before the first deleted one stay where they are
+    for (int j = 0; j < b->num_rows; j++) {
+        if (marked[j]) {
+            editor_free_row(&b->row[j]);
+            if (first > j) first = j;
+            continue;
+        }
+        if (j > 0 && marked[j - 1]) {
+            seams[num_seams] = kept;
+            seam_comment[num_seams++] = b->row[j - 1].hl_open_comment;
         }
+        b->row[kept++] = b->row[j];
+    }
+    int deleted = b->num_rows - kept;
+    b->num_rows = kept;
+    if (deleted) editor_wrap_moved(b, first);
 
-        append_buffer_append(ab, "\x1b[K", 3); //clear to end of line
-        append_buffer_append(ab, "\r\n", 2);
+    for (int i = 0; i < num_seams; i++) {
+        int in_comment = editor_prev_open_comment(b, &b->row[seams[i]]);
+        if (in_comment != seam_comment[i]) editor_update_syntax(b, &b->row[seams[i]], in_comment);
+    }
+    free(seams);
+    free(seam_comment);
+
+    if (b->num_rows == 0) editor_insert_row(0, "", 0);
+    if (b->cursor_y >= b->num_rows) b->cursor_y = b->num_rows - 1;
+    b->cursor_x = 0;
+    if (deleted) {
+        b->dirty++;
+        b->edits++;
     }
+    return deleted;
 }
 
-void editor_draw_status_bar(struct AppendBuffer* ab) {
-    invert_colors(ab);
+void editor_global(char* command) {
+    editor_load_finish(e.active_buffer);
+    int invert = command[0] == 'v' || command[1] == '!';
+    char* pattern = strchr(command, '/') + 1;
+
+    //the pattern runs up to the next unescaped '/' (and '\/' is a literal '/')
+    char* p = pattern;
+    char* out = pattern;
+    while (*p && *p != '/') {
+        if (p[0] == '\\' && p[1] == '/') p++;
+        *out++ = *p++;
+    }
+    char* cmd = *p == '/' ? p + 1 : p;
+    *out = '\0';
 
-    char status[80];
-    int msglen = strlen(e.status_msg);
-    if (msglen > e.screencols) msglen = e.screencols;
-    int show_msg = msglen && time(NULL) - e.status_msg_time < 5 ? 1 : 0;
-    
-    char* mode_str;
-    switch (e.mode) {
-        case MODE_INSERT:
-            mode_str = "-- INSERT --";
-            break;
-        case MODE_VISUAL:
-            mode_str = "-- VISUAL --";
-            break;
-        case MODE_VISUAL_LINE:
-            mode_str = "-- VISUAL LINE --";
-            break;
-        case MODE_VISUAL_BLOCK:
-            mode_str = "-- VISUAL BLOCK --";
-            break;
-        default:
-            mode_str = "-- COMMAND --";
-            break;
+    if (pattern[0] == '\0') {
+        editor_set_status_message("Empty pattern");
+        return;
+    }
+    if (strcmp(cmd, "d") && strncmp(cmd, "normal ", 7)) {
+        editor_set_status_message("Only d and normal are supported with :g");
+        return;
+    }
+    if (editor_read_only()) return;
+
+    struct EditorBuffer* b = e.active_buffer;
+    int pattern_len = strlen(pattern);
+    unsigned char* marked = malloc(b->num_rows);
+    int matches = 0;
+    for (int j = 0; j < b->num_rows; j++) {
+        marked[j] = (memmem(b->row[j].chars, b->row[j].size, pattern, pattern_len) != NULL) != invert;
+        matches += marked[j];
     }
 
-    int len = snprintf(status, sizeof(status), "%s", show_msg ? e.status_msg : mode_str);
+    if (cmd[0] == 'd') {
+        int deleted = editor_delete_marked_rows(marked);
+        editor_set_status_message("%d fewer lines", deleted);
+    } else {
+        //bottom up, so commands that add or remove rows at (or below) the cursor don't move the rows still to go
+        for (int j = b->num_rows - 1; j >= 0; j--) {
+            if (!marked[j] || j >= b->num_rows) continue;
+            b->cursor_y = j;
+            b->cursor_x = 0;
+            e.queued_keys = &cmd[7];
+            while (*e.queued_keys) editor_process_key(editor_read_key());
+            e.queued_keys = NULL;
+            if (e.mode != MODE_COMMAND) editor_switch_mode(MODE_COMMAND);
+        }
+        if (b->cursor_y >= b->num_rows) b->cursor_y = b->num_rows - 1;
+        editor_set_status_message("%d lines matched", matches);
+    }
+    free(marked);
+}
 
-    char rstatus[80];
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s %s | %d/%d", e.active_buffer->dirty ? "(modified)": "",
-            e.active_buffer->filename ? e.active_buffer->filename : "[No Name]", e.active_buffer->cursor_y + 1, e.active_buffer->num_rows);
+/*** filter ***/
+//parses an address (a line number, '.' or '$') into a row index, returns NULL if there isn't one
+char* editor_parse_address(char* p, int* row) {
+    if (*p == '.') {
+        *row = e.active_buffer->cursor_y;
+        return p + 1;
+    } else if (*p == '$') {
+        *row = e.active_buffer->num_rows - 1;
+        return p + 1;
+    } else if (isdigit(*p)) {
+        *row = (int) strtol(p, &p, 10) - 1;
+        return p;
+    }
+    return NULL;
+}
 
-    if (len > e.screencols) len = e.screencols;
-    append_buffer_append(ab, status, len);
-    while (len < e.screencols) {
-        if (e.screencols - len == rlen) {
-            append_buffer_append(ab, rstatus, rlen);
-            break;
-        } else {
-            append_buffer_append(ab, " ", 1);
-            len++;
+//parses '%', 'a' or 'a,b' at the start of 'command' into rows [*start, *end), returns what follows (NULL if there is no range)
+char* editor_parse_range(char* command, int* start, int* end) {
+    editor_load_finish(e.active_buffer); //'%' and '$' mean the end of the file, not of what's loaded so far
+    if (command[0] == '%') {
+        *start = 0;
+        *end = e.active_buffer->num_rows;
+        return command + 1;
+    }
+    int first, last;
+    char* p = editor_parse_address(command, &first);
+    if (p == NULL) return NULL;
+    last = first;
+    if (*p == ',' && (p = editor_parse_address(p + 1, &last)) == NULL) return NULL;
+    if (first > last) {
+        int tmp = first;
+        first = last;
+        last = tmp;
+    }
+    *start = first < 0 ? 0 : first;
+    *end = last + 1 > e.active_buffer->num_rows ? e.active_buffer->num_rows : last + 1;
+    return p;
+}
+
+void editor_filter_close_input() {
+    if (e.filter.to_child != -1) close(e.filter.to_child);
+    e.filter.to_child = -1;
+}
+
+//removes rows [start, end) of the filter's buffer in one pass
+void editor_filter_delete_rows(int start, int end) {
+    struct EditorBuffer* b = e.active_buffer;
+    if (start >= end) return;
+    unsigned char* marked = calloc(b->num_rows, 1);
+    memset(&marked[start], 1, end - start);
+    editor_delete_marked_rows(marked);
+    free(marked);
+}
+
+//writes as many rows as the pipe will take, without ever joining them into one string
+void editor_filter_write() {
+    struct Filter* f = &e.filter;
+    struct iovec iov[64];
+    while (f->next_row < f->end) {
+        int n = 0;
+        for (int j = f->next_row; j < f->end && n + 2 <= 64; j++) {
+            struct EditorRow* row = &f->buffer->row[j];
+            int offset = j == f->next_row ? f->row_offset : 0;
+            if (offset < row->size) iov[n++] = (struct iovec) { row->chars + offset, row->size - offset };
+            iov[n++] = (struct iovec) { "\n", 1 };
+        }
+        ssize_t written = writev(f->to_child, iov, n);
+        if (written == -1) {
+            if (errno == EAGAIN) return;
+            break; //the command stopped reading (EPIPE) - whatever it wrote so far is its output
+        }
+        //move past what was written
+        while (written > 0) {
+            int left = f->buffer->row[f->next_row].size + 1 - f->row_offset;
+            if (written >= left) {
+                written -= left;
+                f->next_row++;
+                f->row_offset = 0;
+            } else {
+                f->row_offset += written;
+                written = 0;
+            }
         }
     }
-    revert_colors(ab);
+    editor_filter_close_input(); //sends EOF
 }
 
-void editor_refresh_screen() {
-    editor_scroll();
+//splits new output into rows and inserts all complete lines with one bulk insert
+void editor_filter_output(char* data, int len, int eof) {
+    struct Filter* f = &e.filter;
+    int num_lines = 0;
+    for (int i = 0; i < len; i++) num_lines += data[i] == '\n';
+    if (eof && (f->partial_len > 0 || (len > 0 && data[len - 1] != '\n'))) num_lines++;
+    if (num_lines == 0) {
+        if (f->partial_len + len > f->partial_capacity) {
+            f->partial_capacity = (f->partial_len + len) * 2;
+            f->partial = realloc(f->partial, f->partial_capacity);
+        }
+        memcpy(&f->partial[f->partial_len], data, len);
+        f->partial_len += len;
+        return;
+    }
 
-    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    struct RegisterSlice* lines = malloc(sizeof(struct RegisterSlice) * num_lines);
+    int count = 0;
+    char* p = data;
+    char* end = data + len;
+    char* joined = NULL; //the first line, if part of it came with an earlier read
+    while (count < num_lines) {
+        char* newline = memchr(p, '\n', end - p);
+        char* line_end = newline ? newline : end;
+        if (count == 0 && f->partial_len > 0) {
+            joined = malloc(f->partial_len + (line_end - p));
+            memcpy(joined, f->partial, f->partial_len);
+            memcpy(joined + f->partial_len, p, line_end - p);
+            lines[count++] = (struct RegisterSlice) { joined, 0, f->partial_len + (int) (line_end - p) };
+            f->partial_len = 0;
+        } else {
+            lines[count++] = (struct RegisterSlice) { p, 0, (int) (line_end - p) };
+        }
+        struct RegisterSlice* line = &lines[count - 1];
+        if (line->len > 0 && line->text[line->len - 1] == '\r') line->len--;
+        p = newline ? newline + 1 : end;
+    }
 
-    append_buffer_append(&ab, HIDE_CURSOR, strlen(HIDE_CURSOR)); //to avoid flicker when redrawing
-    append_buffer_append(&ab, "\x1b[H", 3);  //move cursor back to beginning
+    struct EditorBuffer* active = e.active_buffer;
+    e.active_buffer = f->buffer;
+    editor_insert_rows(f->end + f->inserted, NULL, lines, count);
+    e.active_buffer = active;
+    f->inserted += count;
+    free(lines);
+    free(joined);
 
-    append_buffer_append(&ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
-    append_buffer_append(&ab, COLOR_BACKGROUND, strlen(COLOR_BACKGROUND));
+    //keep the rest of an unfinished line
+    if (p < end) editor_filter_output(p, end - p, 0);
+}
 
-    editor_draw_buffer_tabs(&ab);
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
+void editor_filter_reap(int* status) {
+    if (e.filter.from_child != -1) close(e.filter.from_child);
+    editor_filter_close_input();
+    waitpid(e.filter.pid, status, 0);
+    e.filter.pid = 0;
+    e.filter.from_child = -1;
+    e.filter.partial_len = 0;
+}
 
-    //draw cursor
-    if (e.mode == MODE_INSERT) {
-        char buf[32];
-        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (e.active_buffer->cursor_y - e.active_buffer->row_offset) + 2,  //terminal uses index 1.  Adding 1 for tabs bar
-                                                  (e.active_buffer->render_x - e.active_buffer->col_offset) + 1); //adding 1 since terminal uses starting index 1
-        append_buffer_append(&ab, buf, strlen(buf));
+//the command closed its output: replace the range with what it wrote (unless it failed)
+void editor_filter_finish() {
+    struct Filter* f = &e.filter;
+    editor_filter_output(NULL, 0, 1);
+    int status;
+    editor_filter_reap(&status);
+
+    struct EditorBuffer* active = e.active_buffer;
+    e.active_buffer = f->buffer;
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (ok) {
+        editor_filter_delete_rows(f->start, f->end);
+        if (f->buffer->num_rows > f->inserted || f->inserted == 0) f->buffer->cursor_y = f->start;
+    } else {
+        editor_filter_delete_rows(f->end, f->end + f->inserted);
+        f->buffer->dirty = f->dirty;
     }
+    if (f->buffer->cursor_y >= f->buffer->num_rows) f->buffer->cursor_y = f->buffer->num_rows - 1;
+    f->buffer->cursor_x = 0;
+    e.active_buffer = active;
 
-    append_buffer_append(&ab, SHOW_CURSOR, strlen(SHOW_CURSOR));
-         
-    write(STDOUT_FILENO, ab.buffer, ab.len); 
-    append_buffer_free(&ab); 
-
-} 
+    if (ok) editor_set_status_message("%d lines filtered into %d", f->end - f->start, f->inserted);
+    else editor_set_status_message("Filter failed (exit status %d), buffer unchanged", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
 
-void editor_set_status_message(const char* fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(e.status_msg, sizeof(e.status_msg), fmt, ap);
-    va_end(ap);
-    e.status_msg_time = time(NULL);
+void editor_filter_cancel() {
+    struct Filter* f = &e.filter;
+    if (f->pid == 0) return;
+    kill(f->pid, SIGTERM);
+    editor_filter_reap(NULL);
+
+    struct EditorBuffer* active = e.active_buffer;
+    e.active_buffer = f->buffer;
+    editor_filter_delete_rows(f->end, f->end + f->inserted);
+    f->buffer->dirty = f->dirty;
+    e.active_buffer = active;
+    editor_set_status_message("Filter cancelled");
 }
 
-/*** input ***/
-char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
-    size_t buffer_size = 128;
-    char* buffer = malloc(buffer_size);
+//the filter's two pipes for editor_poll (closed ones are -1, which poll skips)
+void editor_filter_fds(struct pollfd* fds) {
+    struct Filter* f = &e.filter;
+    fds[0] = (struct pollfd) { f->pid ? f->from_child : -1, POLLIN, 0 };
+    fds[1] = (struct pollfd) { f->pid ? f->to_child : -1, POLLOUT, 0 };
+}
 
-    size_t buffer_len = 0;
-    buffer[0] = '\0';
+//moves data through the pipes that editor_poll found ready
+void editor_filter_pump(struct pollfd* fds) {
+    struct Filter* f = &e.filter;
+    if (fds[1].revents) editor_filter_write();
+    if (fds[0].revents) {
+        static char data[ACORN_FILTER_READ];
+        //drain what's there (up to a limit, so keys still get a look in)
+        for (int reads = 0; reads < 16; reads++) {
+            ssize_t n = read(f->from_child, data, sizeof(data));
+            if (n > 0) {
+                editor_filter_output(data, n, 0);
+            } else {
+                if (n == 0 || errno != EAGAIN) editor_filter_finish();
+                break;
+            }
+        }
+    }
 
-    while (1) {
-        editor_set_status_message(prompt, buffer);
+    uint64_t now = perf_now();
+    if (f->pid == 0 || now - f->last_refresh > 100000000) {
+        f->last_refresh = now;
         editor_refresh_screen();
+    }
+}
 
-        int c = editor_read_key();
+//:{range}!cmd
+void editor_filter(int start, int end, char* command) {
+    if (e.filter.pid) {
+        editor_set_status_message("A filter is already running");
+        return;
+    }
+    if (editor_read_only()) return;
+
+    int input[2], output[2];
+    //close-on-exec so children started while the filter runs (eg, a compressor on :w) don't hold our ends open
+    //dup2 clears the flag on the child's stdin/stdout
+    if (pipe2(input, O_CLOEXEC) == -1) die("pipe");
+    if (pipe2(output, O_CLOEXEC) == -1) die("pipe");
+    signal(SIGPIPE, SIG_IGN); //a command that exits without reading everything shows up as EPIPE instead
+
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY); //errors would be drawn over the editor
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        if (null != -1) dup2(null, STDERR_FILENO);
+        close(input[0]);
+        close(input[1]);
+        close(output[0]);
+        close(output[1]);
+        signal(SIGPIPE, SIG_DFL); //ignored signals survive exec, and pipelines like 'yes | head' rely on SIGPIPE to stop
+        execl("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+    close(input[0]);
+    close(output[1]);
+    fcntl(input[1], F_SETFL, fcntl(input[1], F_GETFL) | O_NONBLOCK);
+    fcntl(output[0], F_SETFL, fcntl(output[0], F_GETFL) | O_NONBLOCK);
+
+    struct Filter* f = &e.filter;
+    f->pid = pid;
+    f->buffer = e.active_buffer;
+    f->to_child = input[1];
+    f->from_child = output[0];
+    f->start = start;
+    f->end = end;
+    f->next_row = start;
+    f->row_offset = 0;
+    f->inserted = 0;
+    f->dirty = e.active_buffer->dirty;
+    f->partial_len = 0;
+    f->last_refresh = perf_now();
+    editor_set_status_message("Filtering through %s (Ctrl-C cancels)", command);
+}
+
+/*** file i/o ***/
+char* editor_rows_to_string(int* buffer_length) {
+    int total_length = 0;
+    int j;
+    for (j = 0; j < e.active_buffer->num_rows; j++)
+        total_length += e.active_buffer->row[j].size + 1;
+    *buffer_length = total_length;
+
+    char* buffer_str = malloc(total_length);
+    char* p = buffer_str;
+    for (j = 0; j < e.active_buffer->num_rows; j++) {
+        memcpy(p, e.active_buffer->row[j].chars, e.active_buffer->row[j].size);
+        p += e.active_buffer->row[j].size;
+        *p = '\n';
+        p++;
+    }
+    return buffer_str;
+}
+
+void editor_init_buffer(struct EditorBuffer* buffer) {
+    buffer->cursor_x = 0;
+    buffer->cursor_y = 0;
+    buffer->anchor_x = 0;
+    buffer->anchor_y = 0;
+    buffer->render_x = 0;
+    buffer->row_offset = 0;
+    buffer->col_offset = 0;
+    buffer->num_rows = 0;
+    buffer->dirty = 0;
+    buffer->edits = 0;
+    buffer->row = NULL;
+    buffer->filename = NULL;
+    buffer->syntax = NULL;
+    buffer->row_capacity = 0;
+    buffer->paged = NULL;
+    buffer->loading = NULL;
+    buffer->text_arena = arena_new();
+    buffer->derived_arena = arena_new();
+    buffer->last_used = 0;
+    buffer->derived_bytes = 0;
+    buffer->evicted = 0;
+    buffer->watch = -1;
+    buffer->mtime = (struct timespec) { 0, 0 };
+    buffer->file_size = 0;
+    buffer->disk_changed = 0;
+    buffer->follow = 0;
+    buffer->follow_offset = 0;
+    buffer->follow_inode = 0;
+    buffer->follow_partial = 0;
+    buffer->compressor = NULL;
+    buffer->wrap = (struct WrapIndex) { NULL, 0, 0, 0, 0 };
+    buffer->wrap_offset = 0;
+    buffer->match_row = -1;
+}
+
+int editor_buffer_index(struct EditorBuffer* buffer) {
+    for (int i = 0; i < e.buffer_count; i++)
+        if (e.buffers[i] == buffer) return i;
+    return -1;
+}
+
+size_t editor_buffer_derived_bytes(struct EditorBuffer* buffer) {
+    return buffer->derived_arena->reserved;
+}
+
+//render and hl can always be rebuilt from chars, so inactive buffers only keep them while they fit in the budget
+void editor_evict_buffers() {
+    size_t total = 0;
+    for (int i = 0; i < e.buffer_count; i++)
+        if (e.buffers[i] != e.active_buffer && !e.buffers[i]->evicted) total += e.buffers[i]->derived_bytes;
+
+    while (total > e.cache_budget) {
+        struct EditorBuffer* lru = NULL;
+        for (int i = 0; i < e.buffer_count; i++) {
+            struct EditorBuffer* b = e.buffers[i];
+            if (b == e.active_buffer || b->evicted) continue;
+            if (lru == NULL || b->last_used < lru->last_used) lru = b;
+        }
+        if (lru == NULL) break;
+
+        //paged buffers just drop their cached pages - they'll be read back in when needed
+        if (lru->paged) {
+            editor_free_pages(lru);
+            lru->evicted = 1;
+            total -= lru->derived_bytes;
+            continue;
+        }
+
+        arena_release(lru->derived_arena);
+        lru->derived_arena = arena_new();
+        for (int j = 0; j < lru->num_rows; j++) {
+            lru->row[j].render = NULL;
+            editor_row_release_hl(&lru->row[j]);
+            lru->row[j].render_size = 0;
+        }
+        lru->evicted = 1;
+        total -= lru->derived_bytes;
+    }
+}
+
+void editor_switch_buffer(int index) {
+    if (index < 0 || index >= e.buffer_count) return;
+
+    if (e.active_buffer) e.active_buffer->derived_bytes = editor_buffer_derived_bytes(e.active_buffer);
+    e.active_buffer = e.buffers[index];
+    e.active_buffer->last_used = ++e.buffer_clock;
+    editor_index_sync(e.active_buffer);
+
+    if (e.active_buffer->evicted) {
+        e.active_buffer->evicted = 0;
+        if (e.active_buffer->paged == NULL) editor_update_rows(0, e.active_buffer->num_rows);
+    }
+    editor_evict_buffers();
+}
+
+void editor_close_buffer(int index) {
+    if (index < 0 || index >= e.buffer_count) return;
+
+    //all row text and render goes with the arenas, but highlighting may be shared with other buffers
+    struct EditorBuffer* buffer = e.buffers[index];
+    if (e.filter.pid && e.filter.buffer == buffer) editor_filter_cancel();
+    if (e.share.role && e.share.buffer == buffer) editor_share_stop();
+    editor_unwatch_buffer(buffer);
+    editor_load_close(buffer);
+    editor_detach_registers(buffer->text_arena);
+    if (buffer->paged == NULL)
+        for (int j = 0; j < buffer->num_rows; j++) editor_row_release_hl(&buffer->row[j]);
+    editor_close_paged(buffer);
+    arena_release(buffer->text_arena);
+    arena_release(buffer->derived_arena);
+    free(buffer->row);
+    free(buffer->wrap.tree);
+    free(buffer->filename);
+    free(buffer);
+
+    memmove(&e.buffers[index], &e.buffers[index + 1], sizeof(struct EditorBuffer*) * (e.buffer_count - index - 1));
+    e.buffer_count--;
+
+    if (buffer == e.active_buffer) {
+        e.active_buffer = NULL;
+        editor_switch_buffer(index < e.buffer_count ? index : e.buffer_count - 1);
+    }
+}
+
+//reads up to 'len' bytes of 'fd' from 'offset' into a new buffer, *got is less if the file got shorter meanwhile
+//used instead of mmap for files other programs can write: touching a mapped page past a truncated end is a SIGBUS
+char* editor_read_fd(int fd, off_t offset, size_t len, size_t* got) {
+    char* data = malloc(len ? len : 1);
+    *got = 0;
+    while (*got < len) {
+        ssize_t n = pread(fd, &data[*got], len - *got, offset + *got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        *got += n;
+    }
+    return data;
+}
+
+//a piece of the file that starts at the beginning of a line and ends just after a newline (or at the end of the file)
+struct LoadChunk {
+    char* start;
+    char* end;
+    struct RegisterSlice* lines;
+    int num_lines;
+    int capacity;
+};
+
+void* editor_split_chunk(void* arg) {
+    struct LoadChunk* chunk = arg;
+    uint64_t trace = trace_begin();
+    char* p = chunk->start;
+    while (p < chunk->end) {
+        char* newline = memchr(p, '\n', chunk->end - p);
+        char* line_end = newline ? newline : chunk->end;
+
+        int len = line_end - p;
+        while (len > 0 && p[len - 1] == '\r') len--;
+        if (chunk->num_lines == chunk->capacity) {
+            chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+            chunk->lines = realloc(chunk->lines, sizeof(struct RegisterSlice) * chunk->capacity);
+        }
+        chunk->lines[chunk->num_lines++] = (struct RegisterSlice) { p, 0, len };
+
+        if (newline == NULL) break;
+        p = newline + 1;
+    }
+    trace_end("split_lines", trace);
+    return NULL;
+}
+
+//splits 'data' into lines on one thread per chunk, the slices point into 'data'
+struct RegisterSlice* editor_split_lines(char* data, off_t size, int* num_lines) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_chunks = size / ACORN_LOAD_CHUNK + 1;
+    if (num_chunks > cpus) num_chunks = cpus > 0 ? cpus : 1;
+    if (num_chunks > ACORN_LOAD_THREADS) num_chunks = ACORN_LOAD_THREADS;
+
+    //chunk boundaries are moved forward to the next line so no line is split between two threads
+    struct LoadChunk chunks[ACORN_LOAD_THREADS];
+    char* start = data;
+    for (int i = 0; i < num_chunks; i++) {
+        char* end = data + size * (i + 1) / num_chunks;
+        if (end < start) end = start;
+        if (end < data + size) {
+            char* newline = memchr(end, '\n', data + size - end);
+            end = newline ? newline + 1 : data + size;
+        }
+        chunks[i] = (struct LoadChunk) { start, end, NULL, 0, 0 };
+        start = end;
+    }
+
+    pthread_t threads[ACORN_LOAD_THREADS];
+    for (int i = 1; i < num_chunks; i++)
+        if (pthread_create(&threads[i], NULL, editor_split_chunk, &chunks[i]) != 0) die("pthread_create");
+    editor_split_chunk(&chunks[0]);
+    for (int i = 1; i < num_chunks; i++) pthread_join(threads[i], NULL);
+
+    //one table for the whole file, so it can be inserted (and rendered and highlighted) in a single pass
+    int total = 0;
+    for (int i = 0; i < num_chunks; i++) total += chunks[i].num_lines;
+    struct RegisterSlice* lines = realloc(chunks[0].lines, sizeof(struct RegisterSlice) * (total ? total : 1));
+    int n = chunks[0].num_lines;
+    for (int i = 1; i < num_chunks; i++) {
+        memcpy(&lines[n], chunks[i].lines, sizeof(struct RegisterSlice) * chunks[i].num_lines);
+        n += chunks[i].num_lines;
+        free(chunks[i].lines);
+    }
+    *num_lines = total;
+    return lines;
+}
+
+//reads and splits the rest of a file that's being opened, the rows are appended by the main thread
+void* editor_load_thread(void* arg) {
+    struct LoadingFile* loading = arg;
+    size_t got;
+    char* data = editor_read_fd(loading->fd, loading->offset, loading->size - loading->offset, &got);
+    int num_lines;
+    struct RegisterSlice* lines = editor_split_lines(data, got, &num_lines);
+
+    pthread_mutex_lock(&loading->lock);
+    loading->data = data;
+    loading->lines = lines;
+    loading->num_lines = num_lines;
+    loading->split = 1;
+    pthread_cond_broadcast(&loading->ready);
+    pthread_mutex_unlock(&loading->lock);
+    return NULL;
+}
+
+//splits the first block of the file into rows so the first screen can be drawn right away
+//a bigger file keeps 'fd' and gets the rest read in on a thread (see editor_load_append)
+void editor_load_file(int fd, off_t size) {
+    size_t got;
+    char* data = editor_read_fd(fd, 0, size < ACORN_LOAD_FIRST ? size : ACORN_LOAD_FIRST, &got);
+    int more = got == ACORN_LOAD_FIRST && size > ACORN_LOAD_FIRST;
+    size_t first = got;
+    if (more) { //the thread carries on from the last full line
+        char* newline = memrchr(data, '\n', got);
+        first = newline ? (size_t) (newline + 1 - data) : 0;
+    }
+
+    int total;
+    struct RegisterSlice* lines = editor_split_lines(data, first, &total);
+    editor_insert_rows(0, NULL, lines, total);
+    free(lines);
+    free(data);
+    if (!more) {
+        close(fd);
+        return;
+    }
+
+    struct LoadingFile* loading = calloc(1, sizeof(struct LoadingFile));
+    loading->fd = fd;
+    loading->offset = first;
+    loading->size = size;
+    pthread_mutex_init(&loading->lock, NULL);
+    pthread_cond_init(&loading->ready, NULL);
+    e.active_buffer->loading = loading;
+    if (pthread_create(&loading->thread, NULL, editor_load_thread, loading) != 0) die("pthread_create");
+}
+
+//appends up to 'count' more rows of a loading file - returns 1 if the buffer grew
+//until the thread has split the rest of the file this returns 0 right away, or blocks if 'wait' is set
+int editor_load_append(struct EditorBuffer* buffer, int count, int wait) {
+    struct LoadingFile* loading = buffer->loading;
+    pthread_mutex_lock(&loading->lock);
+    while (wait && !loading->split) pthread_cond_wait(&loading->ready, &loading->lock);
+    int split = loading->split;
+    pthread_mutex_unlock(&loading->lock);
+    if (!split) return 0;
+
+    int n = loading->num_lines - loading->next_line;
+    if (n > count) n = count;
+    struct EditorBuffer* active = e.active_buffer;
+    e.active_buffer = buffer;
+    int dirty = buffer->dirty;
+    editor_insert_rows(buffer->num_rows, NULL, &loading->lines[loading->next_line], n);
+    buffer->dirty = dirty; //these rows are the file, not changes to it
+    e.active_buffer = active;
+
+    pthread_mutex_lock(&loading->lock);
+    loading->next_line += n;
+    pthread_mutex_unlock(&loading->lock);
+    if (loading->next_line == loading->num_lines) editor_load_close(buffer);
+    return n > 0;
+}
+
+//appends what's left of the file - anything that edits, saves or searches the buffer needs all of it
+void editor_load_finish(struct EditorBuffer* buffer) {
+    if (buffer->loading) editor_index_wait(buffer, INT_MAX);
+}
+
+//appends rows between keys, until a key comes in or a frame's worth of time has gone by - returns 1 if the buffer grew
+int editor_load_idle(struct EditorBuffer* buffer) {
+    uint64_t start = perf_now();
+    int grew = 0;
+    while (buffer->loading && editor_load_append(buffer, ACORN_LOAD_BATCH, 0)) {
+        grew = 1;
+        struct pollfd input = { editor_input_fd(), POLLIN, 0 };
+        if (perf_now() - start > 16000000 || poll(&input, 1, 0) > 0) break;
+    }
+    return grew;
+}
+
+//stops loading (joining the thread if it's still reading) - the rows appended so far stay
+void editor_load_close(struct EditorBuffer* buffer) {
+    struct LoadingFile* loading = buffer->loading;
+    if (loading == NULL) return;
+    pthread_join(loading->thread, NULL);
+    pthread_mutex_destroy(&loading->lock);
+    pthread_cond_destroy(&loading->ready);
+    close(loading->fd);
+    free(loading->lines);
+    free(loading->data);
+    free(loading);
+    buffer->loading = NULL;
+}
+
+//adds an empty buffer for 'filename' (nothing is read yet) and makes it the active one
+void editor_new_buffer(char* filename) {
+    if (e.buffer_count == e.buffer_capacity) {
+        e.buffer_capacity = e.buffer_capacity ? e.buffer_capacity * 2 : 16;
+        e.buffers = realloc(e.buffers, sizeof(struct EditorBuffer*) * e.buffer_capacity);
+    }
+
+    struct EditorBuffer* buffer = malloc(sizeof(struct EditorBuffer));
+    editor_init_buffer(buffer);
+    e.buffers[e.buffer_count++] = buffer;
+    editor_switch_buffer(e.buffer_count - 1);
+
+    e.active_buffer->filename = filename == NULL ? NULL : strdup(filename);
+    e.active_buffer->compressor = filename == NULL ? NULL : editor_detect_compressor(filename);
+    editor_select_syntax_highlight();
+}
+
+void editor_open_buffer(char* filename) {
+    editor_new_buffer(filename);
+
+    struct stat st;
+    if (e.active_buffer->compressor && stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            editor_load_compressed(filename, e.active_buffer->compressor) == 0) {
+        //no paging for these, the whole text has to come through the decompressor anyway
+        e.active_buffer->mtime = st.st_mtim;
+        e.active_buffer->file_size = st.st_size;
+    } else if (filename != NULL && stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > e.large_file_size) {
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) die("open");
+        editor_open_paged(fd, st.st_size);
+        e.active_buffer->mtime = st.st_mtim;
+        e.active_buffer->file_size = st.st_size;
+    } else if (filename != NULL && stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) die("open");
+        editor_load_file(fd, st.st_size); //keeps 'fd' if the rest of the file is read in the background
+        editor_index_wait(e.active_buffer, e.screenrows); //only the first screen has to be loaded before we can draw
+        if (e.headless) editor_load_finish(e.active_buffer); //replay frames have to come out the same every run
+        //the size the rows were read at, not whatever the file has grown to since (:follow carries on from there)
+        e.active_buffer->mtime = st.st_mtim;
+        e.active_buffer->file_size = st.st_size;
+    } else if (filename != NULL && access(filename, F_OK) == 0) {
+        FILE* fp = fopen(filename, "r");
+        if (!fp) die("fopen");
+
+        char* line = NULL;
+        size_t line_capacity = 0;
+        ssize_t linelen;
+        while ((linelen = getline(&line, &line_capacity, fp)) != -1) {
+            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] =='\r'))
+                linelen--;
+            editor_insert_row(e.active_buffer->num_rows, line, linelen);
+        }
+        free(line);
+        fclose(fp);
+        editor_record_file(e.active_buffer);
+    } else {
+        editor_insert_row(0, "", 0);
+    } 
+
+    e.active_buffer->dirty = 0;
+    editor_watch_buffer(e.active_buffer);
+}
+
+
+void editor_save(int force) {
+    if (e.active_buffer->filename == NULL) {
+        editor_set_status_message("Save using :w [filename]");
+        return;
+        /*
+        e.active_buffer->filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+        if (e.active_buffer->filename == NULL) {
+            editor_set_status_message("Save aborted");
+            return;
+        }*/
+    }
+    if (editor_read_only()) return;
+    if (e.active_buffer->disk_changed && !force) {
+        editor_set_status_message("File changed on disk since it was read. (Add ! to override).");
+        return;
+    }
+    editor_select_syntax_highlight();
+
+    int len = 0;
+    int saved = 0;
+    if (e.active_buffer->compressor) {
+        saved = editor_save_compressed(e.active_buffer->filename, e.active_buffer->compressor, &len) != -1;
+    } else {
+        int fd = open(e.active_buffer->filename, O_RDWR | O_CREAT, 0644); //0644 is standard permissions - owner gets read/write, otherwise only read
+        if (fd != -1) {
+            char* buffer_str = editor_rows_to_string(&len);
+            saved = ftruncate(fd, len) != -1 && write(fd, buffer_str, len) == len;
+            free(buffer_str);
+            close(fd);
+        }
+    }
+    if (!saved) {
+        editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    e.active_buffer->dirty = 0;
+    e.active_buffer->disk_changed = 0;
+    editor_watch_buffer(e.active_buffer);
+    editor_record_file(e.active_buffer); //so our own write isn't taken for a change
+    if (e.active_buffer->compressor) editor_set_status_message("%d bytes written to disk (%s)", len, e.active_buffer->compressor->name);
+    else editor_set_status_message("%d bytes written to disk", len);
+}
+
+/*** compressed files ***/
+//.gz and .zst files are decompressed by gzip and zstd running in a child process, so decompressing the next block
+//overlaps with splitting and highlighting this one (the pipe is made big enough to hold a block), and no uncompressed
+//copy is ever written to disk. saving pipes the rows back through the same tool
+
+//the compressor for a file going by its first bytes (or its name, if it's empty or doesn't exist yet)
+struct Compressor* editor_detect_compressor(char* filename) {
+    char magic[4];
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd == -1 ? 0 : read(fd, magic, sizeof(magic));
+    if (fd != -1) close(fd);
+    if (n <= 0) return editor_compressor_for_name(filename);
+
+    for (unsigned int i = 0; i < COMPRESSOR_ENTRIES; i++)
+        if (n >= COMPRESSORS[i].magic_len && !memcmp(magic, COMPRESSORS[i].magic, COMPRESSORS[i].magic_len)) return &COMPRESSORS[i];
+    return NULL;
+}
+
+struct Compressor* editor_compressor_for_name(char* filename) {
+    char* ext = strrchr(filename, '.');
+    for (unsigned int i = 0; ext && i < COMPRESSOR_ENTRIES; i++)
+        if (!strcmp(ext, COMPRESSORS[i].extension)) return &COMPRESSORS[i];
+    return NULL;
+}
+
+//starts 'argv' with 'in' as its stdin and 'out' as its stdout (stderr would be drawn over the editor)
+pid_t editor_spawn(char** argv, int in, int out) {
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        if (null != -1) dup2(null, STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL); //the editor ignores it, and that would survive exec
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+//exit status of a child, 127 if it couldn't be run and -1 if it was killed
+int editor_wait_child(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//streams the file through the decompressor, handing 'block_fn' whole lines, ACORN_DECOMPRESS_BLOCK bytes at a time
+//returns the decompressor's exit status (0 if it worked)
+int editor_decompress(char* filename, struct Compressor* compressor, void (*block_fn)(char*, size_t, void*), void* data) {
+    int in = open(filename, O_RDONLY | O_CLOEXEC);
+    if (in == -1) return -1;
+    int out[2];
+    if (pipe(out) == -1) die("pipe");
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    //a default pipe holds 64KB, so the decompressor would stall while a block is split. Users other than root can't
+    //go past fs.pipe-max-size (1MB unless raised), and a smaller pipe only means less overlap
+    if (fcntl(out[0], F_SETPIPE_SZ, ACORN_DECOMPRESS_BLOCK) == -1) fcntl(out[0], F_SETPIPE_SZ, 1024 * 1024);
+    pid_t pid = editor_spawn(compressor->decompress, in, out[1]);
+    close(in);
+    close(out[1]);
+
+    size_t capacity = ACORN_DECOMPRESS_BLOCK;
+    char* block = malloc(capacity);
+    size_t len = 0;
+    while (1) {
+        ssize_t n = read(out[0], &block[len], capacity - len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+        if (len < capacity) continue;
+
+        //the end of a line cut off by the block waits for the next one
+        char* last = memrchr(block, '\n', len);
+        if (last == NULL) { //a line longer than a block
+            capacity *= 2;
+            block = realloc(block, capacity);
+            continue;
+        }
+        size_t whole = last + 1 - block;
+        block_fn(block, whole, data);
+        memmove(block, &block[whole], len - whole);
+        len -= whole;
+    }
+    if (len > 0) block_fn(block, len, data);
+    free(block);
+    close(out[0]);
+    return editor_wait_child(pid);
+}
+
+void editor_insert_block(char* block, size_t len, void* data) {
+    (void) data;
+    int count;
+    struct RegisterSlice* lines = editor_split_lines(block, len, &count);
+    editor_insert_rows(e.active_buffer->num_rows, NULL, lines, count);
+    free(lines);
+}
+
+//loads a compressed file into the (empty) active buffer
+//if it can't be decompressed, the buffer is emptied again and no longer treated as compressed (so the file opens as it is)
+int editor_load_compressed(char* filename, struct Compressor* compressor) {
+    int status = editor_decompress(filename, compressor, editor_insert_block, NULL);
+    if (status == 0) return 0;
+
+    struct EditorBuffer* b = e.active_buffer;
+    for (int j = 0; j < b->num_rows; j++) editor_free_row(&b->row[j]);
+    b->num_rows = 0;
+    editor_wrap_moved(b, 0);
+    b->compressor = NULL;
+    if (status == 127) editor_set_status_message("Can't decompress %s (%s isn't installed)", filename, compressor->name);
+    else editor_set_status_message("Can't decompress %s (%s failed with exit status %d)", filename, compressor->name, status);
+    return -1;
+}
+
+struct DecompressedText {
+    char* text;
+    size_t len;
+    size_t capacity;
+};
+
+void editor_append_block(char* block, size_t len, void* data) {
+    struct DecompressedText* d = data;
+    if (d->len + len > d->capacity) {
+        d->capacity = (d->len + len) * 2;
+        d->text = realloc(d->text, d->capacity);
+    }
+    memcpy(&d->text[d->len], block, len);
+    d->len += len;
+}
+
+//the whole decompressed text of a file (for reloading, which diffs it against the rows), NULL if it can't be read
+char* editor_read_compressed(char* filename, struct Compressor* compressor, size_t* len) {
+    struct DecompressedText d = { malloc(1), 0, 1 };
+    if (editor_decompress(filename, compressor, editor_append_block, &d) != 0) {
+        free(d.text);
+        errno = EIO;
+        return NULL;
+    }
+    *len = d.len;
+    return d.text;
+}
+
+//pipes every row through the compressor into 'fd', returns -1 if anything went wrong
+int editor_compress_rows(int fd, struct Compressor* compressor) {
+    int in[2];
+    if (pipe(in) == -1) return -1;
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN); //a compressor that dies shows up as EPIPE
+    pid_t pid = editor_spawn(compressor->compress, in[0], fd);
+    close(in[0]);
+
+    struct EditorBuffer* b = e.active_buffer;
+    struct iovec iov[64];
+    int ok = 1;
+    for (int j = 0; j < b->num_rows && ok; ) {
+        int n = 0;
+        for (; j < b->num_rows && n + 2 <= 64; j++) {
+            if (b->row[j].size > 0) iov[n++] = (struct iovec) { b->row[j].chars, b->row[j].size };
+            iov[n++] = (struct iovec) { "\n", 1 };
+        }
+        //the pipe is blocking, but writev can still stop part way through
+        struct iovec* v = iov;
+        while (n > 0) {
+            ssize_t written = writev(in[1], v, n);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                ok = 0;
+                break;
+            }
+            while (n > 0 && (size_t) written >= v->iov_len) {
+                written -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0) {
+                v->iov_base = (char*) v->iov_base + written;
+                v->iov_len -= written;
+            }
+        }
+    }
+    close(in[1]);
+
+    int status = editor_wait_child(pid);
+    if (ok && status == 0) return 0;
+    errno = EIO;
+    return -1;
+}
+
+//compresses the rows into a temporary file next to 'filename' and only renames it over the file once the compressor
+//has succeeded, so a missing or failing compressor leaves the old file as it was. '*len' gets the compressed size
+int editor_save_compressed(char* filename, struct Compressor* compressor, int* len) {
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", filename);
+    int fd = mkstemp(temp);
+    if (fd == -1) return -1;
+    struct stat st;
+    fchmod(fd, stat(filename, &st) == 0 ? st.st_mode & 07777 : 0644); //mkstemp makes it 0600
+
+    int saved = editor_compress_rows(fd, compressor) != -1 && fstat(fd, &st) != -1;
+    saved = close(fd) == 0 && saved;
+    if (saved && rename(temp, filename) == 0) {
+        *len = st.st_size;
+        return 0;
+    }
+    int saved_errno = errno;
+    unlink(temp);
+    errno = saved_errno;
+    return -1;
+}
+
+/*** file watching ***/
+//every buffer watches its file through one inotify instance, which is read while waiting for keys
+//clean buffers are reloaded by diffing the file against their rows, so only the rows that changed are replaced
+//(and re-highlighted). Buffers with unsaved changes are only flagged: :e! reloads them, :w! overwrites the file
+
+void editor_record_file(struct EditorBuffer* buffer) {
+    struct stat st;
+    if (buffer->filename == NULL || stat(buffer->filename, &st) == -1) return;
+    buffer->mtime = st.st_mtim;
+    buffer->file_size = st.st_size;
+}
+
+void editor_unwatch_buffer(struct EditorBuffer* buffer) {
+    if (buffer->watch == -1) return;
+    //buffers on the same file share a watch
+    int shared = 0;
+    for (int i = 0; i < e.buffer_count; i++)
+        if (e.buffers[i] != buffer && e.buffers[i]->watch == buffer->watch) shared = 1;
+    if (!shared) inotify_rm_watch(e.inotify_fd, buffer->watch);
+    buffer->watch = -1;
+}
+
+void editor_watch_buffer(struct EditorBuffer* buffer) {
+    int watch = -1;
+    if (e.inotify_fd != -1 && buffer->filename != NULL)
+        watch = inotify_add_watch(e.inotify_fd, buffer->filename, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (watch != buffer->watch) editor_unwatch_buffer(buffer);
+    buffer->watch = watch;
+}
+
+int editor_lines_equal(struct EditorRow* row, uint64_t row_hash, struct RegisterSlice* line, uint64_t line_hash) {
+    return row_hash == line_hash && row->size == line->len && !memcmp(row->chars, &line->text[line->start], line->len);
+}
+
+//line diff of 'rows' [0, n) against 'lines' [0, m): match[i] is the line row i is kept as, or -1 if it goes
+//the common prefix and suffix are skipped, the rest is Myers' O(ND) diff on line hashes. If that needs more than
+//ACORN_DIFF_MAX_EDITS edits, nothing in the middle is matched
+void editor_diff_rows(struct EditorRow* rows, int n, struct RegisterSlice* lines, int m, int* match) {
+    int prefix = 0;
+    while (prefix < n && prefix < m && rows[prefix].size == lines[prefix].len &&
+            !memcmp(rows[prefix].chars, &lines[prefix].text[lines[prefix].start], lines[prefix].len)) {
+        match[prefix] = prefix;
+        prefix++;
+    }
+    int suffix = 0;
+    while (suffix < n - prefix && suffix < m - prefix) {
+        struct EditorRow* row = &rows[n - 1 - suffix];
+        struct RegisterSlice* line = &lines[m - 1 - suffix];
+        if (row->size != line->len || memcmp(row->chars, &line->text[line->start], line->len)) break;
+        match[n - 1 - suffix] = m - 1 - suffix;
+        suffix++;
+    }
+
+    rows += prefix;
+    lines += prefix;
+    match += prefix;
+    n -= prefix + suffix;
+    m -= prefix + suffix;
+    for (int i = 0; i < n; i++) match[i] = -1;
+    if (n <= 0 || m <= 0) return;
+
+    uint64_t* row_hash = malloc(sizeof(uint64_t) * (size_t) n);
+    uint64_t* line_hash = malloc(sizeof(uint64_t) * (size_t) m);
+    for (int i = 0; i < n; i++) row_hash[i] = hl_hash(rows[i].chars, rows[i].size);
+    for (int j = 0; j < m; j++) line_hash[j] = hl_hash(&lines[j].text[lines[j].start], lines[j].len);
+
+    //v[k] is the furthest row reached on diagonal k (row - line), and trace keeps v[-d..d] after every step d
+    int max = n + m < ACORN_DIFF_MAX_EDITS ? n + m : ACORN_DIFF_MAX_EDITS;
+    int* v_base = malloc(sizeof(int) * (2 * max + 3));
+    int* v = v_base + max + 1;
+    int* trace = NULL;
+    size_t trace_capacity = 0;
+    int found = -1;
+    v[1] = 0;
+    for (int d = 0; d <= max && found == -1; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[k - 1] < v[k + 1])) ? v[k + 1] : v[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && editor_lines_equal(&rows[x], row_hash[x], &lines[y], line_hash[y])) {
+                x++;
+                y++;
+            }
+            v[k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+        if ((size_t) (d + 1) * (d + 1) > trace_capacity) {
+            trace_capacity = (size_t) (2 * d + 2) * (2 * d + 2);
+            trace = realloc(trace, sizeof(int) * trace_capacity);
+        }
+        memcpy(&trace[(size_t) d * d], &v[-d], sizeof(int) * (2 * d + 1));
+    }
+
+    //walks back from the end, matching the rows on every diagonal stretch of the path
+    if (found != -1) {
+        int x = n, y = m;
+        for (int d = found; d > 0; d--) {
+            int* prev = &trace[(size_t) (d - 1) * (d - 1)] + d - 1; //v[] after step d - 1
+            int k = x - y;
+            int prev_k = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+            int prev_x = prev[prev_k];
+            int prev_y = prev_x - prev_k;
+            while (x > prev_x && y > prev_y) {
+                if (x <= n && y <= m) match[x - 1] = y - 1;
+                x--;
+                y--;
+            }
+            x = prev_x;
+            y = prev_y;
+        }
+        while (x > 0 && y > 0) {
+            match[x - 1] = y - 1;
+            x--;
+            y--;
+        }
+    }
+    for (int i = 0; i < n; i++)
+        if (match[i] != -1) match[i] += prefix;
+
+    free(trace);
+    free(v_base);
+    free(row_hash);
+    free(line_hash);
+}
+
+//rows [at, at + count) are new, and the row after them was highlighted coming after a row with 'old_comment'
+struct ReloadHunk {
+    int at;
+    int count;
+    unsigned char old_comment;
+};
+
+//re-reads the buffer's file and splices in only what changed, keeping the cursor and scroll position
+//returns the number of rows that were deleted or inserted, or -1 if the file can't be read
+int editor_reload_buffer(struct EditorBuffer* buffer) {
+    editor_load_finish(buffer); //the diff is against the whole file
+    int fd = open(buffer->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    uint64_t trace = trace_begin();
+
+    char* data = NULL;
+    size_t size = st.st_size;
+    if (buffer->compressor) {
+        data = editor_read_compressed(buffer->filename, buffer->compressor, &size);
+        if (data == NULL) {
+            close(fd);
+            return -1;
+        }
+    } else if (st.st_size > 0) {
+        data = editor_read_fd(fd, 0, st.st_size, &size);
+    }
+    close(fd);
+
+    int m = 0;
+    struct RegisterSlice* lines = data ? editor_split_lines(data, size, &m) : NULL;
+    if (m == 0) { //an empty file still gets a row to put the cursor on
+        free(lines);
+        lines = malloc(sizeof(struct RegisterSlice));
+        lines[0] = (struct RegisterSlice) { "", 0, 0 };
+        m = 1;
+    }
+
+    struct EditorRow* old = buffer->row;
+    int n = buffer->num_rows;
+    int* match = malloc(sizeof(int) * (n ? n : 1));
+    editor_diff_rows(old, n, lines, m, match);
+
+    struct EditorBuffer* active = e.active_buffer;
+    e.active_buffer = buffer;
+
+    //kept rows are moved over as they are (with their render and highlighting), the rest is freed or created
+    struct EditorRow* rows = malloc(sizeof(struct EditorRow) * m);
+    struct ReloadHunk* hunks = malloc(sizeof(struct ReloadHunk) * (n + 1));
+    int num_hunks = 0;
+    int changed = 0;
+    int* tracked[3] = { &buffer->cursor_y, &buffer->anchor_y, &buffer->row_offset };
+    int moved[3] = { buffer->cursor_y, buffer->anchor_y, buffer->row_offset };
+    int i = 0, j = 0;
+    while (i < n || j < m) {
+        int hunk = (i < n && match[i] == -1) || (j < m && (i == n || match[i] != j));
+        if (!hunk) {
+            for (int k = 0; k < 3; k++)
+                if (*tracked[k] == i) moved[k] = j;
+            rows[j++] = old[i++];
+            continue;
+        }
+        int first = i;
+
+        struct ReloadHunk* h = &hunks[num_hunks++];
+        h->at = j;
+        h->old_comment = i > 0 ? old[i - 1].hl_open_comment : 0;
+        while (i < n && match[i] == -1) {
+            h->old_comment = old[i].hl_open_comment;
+            editor_free_row(&old[i++]);
+            changed++;
+        }
+        int stop = i < n ? match[i] : m;
+        for (; j < stop; j++) {
+            struct EditorRow* row = &rows[j];
+            row->size = lines[j].len;
+            row->chars = row_text_new(buffer->text_arena, &lines[j].text[lines[j].start], lines[j].len, lines[j].len + 1);
+            row->render_size = 0;
+            row->render = NULL;
+            row->hl = NULL;
+            row->hl_count = 0;
+            row->hl_open_comment = 0;
+            row->wrap_lines = 1;
+        }
+        h->count = j - h->at;
+        changed += h->count;
+
+        //rows that were replaced keep their distance from the start of the hunk
+        int last = h->count > 0 ? h->at + h->count - 1 : h->at;
+        for (int k = 0; k < 3; k++) {
+            int y = h->at + *tracked[k] - first;
+            if (*tracked[k] >= first && *tracked[k] < i) moved[k] = y < last ? y : last;
+        }
+    }
+    free(old);
+    buffer->row = rows;
+    buffer->num_rows = m;
+    buffer->row_capacity = m;
+    if (num_hunks > 0) editor_wrap_moved(buffer, hunks[0].at);
+
+    //in order, so every hunk is highlighted after what comes before it is final
+    if (!buffer->evicted) {
+        for (int h = 0; h < num_hunks; h++) {
+            int next = hunks[h].at + hunks[h].count;
+            editor_update_rows(hunks[h].at, next);
+            if (next < buffer->num_rows) {
+                int in_comment = editor_prev_open_comment(buffer, &buffer->row[next]);
+                if (in_comment != hunks[h].old_comment) editor_update_syntax(buffer, &buffer->row[next], in_comment);
+            }
+        }
+    }
+    e.active_buffer = active;
+
+    for (int k = 0; k < 3; k++) *tracked[k] = moved[k] < m ? moved[k] : m - 1;
+    struct EditorRow* row = &buffer->row[buffer->cursor_y];
+    if (buffer->cursor_x > row->size) buffer->cursor_x = row->size;
+    buffer->cursor_x = utf8_char_start(row->chars, buffer->cursor_x);
+    if (changed) buffer->match_row = -1;
+
+    buffer->dirty = 0;
+    if (changed) buffer->edits++; //a shared session has to look for what changed even though the buffer is clean
+    buffer->disk_changed = 0;
+    buffer->mtime = st.st_mtim;
+    buffer->file_size = st.st_size;
+
+    free(hunks);
+    free(match);
+    free(lines);
+    free(data);
+    trace_end("reload", trace);
+    return changed;
+}
+
+//the watched file of 'buffer' changed (or was replaced or deleted)
+void editor_file_changed(struct EditorBuffer* buffer) {
+    char* name = buffer->filename;
+    if (buffer->watch == -1) editor_watch_buffer(buffer); //replaced by a new file, which needs a watch of its own
+    if (buffer->follow) {
+        editor_follow_update(buffer);
+        return;
+    }
+
+    struct stat st;
+    if (stat(name, &st) == -1) {
+        editor_set_status_message("%s was deleted on disk", name);
+        return;
+    }
+    if (st.st_mtim.tv_sec == buffer->mtime.tv_sec && st.st_mtim.tv_nsec == buffer->mtime.tv_nsec && st.st_size == buffer->file_size)
+        return; //our own write, or nothing that changes the contents
+
+    if (buffer->paged) {
+        editor_set_status_message("%s changed on disk (large files aren't reloaded)", name);
+        editor_record_file(buffer);
+        return;
+    }
+    if (buffer->dirty || (e.filter.pid && e.filter.buffer == buffer)) {
+        if (!buffer->disk_changed) editor_set_status_message("%s changed on disk. :e! reloads it, :w! overwrites it", name);
+        buffer->disk_changed = 1;
+        return;
+    }
+
+    int changed = editor_reload_buffer(buffer);
+    if (changed == -1) editor_set_status_message("Can't reload %s: %s", name, strerror(errno));
+    else if (changed > 0) editor_set_status_message("%s changed on disk, %d lines reloaded", name, changed);
+}
+
+//reads whatever inotify has for us, returns 1 if any buffer's file changed
+//while a prompt is open nothing is read, the events wait in the inotify queue until it closes (a reload under
+//a search would move the rows it's looking through, and its message would replace the prompt)
+int editor_check_files() {
+    if (e.inotify_fd == -1 || e.prompting) return 0;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    unsigned char* changed = NULL;
+
+    //a followed file that was rotated may not have been created again when its watch went, so keep looking for it
+    for (int i = 0; i < e.buffer_count; i++) {
+        if (!e.buffers[i]->follow || e.buffers[i]->watch != -1) continue;
+        editor_watch_buffer(e.buffers[i]);
+        if (e.buffers[i]->watch == -1) continue;
+        if (changed == NULL) changed = calloc(e.buffer_count, 1);
+        changed[i] = 1;
+    }
+
+    ssize_t len;
+    while ((len = read(e.inotify_fd, events, sizeof(events))) > 0) {
+        if (changed == NULL) changed = calloc(e.buffer_count, 1);
+        for (char* p = events; p < events + len; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + event->len;
+            //a file that was moved away isn't ours anymore, the file now at the name (if any) is watched instead
+            if (event->mask & IN_MOVE_SELF) inotify_rm_watch(e.inotify_fd, event->wd);
+            for (int i = 0; i < e.buffer_count; i++) {
+                if (e.buffers[i]->watch != event->wd) continue;
+                changed[i] = 1;
+                if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) e.buffers[i]->watch = -1;
+            }
+        }
+    }
+    if (changed == NULL) return 0;
+
+    int any = 0;
+    for (int i = 0; i < e.buffer_count; i++) {
+        if (!changed[i]) continue;
+        editor_file_changed(e.buffers[i]);
+        any = 1;
+    }
+    free(changed);
+    return any;
+}
+
+//:e! - throws away unsaved changes and goes back to the file on disk (only the rows that differ are replaced)
+void editor_revert() {
+    struct EditorBuffer* buffer = e.active_buffer;
+    if (buffer->filename == NULL) {
+        editor_set_status_message("No file name");
+        return;
+    }
+    if (editor_read_only()) return;
+
+    int changed = editor_reload_buffer(buffer);
+    if (changed == -1) editor_set_status_message("Can't reload %s: %s", buffer->filename, strerror(errno));
+    else editor_set_status_message("%s reloaded, %d lines changed", buffer->filename, changed);
+}
+
+/*** follow ***/
+//:follow works like tail -f: bytes appended to the file are read from the last offset and appended as rows,
+//so an update costs the same however big the file already is. The view stays at the end if it was there.
+//A file that shrinks (truncated) or is replaced by a new one (rotated) is read again from the top
+
+//remembers where the buffer's rows end in the file ('fd'), appends are read from there
+void editor_follow_mark(struct EditorBuffer* buffer, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) buffer->follow_inode = st.st_ino;
+
+    if (buffer->paged) {
+        //the index thread reads to the end of the file, which may be past the size it was opened at
+        editor_index_wait(buffer, INT_MAX);
+        pthread_mutex_lock(&buffer->paged->lock);
+        buffer->paged->size = buffer->paged->indexed_bytes;
+        buffer->follow_offset = buffer->paged->size;
+        pthread_mutex_unlock(&buffer->paged->lock);
+    } else {
+        buffer->follow_offset = buffer->file_size;
+    }
+
+    char last = '\n';
+    if (buffer->follow_offset > 0 && pread(fd, &last, 1, buffer->follow_offset - 1) != 1) last = '\n';
+    buffer->follow_partial = buffer->follow_offset > 0 ? last != '\n' : buffer->num_rows > 0;
+}
+
+//reads bytes [follow_offset, size) of 'fd' and appends them to the rows with one bulk insert
+void editor_follow_append(struct EditorBuffer* buffer, int fd, off_t size) {
+    size_t got;
+    char* data = editor_read_fd(fd, buffer->follow_offset, size - buffer->follow_offset, &got);
+    if (got == 0) {
+        free(data);
+        return;
+    }
+
+    int count;
+    struct RegisterSlice* lines = editor_split_lines(data, got, &count);
+    struct EditorBuffer* active = e.active_buffer;
+    e.active_buffer = buffer;
+    int first = 0;
+    if (buffer->follow_partial && buffer->num_rows > 0 && count > 0) { //the rest of the last row
+        editor_row_append_string(&buffer->row[buffer->num_rows - 1], &lines[0].text[lines[0].start], lines[0].len);
+        first = 1;
+    }
+    editor_insert_rows(buffer->num_rows, NULL, &lines[first], count - first);
+    e.active_buffer = active;
+
+    buffer->dirty = 0; //the rows match the file, there's nothing to save
+    buffer->follow_offset += got;
+    buffer->follow_partial = data[got - 1] != '\n';
+    free(lines);
+    free(data);
+}
+
+//large files just have their line index extended over the new bytes
+void editor_follow_paged(struct EditorBuffer* buffer) {
+    struct PagedFile* paged = buffer->paged;
+    char last = '\n';
+    if (paged->size > 0 && pread(paged->fd, &last, 1, paged->size - 1) != 1) last = '\n';
+
+    long long old_rows = paged->total_rows;
+    long long rows = editor_index_scan(paged, paged->size, old_rows - (last != '\n'), &last);
+    pthread_mutex_lock(&paged->lock);
+    paged->size = paged->indexed_bytes;
+    rows += last != '\n';
+    paged->total_rows = rows > 0x7fffffff ? 0x7fffffff : rows;
+    pthread_mutex_unlock(&paged->lock);
+
+    //the page with the old last row may have grown, so it's read again next time it's needed
+    int stale = old_rows > 0 ? (old_rows - 1) / ACORN_PAGE_LINES : 0;
+    for (int i = 0; i < ACORN_PAGE_CACHE; i++)
+        if (paged->pages[i].index >= stale) editor_free_page(buffer, &paged->pages[i]);
+    editor_index_sync(buffer);
+    buffer->follow_offset = paged->size;
+}
+
+//reads a truncated or rotated file again from the top ('fd' is the file now at the buffer's name)
+int editor_follow_restart(struct EditorBuffer* buffer, int fd) {
+    if (buffer->paged) {
+        //everything that can fail comes before the old pager goes, so a failure leaves the buffer as it was
+        struct stat st;
+        if (fstat(fd, &st) == -1) return -1;
+        int paged_fd = dup(fd);
+        if (paged_fd == -1) return -1;
+        editor_close_paged(buffer);
+        buffer->paged = editor_index_file(paged_fd, st.st_size, NULL, 0, 0);
+        buffer->num_rows = 0;
+    } else if (editor_reload_buffer(buffer) == -1) {
+        return -1;
+    }
+    editor_follow_mark(buffer, fd);
+    buffer->row_offset = 0;
+    return 0;
+}
+
+//the followed file changed
+void editor_follow_update(struct EditorBuffer* buffer) {
+    int fd = open(buffer->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return; //rotated away and not created again yet
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return;
+    }
+    uint64_t trace = trace_begin();
+
+    int at_end = buffer->cursor_y >= buffer->num_rows - 1;
+    if (st.st_ino != buffer->follow_inode || st.st_size < buffer->follow_offset) {
+        char* what = st.st_ino != buffer->follow_inode ? "rotated" : "truncated";
+        if (editor_follow_restart(buffer, fd) == -1) editor_set_status_message("Can't read %s: %s", buffer->filename, strerror(errno));
+        else editor_set_status_message("%s was %s, following it from the top", buffer->filename, what);
+    } else if (st.st_size > buffer->follow_offset) {
+        if (buffer->paged) editor_follow_paged(buffer);
+        else editor_follow_append(buffer, fd, st.st_size);
+    }
+    close(fd);
+
+    if ((at_end || buffer->cursor_y >= buffer->num_rows) && buffer->num_rows > 0) {
+        buffer->cursor_y = buffer->num_rows - 1;
+        buffer->cursor_x = 0;
+    }
+    buffer->mtime = st.st_mtim;
+    buffer->file_size = st.st_size;
+    trace_end("follow", trace);
+}
+
+//:follow - starts following the buffer's file (from the end), or stops if it already does
+void editor_follow(struct EditorBuffer* buffer) {
+    editor_load_finish(buffer); //appends carry on from the end of the file
+    if (buffer->follow) {
+        buffer->follow = 0;
+        editor_set_status_message("Stopped following %s", buffer->filename);
+        return;
+    }
+    if (buffer->filename == NULL) {
+        editor_set_status_message("No file name");
+        return;
+    }
+    if (buffer->dirty) {
+        editor_set_status_message("No write since last change");
+        return;
+    }
+    if (buffer->compressor) {
+        editor_set_status_message("Can't follow a compressed file");
+        return;
+    }
+    int fd = open(buffer->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        editor_set_status_message("Can't read %s: %s", buffer->filename, strerror(errno));
+        return;
+    }
+
+    //whatever changed since the file was read is caught up with first
+    struct stat st;
+    if (buffer->paged == NULL && fstat(fd, &st) == 0 &&
+            (st.st_mtim.tv_sec != buffer->mtime.tv_sec || st.st_mtim.tv_nsec != buffer->mtime.tv_nsec || st.st_size != buffer->file_size))
+        editor_reload_buffer(buffer);
+    editor_follow_mark(buffer, fd);
+    close(fd);
+
+    buffer->follow = 1;
+    buffer->disk_changed = 0;
+    buffer->cursor_y = buffer->num_rows > 0 ? buffer->num_rows - 1 : 0;
+    buffer->cursor_x = 0;
+    editor_set_status_message("Following %s (:follow again stops)", buffer->filename);
+}
+
+/*** sessions ***/
+//:mksession (and quitting) writes the open buffers to a snapshot, and acorn started without a file picks up from it.
+//The snapshot is used in place through mmap: a header, a record per buffer, then the arrays the records point at by
+//file offset. A file with the same mtime, size and content hash as when the snapshot was written has its rows cut
+//straight out of it with the saved line index and gets its saved highlight runs back, so it's neither split nor lexed.
+//Anything that doesn't check out is opened the normal way. Unsaved changes aren't kept, only where the cursor was.
+
+#define SESSION_MAGIC "ACORNSS1"
+#define SESSION_VERSION 1
+
+#define SESSION_ROWS 1 //'rows' is the line index of the file
+#define SESSION_HIGHLIGHT 2 //'spans' is the highlighting of those rows
+#define SESSION_PAGED 4 //'rows' is the checkpoint index of a large file
+
+struct SessionHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_buffers;
+    uint32_t active;
+    uint32_t cwd_len;
+    uint64_t cwd; //relative file names are relative to this
+    uint64_t buffers; //struct SessionBuffer[num_buffers]
+};
+
+struct SessionBuffer {
+    uint64_t name;
+    uint32_t name_len;
+    uint32_t flags;
+    int32_t cursor_x, cursor_y;
+    int32_t row_offset, col_offset;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t file_size;
+    uint64_t hash; //of the whole file (or both ends of a large one)
+    uint64_t syntax; //editor_syntax_hash of the rules the spans were lexed with
+    int64_t total_rows; //of a large file
+    int64_t num_rows; //entries in 'rows' - struct SessionRow, or off_t checkpoints of a large file
+    uint64_t rows;
+    int64_t num_spans;
+    uint64_t spans; //struct HighlightSpan[num_spans], the runs of every row one after the other
+};
+
+struct SessionRow {
+    int64_t start; //file offset
+    int32_t len;
+    int32_t hl_count;
+    int32_t hl_open_comment;
+    int32_t unused;
+};
+
+//$ACORN_SESSION, otherwise a file in $XDG_STATE_HOME or $HOME - NULL if sessions are turned off (ACORN_SESSION="")
+char* editor_session_path() {
+    static char path[PATH_MAX];
+    if (getenv("ACORN_SESSION")) snprintf(path, sizeof(path), "%s", getenv("ACORN_SESSION"));
+    else if (getenv("XDG_STATE_HOME")) snprintf(path, sizeof(path), "%s/acorn-session", getenv("XDG_STATE_HOME"));
+    else if (getenv("HOME")) snprintf(path, sizeof(path), "%s/.acorn-session", getenv("HOME"));
+    else return NULL;
+    return path[0] ? path : NULL;
+}
+
+uint64_t editor_session_hash(const char* data, off_t size) {
+    uint64_t h = (uint64_t) size;
+    for (off_t at = 0; at < size; at += 1 << 30) {
+        int len = size - at < (1 << 30) ? (int) (size - at) : 1 << 30;
+        h = (h * 0x9e3779b97f4a7c15ULL) ^ hl_hash(&data[at], len);
+    }
+    return h;
+}
+
+//large files are only hashed at both ends - together with the mtime and size that's enough to tell it's another file
+uint64_t editor_session_sample_hash(int fd, off_t size) {
+    off_t sample = size < ACORN_SESSION_SAMPLE ? size : ACORN_SESSION_SAMPLE;
+    char* data = malloc(sample * 2 + 1);
+    uint64_t h = 0;
+    if (pread(fd, data, sample, 0) == sample && pread(fd, &data[sample], sample, size - sample) == sample)
+        h = editor_session_hash(data, sample * 2) ^ (uint64_t) size;
+    free(data);
+    return h;
+}
+
+//changes whenever the highlighting rules do, so runs saved with older rules aren't used
+uint64_t editor_syntax_hash(struct EditorSyntax* syntax) {
+    if (syntax == NULL) return 0;
+    char* parts[] = { syntax->file_type, syntax->singleline_comment_start, syntax->multiline_comment_start, syntax->multiline_comment_end };
+    uint64_t h = (uint64_t) syntax->flags;
+    for (int i = 0; i < 4; i++) h = (h * 0x9e3779b97f4a7c15ULL) ^ hl_hash(parts[i], strlen(parts[i]));
+    for (int i = 0; syntax->keywords[i]; i++) h = (h * 0x9e3779b97f4a7c15ULL) ^ hl_hash(syntax->keywords[i], strlen(syntax->keywords[i]));
+    return h;
+}
+
+//writes 'len' bytes at 'end' (8 byte aligned, so arrays can be used in place) and returns the offset they went to
+uint64_t session_put(int fd, off_t* end, const void* data, size_t len, int* failed) {
+    off_t at = (*end + 7) & ~(off_t) 7;
+    for (size_t done = 0; done < len && !*failed; ) {
+        ssize_t n = pwrite(fd, (const char*) data + done, len - done, at + done);
+        if (n <= 0) *failed = 1;
+        else done += n;
+    }
+    *end = at + len;
+    return at;
+}
+
+//'count' elements of 'size' bytes at 'offset' of a mapped session, or NULL if they aren't all in it
+void* session_array(char* session, size_t session_size, uint64_t offset, int64_t count, size_t size) {
+    if (count < 0 || offset % 8 != 0 || offset > session_size || (uint64_t) count > (session_size - offset) / size) return NULL;
+    return &session[offset];
+}
+
+//the line index (and highlighting) of a buffer whose rows are exactly what's in its file
+void editor_session_save_rows(int fd, off_t* end, int* failed, struct EditorBuffer* buffer, struct SessionBuffer* record) {
+    struct stat st;
+    int file = open(buffer->filename, O_RDONLY | O_CLOEXEC);
+    if (file == -1) return;
+    if (fstat(file, &st) == -1 || st.st_size == 0 || st.st_size != buffer->file_size ||
+            st.st_mtim.tv_sec != buffer->mtime.tv_sec || st.st_mtim.tv_nsec != buffer->mtime.tv_nsec) {
+        close(file);
+        return;
+    }
+    size_t got;
+    char* data = editor_read_fd(file, 0, st.st_size, &got);
+    close(file);
+    if (got != (size_t) st.st_size) {
+        free(data);
+        return;
+    }
+
+    //same split as editor_split_lines: every row starts before the end of the file and runs up to its newline (less any \r)
+    struct SessionRow* rows = malloc(sizeof(struct SessionRow) * (buffer->num_rows + 1));
+    int64_t num_spans = 0;
+    off_t offset = 0;
+    int j;
+    for (j = 0; j < buffer->num_rows; j++) {
+        struct EditorRow* row = &buffer->row[j];
+        if (offset >= st.st_size || row->size > st.st_size - offset || memcmp(&data[offset], row->chars, row->size)) break;
+        rows[j] = (struct SessionRow) { offset, row->size, row->hl_count, row->hl_open_comment, 0 };
+        num_spans += row->hl_count;
+        offset += row->size;
+        while (offset < st.st_size && data[offset] == '\r') offset++;
+        if (offset < st.st_size && data[offset++] != '\n') break;
+    }
+
+    if (j == buffer->num_rows && offset == st.st_size) {
+        record->flags |= SESSION_ROWS;
+        record->hash = editor_session_hash(data, st.st_size);
+        record->num_rows = buffer->num_rows;
+        record->rows = session_put(fd, end, rows, sizeof(struct SessionRow) * buffer->num_rows, failed);
+
+        //an evicted buffer has no highlighting to save, it's lexed again on the way back in
+        if (buffer->syntax && !buffer->evicted) {
+            struct HighlightSpan* spans = malloc(sizeof(struct HighlightSpan) * (num_spans + 1));
+            int64_t n = 0;
+            for (j = 0; j < buffer->num_rows; j++) {
+                memcpy(&spans[n], buffer->row[j].hl, sizeof(struct HighlightSpan) * buffer->row[j].hl_count);
+                n += buffer->row[j].hl_count;
+            }
+            record->flags |= SESSION_HIGHLIGHT;
+            record->syntax = editor_syntax_hash(buffer->syntax);
+            record->num_spans = num_spans;
+            record->spans = session_put(fd, end, spans, sizeof(struct HighlightSpan) * num_spans, failed);
+            free(spans);
+        }
+    }
+    free(rows);
+    free(data);
+}
+
+//the checkpoint index of a large file, once it's finished
+void editor_session_save_index(int fd, off_t* end, int* failed, struct EditorBuffer* buffer, struct SessionBuffer* record) {
+    struct PagedFile* paged = buffer->paged;
+    struct stat st;
+    if (fstat(paged->fd, &st) == -1 || st.st_size != buffer->file_size ||
+            st.st_mtim.tv_sec != buffer->mtime.tv_sec || st.st_mtim.tv_nsec != buffer->mtime.tv_nsec) return;
+
+    pthread_mutex_lock(&paged->lock);
+    if (!paged->indexing && paged->size == st.st_size && (record->hash = editor_session_sample_hash(paged->fd, paged->size)) != 0) {
+        record->flags |= SESSION_PAGED;
+        record->total_rows = paged->total_rows;
+        record->num_rows = paged->num_checkpoints;
+        record->rows = session_put(fd, end, paged->checkpoints, sizeof(off_t) * paged->num_checkpoints, failed);
+    }
+    pthread_mutex_unlock(&paged->lock);
+}
+
+//written to a temporary file that replaces 'path' once it's complete - returns the number of buffers, or -1 on an I/O error
+int editor_write_session(char* path) {
+    if (path == NULL) return -1;
+    char temp[PATH_MAX + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return -1;
+    uint64_t trace = trace_begin();
+
+    struct SessionHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+    header.version = SESSION_VERSION;
+    header.buffers = sizeof(header);
+    struct SessionBuffer* records = calloc(e.buffer_count + 1, sizeof(struct SessionBuffer));
+    off_t end = header.buffers + sizeof(struct SessionBuffer) * e.buffer_count;
+    int failed = 0;
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+    header.cwd_len = strlen(cwd);
+    header.cwd = session_put(fd, &end, cwd, header.cwd_len, &failed);
+
+    for (int i = 0; i < e.buffer_count; i++) {
+        struct EditorBuffer* buffer = e.buffers[i];
+        if (buffer->filename == NULL) continue; //nothing to open it from
+        if (buffer == e.active_buffer) header.active = header.num_buffers;
+        struct SessionBuffer* record = &records[header.num_buffers++];
+        record->name_len = strlen(buffer->filename);
+        record->name = session_put(fd, &end, buffer->filename, record->name_len, &failed);
+        record->cursor_x = buffer->cursor_x;
+        record->cursor_y = buffer->cursor_y;
+        record->row_offset = buffer->row_offset;
+        record->col_offset = buffer->col_offset;
+        record->mtime_sec = buffer->mtime.tv_sec;
+        record->mtime_nsec = buffer->mtime.tv_nsec;
+        record->file_size = buffer->file_size;
+
+        //the index is of the file, so it's only any use if the rows are the same as the file
+        if (buffer->dirty || buffer->disk_changed || buffer->compressor) continue;
+        if (buffer->paged) editor_session_save_index(fd, &end, &failed, buffer, record);
+        else editor_session_save_rows(fd, &end, &failed, buffer, record);
+    }
+
+    off_t start = header.buffers;
+    session_put(fd, &start, records, sizeof(struct SessionBuffer) * header.num_buffers, &failed);
+    start = 0;
+    session_put(fd, &start, &header, sizeof(header), &failed);
+    free(records);
+    if (close(fd) == -1) failed = 1;
+    if (failed || rename(temp, path) == -1) {
+        int error = errno;
+        unlink(temp);
+        errno = error;
+        return -1;
+    }
+    trace_end("write_session", trace);
+    return header.num_buffers;
+}
+
+void editor_mksession(char* path) {
+    if (path == NULL) {
+        editor_set_status_message("Sessions are turned off (ACORN_SESSION is empty)");
+        return;
+    }
+    int written = editor_write_session(path);
+    if (written == -1) editor_set_status_message("Can't write %s! I/O error: %s", path, strerror(errno));
+    else editor_set_status_message("Session of %d buffer%s written to %s", written, written == 1 ? "" : "s", path);
+}
+
+//gives every row its saved highlight runs - they don't go through the highlight cache (interning every row costs
+//more than all the rest of a restore), rows that are lexed again later fill it as usual
+//returns 0 if the runs don't fit the rows (then the rows have to be highlighted the normal way)
+int editor_session_load_hl(struct EditorBuffer* buffer, struct SessionRow* rows, struct HighlightSpan* spans, int64_t num_spans) {
+    int64_t next = 0;
+    for (int j = 0; j < buffer->num_rows; j++) {
+        struct EditorRow* row = &buffer->row[j];
+        int count = rows[j].hl_count;
+        if (count < 0 || count > num_spans - next) return 0;
+        struct HighlightSpan* runs = &spans[next];
+        next += count;
+        for (int i = 0, column = 0; i < count; i++) { //in order and inside the row
+            if (runs[i].start < column || runs[i].len <= 0 || runs[i].len > row->render_size - runs[i].start) return 0;
+            column = runs[i].start + runs[i].len;
+        }
+
+        row->hl = hl_runs_copy(e.hl_cache.arena, runs, count);
+        row->hl_count = count;
+        row->hl_open_comment = rows[j].hl_open_comment;
+    }
+    return 1;
+}
+
+//opens 'name' by cutting its rows out of the file with the saved line index - returns 0 if the file has changed
+int editor_session_load_rows(char* name, struct SessionBuffer* record, char* session, size_t session_size) {
+    struct SessionRow* rows = session_array(session, session_size, record->rows, record->num_rows, sizeof(struct SessionRow));
+    struct HighlightSpan* spans = session_array(session, session_size, record->spans, record->num_spans, sizeof(struct HighlightSpan));
+    struct stat st;
+    if (!(record->flags & SESSION_ROWS) || rows == NULL || record->num_rows > INT_MAX || stat(name, &st) == -1 ||
+            !S_ISREG(st.st_mode) || st.st_size != record->file_size || st.st_size > e.large_file_size ||
+            st.st_mtim.tv_sec != record->mtime_sec || st.st_mtim.tv_nsec != record->mtime_nsec) return 0;
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    size_t got;
+    char* data = editor_read_fd(fd, 0, st.st_size, &got);
+    close(fd);
+
+    int num_rows = record->num_rows;
+    struct RegisterSlice* lines = malloc(sizeof(struct RegisterSlice) * (num_rows + 1));
+    int ok = got == (size_t) st.st_size && editor_session_hash(data, st.st_size) == record->hash;
+    for (int j = 0; j < num_rows && ok; j++) {
+        ok = rows[j].start >= 0 && rows[j].len >= 0 && rows[j].start <= st.st_size - rows[j].len;
+        if (ok) lines[j] = (struct RegisterSlice) { &data[rows[j].start], 0, rows[j].len };
+    }
+
+    if (ok) {
+        editor_new_buffer(name);
+        struct EditorBuffer* b = e.active_buffer;
+        editor_place_rows(0, NULL, lines, num_rows);
+        for (int j = 0; j < num_rows; j++) editor_update_render(&b->row[j]);
+        if (!(record->flags & SESSION_HIGHLIGHT) || spans == NULL || record->syntax != editor_syntax_hash(b->syntax) ||
+                !editor_session_load_hl(b, rows, spans, record->num_spans))
+            editor_highlight_rows(b, 0, num_rows);
+        b->mtime = st.st_mtim;
+        b->file_size = st.st_size;
+    }
+    free(lines);
+    free(data);
+    return ok;
+}
+
+//opens the large file 'name' with the saved checkpoint index instead of scanning it again - returns 0 if the file has changed
+int editor_session_load_index(char* name, struct SessionBuffer* record, char* session, size_t session_size) {
+    off_t* checkpoints = session_array(session, session_size, record->rows, record->num_rows, sizeof(off_t));
+    struct stat st;
+    if (!(record->flags & SESSION_PAGED) || checkpoints == NULL || record->num_rows < 1 || record->num_rows > INT_MAX ||
+            record->total_rows < (record->num_rows - 1) * ACORN_PAGE_LINES || record->total_rows > INT_MAX ||
+            stat(name, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != record->file_size || st.st_size <= e.large_file_size ||
+            st.st_mtim.tv_sec != record->mtime_sec || st.st_mtim.tv_nsec != record->mtime_nsec) return 0;
+    for (int i = 0; i < record->num_rows; i++)
+        if (checkpoints[i] > st.st_size || (i == 0 ? checkpoints[i] != 0 : checkpoints[i] <= checkpoints[i - 1])) return 0;
+
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    if (editor_session_sample_hash(fd, st.st_size) != record->hash) {
+        close(fd);
+        return 0;
+    }
+    editor_new_buffer(name);
+    e.active_buffer->paged = editor_index_file(fd, st.st_size, checkpoints, record->num_rows, record->total_rows);
+    editor_index_sync(e.active_buffer);
+    e.active_buffer->mtime = st.st_mtim;
+    e.active_buffer->file_size = st.st_size;
+    return 1;
+}
+
+void editor_session_restore_cursor(struct EditorBuffer* buffer, struct SessionBuffer* record) {
+    editor_index_wait(buffer, record->cursor_y);
+    int y = record->cursor_y < buffer->num_rows ? record->cursor_y : buffer->num_rows - 1;
+    buffer->cursor_y = y > 0 ? y : 0;
+    int rowlen = buffer->num_rows > 0 ? editor_row(buffer, buffer->cursor_y)->size : 0;
+    buffer->cursor_x = record->cursor_x < rowlen ? (record->cursor_x > 0 ? record->cursor_x : 0) : (rowlen > 0 ? rowlen - 1 : 0);
+    buffer->row_offset = record->row_offset < buffer->cursor_y ? (record->row_offset > 0 ? record->row_offset : 0) : buffer->cursor_y;
+    buffer->col_offset = record->col_offset > 0 ? record->col_offset : 0;
+}
+
+//opens the buffers of a session - returns how many, or -1 if 'path' isn't a session this acorn can read
+int editor_restore_session(char* path) {
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd == -1) return -1;
+    struct stat st;
+    char* session = MAP_FAILED;
+    errno = EINVAL; //too short to be a session
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct SessionHeader))
+        session = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (session == MAP_FAILED) return -1;
+
+    size_t size = st.st_size;
+    struct SessionHeader* header = (struct SessionHeader*) session;
+    struct SessionBuffer* records = session_array(session, size, header->buffers, header->num_buffers, sizeof(struct SessionBuffer));
+    char* cwd = session_array(session, size, header->cwd, header->cwd_len, 1);
+    if (memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) || header->version != SESSION_VERSION || records == NULL || cwd == NULL) {
+        munmap(session, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t start = perf_now();
+    char here[PATH_MAX];
+    int moved = getcwd(here, sizeof(here)) == NULL || strlen(here) != header->cwd_len || memcmp(here, cwd, header->cwd_len);
+    int opened = 0, reused = 0, active = -1;
+    for (uint32_t i = 0; i < header->num_buffers; i++) {
+        struct SessionBuffer* record = &records[i];
+        char* saved_name = session_array(session, size, record->name, record->name_len, 1);
+        if (saved_name == NULL || record->name_len == 0) continue;
+
+        //relative names are relative to where the session was written
+        char name[PATH_MAX];
+        if (moved && saved_name[0] != '/') snprintf(name, sizeof(name), "%.*s/%.*s", (int) header->cwd_len, cwd, (int) record->name_len, saved_name);
+        else snprintf(name, sizeof(name), "%.*s", (int) record->name_len, saved_name);
+        if (access(name, F_OK) == -1) continue; //deleted since
+
+        if (editor_session_load_rows(name, record, session, size) || editor_session_load_index(name, record, session, size)) {
+            e.active_buffer->dirty = 0;
+            editor_watch_buffer(e.active_buffer);
+            reused++;
+        } else {
+            editor_open_buffer(name);
+        }
+        editor_session_restore_cursor(e.active_buffer, record);
+        if (i == header->active) active = e.buffer_count - 1;
+        opened++;
+    }
+    munmap(session, size);
+
+    if (opened == 0) editor_open_buffer(NULL);
+    else editor_switch_buffer(active != -1 ? active : e.buffer_count - 1);
+    editor_set_status_message("Session of %d buffer%s restored in %.1f ms (%d from saved indexes)",
+            opened, opened == 1 ? "" : "s", (perf_now() - start) / 1e6, reused);
+    return opened;
+}
+
+/*** find ***/
+void editor_find_callback(char* query, int key) {
+    static int last_match = -1;
+    static int direction = 1; //1 is forward, -1 is backwards
+
+    e.active_buffer->match_row = -1;
+
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    if (last_match >= e.active_buffer->num_rows) last_match = -1; //the rows changed under the search
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+    int i;
+    if (e.active_buffer->paged) {
+        //scan the file on disk instead of paging in every row, then only page in the match
+        current = editor_paged_find(e.active_buffer, query, last_match, direction);
+        if (current == -1) return;
+        struct EditorRow* row = editor_row(e.active_buffer, current);
+        char* match = strstr(ROW_RENDER(row), query);
+        last_match = current;
+        e.active_buffer->cursor_y = current;
+        e.active_buffer->cursor_x = match ? editor_row_render_offset_to_cursor_x(row, match - ROW_RENDER(row)) : 0;
+        e.active_buffer->row_offset = e.active_buffer->num_rows;
+        if (match) {
+            e.active_buffer->match_row = current;
+            e.active_buffer->match_start = match - ROW_RENDER(row);
+            e.active_buffer->match_len = strlen(query);
+        }
+        return;
+    }
+    for (i = 0; i < e.active_buffer->num_rows; i++) {
+        //loop 'current'
+        current += direction;
+        if (current == -1) current = e.active_buffer->num_rows - 1;
+        else if (current == e.active_buffer->num_rows) current = 0;
+
+        struct EditorRow* row = editor_row(e.active_buffer, current);
+        char* match = strstr(ROW_RENDER(row), query);
+        if (match) {
+            last_match = current;
+            e.active_buffer->cursor_y = current;
+            e.active_buffer->cursor_x = editor_row_render_offset_to_cursor_x(row, match - ROW_RENDER(row));
+            e.active_buffer->row_offset = e.active_buffer->num_rows; //setting offset so that next screen refresh will scroll up so query is at top of screen
+
+            e.active_buffer->match_row = current;
+            e.active_buffer->match_start = match - ROW_RENDER(row);
+            e.active_buffer->match_len = strlen(query);
+            break;
+        }
+    }
+}
+
+void editor_find() {
+    editor_load_finish(e.active_buffer); //the search wraps around
+    int saved_cx = e.active_buffer->cursor_x;
+    int saved_cy = e.active_buffer->cursor_y;
+    int saved_coloff = e.active_buffer->col_offset;
+    int saved_rowoff = e.active_buffer->row_offset;
+
+    char* query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+
+    if (query) {
+        free(query);
+    } else {
+        e.active_buffer->cursor_x = saved_cx;
+        e.active_buffer->cursor_y = saved_cy;
+        e.active_buffer->col_offset = saved_coloff;
+        e.active_buffer->row_offset = saved_rowoff;
+    }
+}
+
+/*** append buffer ***/
+
+struct AppendBuffer {
+    char* buffer;
+    int len;
+    int capacity;
+};
+
+#define APPEND_BUFFER_INIT {NULL, 0, 0}
+
+//grows by doubling - a frame is built from a few escape codes and a run of text at a time
+void append_buffer_append(struct AppendBuffer* ab, const char* s, int len) {
+    if (ab->len + len > ab->capacity) {
+        int capacity = ab->capacity ? ab->capacity : 1024;
+        while (capacity < ab->len + len) capacity *= 2;
+        char* new = realloc(ab->buffer, capacity);
+        if (new == NULL) return;
+        ab->buffer = new;
+        ab->capacity = capacity;
+    }
+    memcpy(&ab->buffer[ab->len], s, len);
+    ab->len += len;
+}
+
+void append_buffer_free(struct AppendBuffer* ab) {
+    free(ab->buffer);
+}
+
+/*** output ***/
+//the top of the screen is line 'wrap_offset' of row 'row_offset', and moves just far enough to show the cursor's line
+void editor_scroll_wrapped() {
+    struct EditorBuffer* b = e.active_buffer;
+    struct WrapIndex* wrap = editor_wrap_sync(b);
+    b->col_offset = 0;
+
+    int line, column;
+    editor_wrap_cursor(b, &line, &column);
+    int cursor_line = line - wrap_prefix(wrap, b->cursor_y < b->num_rows ? b->cursor_y : b->num_rows);
+    if (b->cursor_y < b->row_offset || (b->cursor_y == b->row_offset && cursor_line < b->wrap_offset)) {
+        b->row_offset = b->cursor_y;
+        b->wrap_offset = cursor_line;
+    }
+    if (b->row_offset >= b->num_rows || b->wrap_offset < 0) b->wrap_offset = 0;
+    else if (b->wrap_offset >= b->row[b->row_offset].wrap_lines) b->wrap_offset = b->row[b->row_offset].wrap_lines - 1;
+
+    int top = wrap_prefix(wrap, b->row_offset) + b->wrap_offset;
+    if (line >= top + e.screenrows) b->row_offset = wrap_find(wrap, line - e.screenrows + 1, &b->wrap_offset);
+}
+
+void editor_scroll() {
+    e.active_buffer->render_x = 0;
+    if (e.active_buffer->cursor_y < e.active_buffer->num_rows) {
+        e.active_buffer->render_x = editor_row_cursor_x_to_render_x(editor_row(e.active_buffer, e.active_buffer->cursor_y), e.active_buffer->cursor_x);
+    }
+    if (e.block_insert.active) {
+        //cursor sits after the text typed so far (cursor_x is clamped to the row, so add any padding back)
+        if (e.block_insert.pad_short_rows) e.active_buffer->render_x += e.block_insert.col - e.active_buffer->cursor_x;
+        e.active_buffer->render_x += e.block_insert.len;
+    }
+    if (editor_wrapping(e.active_buffer)) {
+        editor_scroll_wrapped();
+        return;
+    }
+
+    if (e.active_buffer->cursor_y < e.active_buffer->row_offset) {
+        e.active_buffer->row_offset = e.active_buffer->cursor_y;
+    }
+    if (e.active_buffer->cursor_y >= e.active_buffer->row_offset + e.screenrows) {
+        e.active_buffer->row_offset = e.active_buffer->cursor_y - e.screenrows + 1;
+    }
+    if (e.active_buffer->render_x < e.active_buffer->col_offset) {
+        e.active_buffer->col_offset = e.active_buffer->render_x;
+    }
+    if (e.active_buffer->render_x >= e.active_buffer->col_offset + e.screencols) {
+        e.active_buffer->col_offset = e.active_buffer->render_x - e.screencols + 1;
+    }
+}
+
+void invert_colors(struct AppendBuffer* ab) {
+    append_buffer_append(ab, "\x1b[7m", 4);
+}
+
+void revert_colors(struct AppendBuffer* ab) {
+    append_buffer_append(ab, "\x1b[m", 3);
+    append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+    append_buffer_append(ab, COLOR_BACKGROUND, strlen(COLOR_BACKGROUND));
+}
+
+void editor_draw_buffer_tabs(struct AppendBuffer* ab) {
+    append_buffer_append(ab, "\x1b[K", 3); //clear to end of line
+    int tab_width = e.buffer_count <= 6 ? e.screencols / 6 : e.screencols / e.buffer_count;
+    int active = editor_buffer_index(e.active_buffer);
+
+    invert_colors(ab);
+
+    int current_count = 0;
+
+
+    int len = 0;
+    while (len < e.screencols) {
+        if (len >= tab_width * active && len < tab_width * (active + 1)) {
+            append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+        } else {
+            append_buffer_append(ab, COLOR_BLUE, strlen(COLOR_BLUE));
+        }
+
+        if (len % tab_width == 0) {
+            current_count++;
+            if (current_count > e.buffer_count) break;
+            append_buffer_append(ab, "|", 1);
+        } else {
+            append_buffer_append(ab, " ", 1);
+        }
+        len++;
+    }
+    revert_colors(ab);
+    append_buffer_append(ab, "\r\n", 2);
+}
+
+//TODO: This might be bugged if line goes off the screen (eg, column offset is not zero)
+void editor_get_borders(int* left_x, int* left_y, int* right_x, int* right_y) {
+    if (e.active_buffer->anchor_y > e.active_buffer->cursor_y) {
+        *left_x = e.active_buffer->render_x;
+        *left_y = e.active_buffer->cursor_y;
+        *right_x = e.active_buffer->anchor_x;
+        *right_y = e.active_buffer->anchor_y;
+    } else if (e.active_buffer->anchor_y < e.active_buffer->cursor_y) {
+        *left_x = e.active_buffer->anchor_x;
+        *left_y = e.active_buffer->anchor_y;
+        *right_x = e.active_buffer->render_x;
+        *right_y = e.active_buffer->cursor_y;
+    } else { //anchor and cursor on same row
+        *left_y = e.active_buffer->anchor_y;
+        *right_y = *left_y;
+        *left_x = e.active_buffer->anchor_x < e.active_buffer->render_x ? e.active_buffer->anchor_x : e.active_buffer->render_x;
+        *right_x = e.active_buffer->anchor_x < e.active_buffer->render_x ? e.active_buffer->render_x : e.active_buffer->anchor_x;
+    }
+}
+
+int editor_char_between_anchors(int file_row, int j, int left_x, int left_y, int right_x, int right_y) {
+    int same_line = left_y == file_row && right_y == file_row && left_x <= j && j <= right_x;
+    int middle_rows = left_y < file_row && file_row < right_y;
+    int right_of_start = right_y > left_y && file_row == left_y && left_x <= j;
+    int left_of_end = right_y > left_y && file_row == right_y && j <= right_x;
+
+    int visual_highlight = e.mode == MODE_VISUAL && (same_line || middle_rows || right_of_start || left_of_end);
+
+    int visual_line = e.mode == MODE_VISUAL_LINE && left_y <= file_row && file_row <= right_y;
+
+    int left = left_x < right_x ? left_x : right_x;
+    int right = left_x < right_x ? right_x : left_x;
+    int top = left_y;
+    int bottom = right_y;
+    int visual_block = e.mode == MODE_VISUAL_BLOCK && left <= j && j <= right && top <= file_row && file_row <= bottom;
+
+    return visual_block || visual_highlight || visual_line;
+}
+
+//draws the screen line of row 'file_row' that starts at render column 'col_offset'
+//returns the column it stopped at because the line was full, or -1 if the rest of the row is on it
+int editor_draw_row(struct AppendBuffer* ab, int file_row, int col_offset) {
+    struct EditorRow* row = editor_row(e.active_buffer, file_row);
+    char* render = ROW_RENDER(row);
+    int render_size = row->render_size;
+
+    char* preview = NULL;
+    unsigned char* preview_hl = NULL;
+    if (e.block_insert.active && e.block_insert.top <= file_row && file_row <= e.block_insert.bottom) {
+        render_size = editor_block_preview_row(row, &preview, &preview_hl);
+        if (preview) render = preview;
+    }
+
+    //find the bytes of render that are on screen - rows where every byte is one column can skip decoding
+    int one_byte_columns = preview ? utf8_ascii_prefix(render, render_size) == render_size : row->width == row->render_size;
+    int start = col_offset;
+    int column = start;
+    int cut = 0; //columns of a wide character cut off by the left edge
+    if (!one_byte_columns) {
+        start = 0;
+        column = 0;
+        while (start < render_size && column < col_offset) {
+            int cp;
+            start += utf8_decode(&render[start], render_size - start, &cp);
+            column += utf8_width(cp);
+        }
+        cut = column - col_offset;
+    }
+    if (start > render_size) start = render_size;
+    int end = start;
+    int end_column = column;
+    if (one_byte_columns) {
+        end = start + e.screencols < render_size ? start + e.screencols : render_size;
+    } else {
+        while (end < render_size) {
+            int cp;
+            int n = utf8_decode(&render[end], render_size - end, &cp);
+            if (end_column + utf8_width(cp) > col_offset + e.screencols) break;
+            end += n;
+            end_column += utf8_width(cp);
+        }
+    }
+    int len = end - start;
+    char* c = &render[start];
+    while (cut--) append_buffer_append(ab, " ", 1);
+
+    //only the visible part of the row gets expanded into per-column highlights
+    if (len + 1 > e.draw_hl_capacity) {
+        e.draw_hl_capacity = len + 1 > 2 * e.draw_hl_capacity ? len + 1 : 2 * e.draw_hl_capacity;
+        e.draw_hl = realloc(e.draw_hl, e.draw_hl_capacity);
+    }
+    unsigned char* hl = e.draw_hl;
+    if (preview_hl) {
+        memcpy(hl, &preview_hl[start], len);
+    } else {
+        editor_row_expand_hl(row, start, len, hl);
+    }
+    struct EditorBuffer* b = e.active_buffer;
+    if (file_row == b->match_row) {
+        for (int j = b->match_start; j < b->match_start + b->match_len; j++)
+            if (j >= start && j < start + len) hl[j - start] = HL_MATCH;
+    }
+    int current_color = -1;
+    int j, n;
+    for (j = 0; j < len; j += n) {
+        int cp = (unsigned char) c[j];
+        n = cp < 0x80 ? 1 : utf8_decode(&c[j], len - j, &cp);
+        int left_x, left_y, right_x, right_y;
+        editor_get_borders(&left_x, &left_y, &right_x, &right_y);
+        int visual_highlight = editor_char_between_anchors(file_row, column, left_x, left_y, right_x, right_y);
+        int is_cursor_block = e.mode == MODE_COMMAND && e.active_buffer->render_x == column && e.active_buffer->cursor_y == file_row;
+        column += utf8_width(cp);
+
+        //control characters and invalid bytes are drawn as an inverted symbol
+        int is_symbol = cp < 0x20 || cp == 0x7f || (cp >= 0x80 && cp < 0xa0) || cp == -1;
+        char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+
+        if (visual_highlight || is_cursor_block || is_symbol) {
+            invert_colors(ab);
+            if (is_symbol) append_buffer_append(ab, &sym, 1);
+            else append_buffer_append(ab, &c[j], n);
+            revert_colors(ab);
+            //reset current color
+            if (current_color != -1) {
+                char* c = editor_color_to_string(current_color);
+                append_buffer_append(ab, c, strlen(c)); 
+            }
+        } else if (hl[j] == HL_NORMAL) {
+            if (current_color != -1) {
+                append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+                current_color = -1;
+            }
+            append_buffer_append(ab, &c[j], n);
+        } else {
+            int color = editor_syntax_to_color(hl[j]);
+            if (color != current_color) {
+                current_color = color;
+              
+                char* c = editor_color_to_string(current_color);
+                append_buffer_append(ab, c, strlen(c)); 
+            }
+            append_buffer_append(ab, &c[j], n);
+        }
+    }
+    append_buffer_append(ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+    free(preview);
+    free(preview_hl);
+    return end < render_size ? column : -1;
+}
+
+void editor_draw_rows(struct AppendBuffer* ab) {
+    //with :set wrap a row can take several lines, and the top one may be partly scrolled off
+    int wrap = editor_wrapping(e.active_buffer);
+    int file_row = e.active_buffer->row_offset;
+    int column = e.active_buffer->col_offset;
+    if (wrap && file_row < e.active_buffer->num_rows)
+        column = editor_wrap_line_start(&e.active_buffer->row[file_row], e.active_buffer->wrap.cols, e.active_buffer->wrap_offset);
+
+    int y;
+    for (y = 0; y < e.screenrows; y++) {
+        if (file_row >= e.active_buffer->num_rows) { //draw empty lines
+            if (e.active_buffer->num_rows == 0 && y == e.screenrows / 3) {
+                char welcome[80];
+                int welcome_len = snprintf(welcome, sizeof(welcome),
+                        "80s Sci-Fi Editor -- version %s", ACORN_VERSION);
+                if (welcome_len > e.screencols) welcome_len = e.screencols;
+                int padding = (e.screencols - welcome_len) / 2;
+                if (padding) {
+                    append_buffer_append(ab, "~", 1);
+                    padding--;
+                }
+                while (padding--) append_buffer_append(ab, " ", 1);
+                append_buffer_append(ab, welcome, welcome_len);
+            } else {
+                append_buffer_append(ab, "~", 1);
+            }
+        } else { //draw text in buffer
+            int stop = editor_draw_row(ab, file_row, column);
+            if (wrap && stop > column) {
+                column = stop; //the rest of the row goes on the next line
+            } else {
+                file_row++;
+                column = wrap ? 0 : e.active_buffer->col_offset;
+            }
+        }
+
+        append_buffer_append(ab, "\x1b[K", 3); //clear to end of line
+        append_buffer_append(ab, "\r\n", 2);
+    }
+}
+
+//timings of the last key for the status bar overlay (:perf hud)
+int editor_perf_hud(char* buf, int size) {
+    struct Perf* perf = &e.perf;
+    if (perf->keys == 0 || size <= 0) return 0;
+    int i = (perf->keys - 1) % ACORN_PERF_SAMPLES;
+    int len = snprintf(buf, size, "  key %.2fms hl %.2f draw %.2f write %.2f | %lluB %llu rows",
+            perf->samples[PERF_KEYPRESS][i] / 1e6, perf->samples[PERF_SYNTAX][i] / 1e6,
+            perf->samples[PERF_DRAW][i] / 1e6, perf->samples[PERF_WRITE][i] / 1e6,
+            (unsigned long long) perf->bytes[i], (unsigned long long) perf->rows[i]);
+    return len < size ? len : size - 1;
+}
+
+void editor_draw_status_bar(struct AppendBuffer* ab) {
+    invert_colors(ab);
+
+    char status[160];
+    int msglen = strlen(e.status_msg);
+    if (msglen > e.screencols) msglen = e.screencols;
+    //replayed frames shouldn't depend on the wall clock, so messages stay up until replaced
+    int show_msg = msglen && (e.headless || time(NULL) - e.status_msg_time < 5) ? 1 : 0;
+    
+    char* mode_str;
+    switch (e.mode) {
+        case MODE_INSERT:
+            mode_str = "-- INSERT --";
+            break;
+        case MODE_VISUAL:
+            mode_str = "-- VISUAL --";
+            break;
+        case MODE_VISUAL_LINE:
+            mode_str = "-- VISUAL LINE --";
+            break;
+        case MODE_VISUAL_BLOCK:
+            mode_str = "-- VISUAL BLOCK --";
+            break;
+        default:
+            mode_str = "-- COMMAND --";
+            break;
+    }
+
+    int len = snprintf(status, sizeof(status), "%s", show_msg ? e.status_msg : mode_str);
+    if (e.perf.hud) len += editor_perf_hud(&status[len], sizeof(status) - len);
+
+    char flags[32] = "";
+    int progress = editor_index_progress(e.active_buffer);
+    if (e.filter.pid && e.filter.buffer == e.active_buffer) snprintf(flags, sizeof(flags), "(filtering %d)", e.filter.inserted);
+    else if (e.active_buffer->follow) snprintf(flags, sizeof(flags), "(following)");
+    else if (e.share.buffer == e.active_buffer && e.share.role == 'h') snprintf(flags, sizeof(flags), "(shared with %d)", e.share.num_connections);
+    else if (e.share.buffer == e.active_buffer) snprintf(flags, sizeof(flags), "(joined)");
+    else if (e.active_buffer->disk_changed) snprintf(flags, sizeof(flags), "(changed on disk)");
+    else if (e.active_buffer->dirty) snprintf(flags, sizeof(flags), "(modified)");
+    else if (progress != -1) snprintf(flags, sizeof(flags), e.active_buffer->paged ? "(indexing %d%%)" : "(loading %d%%)", progress);
+    else if (e.active_buffer->paged) snprintf(flags, sizeof(flags), "(read-only)");
+
+    char rstatus[80];
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s %s | %d/%d", flags,
+            e.active_buffer->filename ? e.active_buffer->filename : "[No Name]", e.active_buffer->cursor_y + 1, e.active_buffer->num_rows);
+
+    if (len > e.screencols) len = e.screencols;
+    append_buffer_append(ab, status, len);
+    while (len < e.screencols) {
+        if (e.screencols - len == rlen) {
+            append_buffer_append(ab, rstatus, rlen);
+            break;
+        } else {
+            append_buffer_append(ab, " ", 1);
+            len++;
+        }
+    }
+    revert_colors(ab);
+}
+
+void editor_refresh_screen() {
+    uint64_t trace = trace_begin();
+    editor_scroll();
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+
+    append_buffer_append(&ab, HIDE_CURSOR, strlen(HIDE_CURSOR)); //to avoid flicker when redrawing
+    append_buffer_append(&ab, "\x1b[H", 3);  //move cursor back to beginning
+
+    append_buffer_append(&ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+    append_buffer_append(&ab, COLOR_BACKGROUND, strlen(COLOR_BACKGROUND));
+
+    editor_draw_buffer_tabs(&ab);
+    perf_begin(PERF_DRAW);
+    editor_draw_rows(&ab);
+    perf_end(PERF_DRAW);
+    editor_draw_status_bar(&ab);
+
+    //draw cursor
+    if (e.mode == MODE_INSERT) {
+        char buf[32];
+        int y = e.active_buffer->cursor_y - e.active_buffer->row_offset;
+        int x = e.active_buffer->render_x - e.active_buffer->col_offset;
+        if (editor_wrapping(e.active_buffer)) {
+            editor_wrap_cursor(e.active_buffer, &y, &x);
+            y -= wrap_prefix(&e.active_buffer->wrap, e.active_buffer->row_offset) + e.active_buffer->wrap_offset;
+        }
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 2, x + 1); //terminal uses index 1.  Adding 1 for tabs bar
+        append_buffer_append(&ab, buf, strlen(buf));
+    }
+
+    append_buffer_append(&ab, SHOW_CURSOR, strlen(SHOW_CURSOR));
+         
+    perf_begin(PERF_WRITE);
+    editor_write(ab.buffer, ab.len);
+    perf_end(PERF_WRITE);
+    e.perf.current_bytes += ab.len;
+    e.frame_bytes = ab.len;
+    append_buffer_free(&ab); 
+    trace_end("frame", trace);
+    trace_paint();
+
+} 
+
+void editor_set_status_message(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(e.status_msg, sizeof(e.status_msg), fmt, ap);
+    va_end(ap);
+    e.status_msg_time = time(NULL);
+}
+
+/*** input ***/
+//called while waiting for a key - redraws when background work has something to show
+void editor_idle() {
+    int changed = editor_check_files();
+    if (e.active_buffer->loading) changed |= editor_load_idle(e.active_buffer);
+    //the index thread may have found more rows (and the progress in the status bar has moved on)
+    int indexing = editor_index_progress(e.active_buffer) != -1;
+    if (editor_index_sync(e.active_buffer) || indexing || changed) editor_refresh_screen();
+}
+
+char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
+    size_t buffer_size = 128;
+    char* buffer = malloc(buffer_size);
+    e.prompt_bytes = buffer_size;
+
+    size_t buffer_len = 0;
+    buffer[0] = '\0';
+    e.prompting++;
+
+    while (1) {
+        editor_set_status_message(prompt, buffer);
+        editor_refresh_screen();
+
+        int c = editor_read_key();
+
+        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            if (buffer_len != 0) buffer[--buffer_len] = '\0';
+        } else if (c == '\x1b') {
+            editor_set_status_message("");
+            if (callback) callback(buffer, c);
+            free(buffer);
+            e.prompt_bytes = 0;
+            e.prompting--;
+            return NULL;
+        } else if (c == '\r') {
+            if (buffer_len != 0) {
+                editor_set_status_message("");
+                if (callback) callback(buffer, c);
+                e.prompt_bytes = 0;
+                e.prompting--;
+                return buffer;
+            }
+        } else if (!iscntrl(c) && c < 128) {
+            if (buffer_len == buffer_size - 1) {
+                buffer_size *= 2;
+                buffer = realloc(buffer, buffer_size);
+                e.prompt_bytes = buffer_size;
+            }
+            buffer[buffer_len++] = c;
+            buffer[buffer_len] = '\0';
+        }
+
+        if (callback) callback(buffer, c);
+    }
+}
+
+void editor_quit() {
+    editor_write("\x1b[2J", 4);
+    editor_write("\x1b[H", 3);
+    if (e.headless) editor_replay_finish();
+    if (e.server.running) editor_server_detach(0);
+    //so the next acorn started without a file carries on from here (a server's buffers belong to its clients)
+    if (!e.headless && !e.server.running) editor_write_session(editor_session_path());
+    exit(0);
+}
+
+//closes the active buffer - 'exit_on_last' quits acorn when it was the last one (:q), otherwise an empty buffer is left (:bd)
+void editor_quit_buffer(int force, int exit_on_last) {
+    if (e.active_buffer->dirty && !force) {
+        editor_set_status_message("No write since last change. (Add ! to override).");
+        return;
+    }
+    //a client's :q only detaches it - the buffers stay loaded for the next one (:q! forgets unsaved changes first)
+    if (e.server.running && exit_on_last) {
+        if (e.active_buffer->dirty && e.active_buffer->filename && e.active_buffer->paged == NULL) editor_reload_buffer(e.active_buffer);
+        editor_write("\x1b[2J", 4);
+        editor_write("\x1b[H", 3);
+        editor_server_detach(0);
+        return;
+    }
+    if (e.buffer_count == 1 && exit_on_last) editor_quit();
+
+    editor_close_buffer(editor_buffer_index(e.active_buffer));
+    if (e.buffer_count == 0) editor_open_buffer(NULL);
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+//appends a line to the scratch buffer a report (:perf, :mem) is being written into
+void editor_report_line(const char* fmt, ...) {
+    char line[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    editor_insert_row(e.active_buffer->num_rows, line, len < (int) sizeof(line) ? len : (int) sizeof(line) - 1);
+}
+
+//:perf - opens a scratch buffer with percentiles and histograms over the last ACORN_PERF_SAMPLES keys
+void editor_perf_report() {
+    static const char* names[PERF_COUNTERS] = { "keypress", "highlight", "draw", "write" };
+    struct Perf perf = e.perf; //copied before the report buffer's own rows get highlighted
+    int n = perf.keys < ACORN_PERF_SAMPLES ? perf.keys : ACORN_PERF_SAMPLES;
+    if (n == 0) {
+        editor_set_status_message("No keys recorded yet");
+        return;
+    }
+
+    editor_open_buffer(NULL);
+    editor_report_line("acorn performance - last %d keys (%d in total), times in ms", n, perf.keys);
+    editor_report_line("");
+    editor_report_line("%-12s %9s %9s %9s %9s %9s", "", "avg", "p50", "p90", "p99", "max");
+
+    uint64_t sorted[PERF_COUNTERS][ACORN_PERF_SAMPLES];
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        uint64_t total = 0;
+        memcpy(sorted[c], perf.samples[c], sizeof(uint64_t) * n);
+        qsort(sorted[c], n, sizeof(uint64_t), compare_u64);
+        for (int i = 0; i < n; i++) total += sorted[c][i];
+        editor_report_line("%-12s %9.3f %9.3f %9.3f %9.3f %9.3f", names[c], total / 1e6 / n,
+                sorted[c][n / 2] / 1e6, sorted[c][n * 90 / 100] / 1e6, sorted[c][n * 99 / 100] / 1e6, sorted[c][n - 1] / 1e6);
+    }
+
+    uint64_t total_bytes = 0, max_bytes = 0, total_rows = 0, max_rows = 0;
+    for (int i = 0; i < n; i++) {
+        total_bytes += perf.bytes[i];
+        total_rows += perf.rows[i];
+        if (perf.bytes[i] > max_bytes) max_bytes = perf.bytes[i];
+        if (perf.rows[i] > max_rows) max_rows = perf.rows[i];
+    }
+    editor_report_line("");
+    editor_report_line("bytes written per key    avg %llu  max %llu", (unsigned long long) (total_bytes / n), (unsigned long long) max_bytes);
+    editor_report_line("rows highlighted per key avg %.1f  max %llu", (double) total_rows / n, (unsigned long long) max_rows);
+
+    //buckets grow by 4x: <16us, <64us, ... <64ms, and everything slower
+    static const char* buckets[] = { "<16us", "<64us", "<256us", "<1ms", "<4ms", "<16ms", "<64ms", ">=64ms" };
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        int counts[8] = { 0 };
+        for (int i = 0; i < n; i++) {
+            int b = 0;
+            for (uint64_t limit = 16000; b < 7 && sorted[c][i] >= limit; limit *= 4) b++;
+            counts[b]++;
+        }
+        editor_report_line("");
+        editor_report_line("%s", names[c]);
+        for (int b = 0; b < 8; b++) {
+            char bar[51];
+            int width = counts[b] * 50 / n;
+            memset(bar, '#', width);
+            bar[width] = '\0';
+            editor_report_line("  %-7s %5d %s", buckets[b], counts[b], bar);
+        }
+    }
+
+    editor_del_row(0); //the empty row the buffer was opened with
+    e.active_buffer->cursor_y = 0;
+    e.active_buffer->dirty = 0;
+}
+
+//bytes a buffer is holding on to, by what they're for
+struct BufferMemory {
+    size_t text; //row chars (may be shared with registers)
+    size_t text_reserved; //chunks of the text arena, including free blocks
+    size_t render; //expanded copies of rows with tabs
+    size_t render_reserved;
+    size_t highlight; //highlight runs the rows point at (shared through the highlight cache)
+    size_t rows; //the row array, or the page cache of a large file
+    size_t index; //line index of a large file
+};
+
+size_t editor_hl_bytes(struct EditorRow* row) {
+    return row->hl ? sizeof(struct HighlightRuns) + sizeof(struct HighlightSpan) * row->hl_count : 0;
+}
+
+void editor_buffer_memory(struct EditorBuffer* buffer, struct BufferMemory* mem) {
+    memset(mem, 0, sizeof(*mem));
+    mem->text = buffer->text_arena->live;
+    mem->text_reserved = buffer->text_arena->reserved;
+    mem->render = buffer->derived_arena->live;
+    mem->render_reserved = buffer->derived_arena->reserved;
+    if (buffer->paged) {
+        struct PagedFile* paged = buffer->paged;
+        for (int p = 0; p < ACORN_PAGE_CACHE; p++) {
+            if (paged->pages[p].index == -1) continue;
+            mem->rows += sizeof(struct EditorRow) * paged->pages[p].num_rows;
+            for (int j = 0; j < paged->pages[p].num_rows; j++) mem->highlight += editor_hl_bytes(&paged->pages[p].row[j]);
+        }
+        pthread_mutex_lock(&paged->lock);
+        mem->index = sizeof(off_t) * paged->num_checkpoints;
+        pthread_mutex_unlock(&paged->lock);
+    } else {
+        mem->rows = sizeof(struct EditorRow) * buffer->row_capacity;
+        for (int j = 0; j < buffer->num_rows; j++) mem->highlight += editor_hl_bytes(&buffer->row[j]);
+    }
+}
+
+//memory that isn't owned by any one buffer
+struct EditorMemory {
+    size_t hl_cache; //runs, entries and slots of the highlight cache
+    size_t registers; //slice tables (the text is counted with the buffer it was yanked from)
+    size_t frame;
+    size_t prompt;
+    size_t tracing;
+    double allocs_per_key; //over the last ACORN_PERF_SAMPLES keys
+    uint64_t max_allocs_per_key;
+    long rss_kb;
+    long peak_rss_kb;
+};
+
+void editor_memory(struct EditorMemory* mem) {
+    memset(mem, 0, sizeof(*mem));
+    struct HighlightCache* cache = &e.hl_cache;
+    mem->hl_cache = cache->arena->reserved + sizeof(struct HighlightCacheEntry) * cache->allocated + sizeof(struct HighlightCacheSlot) * cache->num_slots;
+    for (int i = 0; i < REGISTER_COUNT; i++)
+        mem->registers += sizeof(struct RegisterSlice) * e.registers[i].num_slices;
+    mem->frame = e.frame_bytes;
+    mem->prompt = e.prompt_bytes;
+    mem->tracing = e.trace.events ? sizeof(struct TraceEvent) * ACORN_TRACE_EVENTS : 0;
+
+    int n = e.perf.keys < ACORN_PERF_SAMPLES ? e.perf.keys : ACORN_PERF_SAMPLES;
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += e.perf.allocs[i];
+        if (e.perf.allocs[i] > mem->max_allocs_per_key) mem->max_allocs_per_key = e.perf.allocs[i];
+    }
+    mem->allocs_per_key = n ? (double) total / n : 0;
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) mem->peak_rss_kb = usage.ru_maxrss;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    long pages;
+    if (fp && fscanf(fp, "%*s %ld", &pages) == 1) mem->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    if (fp) fclose(fp);
+}
+
+//:mem - opens a scratch buffer with the memory used by each buffer and by the editor itself (in KB)
+void editor_mem_report() {
+    struct EditorMemory mem;
+    editor_memory(&mem);
+    int count = e.buffer_count;
+    struct EditorBuffer** buffers = malloc(sizeof(struct EditorBuffer*) * count); //the report opens a buffer of its own
+    memcpy(buffers, e.buffers, sizeof(struct EditorBuffer*) * count);
+
+    editor_open_buffer(NULL);
+    editor_report_line("acorn memory (KB) - reserved arena chunks in brackets");
+    editor_report_line("");
+    editor_report_line("%-24s %9s %18s %18s %9s %9s %9s", "buffer", "rows", "text", "render", "highlight", "row array", "index");
+    for (int i = 0; i < count; i++) {
+        struct BufferMemory bm;
+        editor_buffer_memory(buffers[i], &bm);
+        const char* name = buffers[i]->filename ? buffers[i]->filename : "[No Name]";
+        if (strlen(name) > 24) name += strlen(name) - 24;
+        editor_report_line("%-24s %9d %8zu [%7zu] %8zu [%7zu] %9zu %9zu %9zu", name, buffers[i]->num_rows,
+                bm.text / 1024, bm.text_reserved / 1024, bm.render / 1024, bm.render_reserved / 1024,
+                bm.highlight / 1024, bm.rows / 1024, bm.index / 1024);
+    }
+    free(buffers);
+
+    editor_report_line("");
+    editor_report_line("highlight cache   %9zu", mem.hl_cache / 1024);
+    editor_report_line("registers         %9zu", mem.registers / 1024);
+    editor_report_line("last frame        %9zu", mem.frame / 1024);
+    editor_report_line("prompt            %9zu", mem.prompt / 1024);
+    editor_report_line("trace buffer      %9zu", mem.tracing / 1024);
+    editor_report_line("");
+    if (ACORN_COUNTS_ALLOCS) editor_report_line("allocations per key  avg %.1f  max %llu", mem.allocs_per_key, (unsigned long long) mem.max_allocs_per_key);
+    else editor_report_line("allocations per key  not counted (only acorn_replay counts them)");
+    editor_report_line("resident             %ld KB (peak %ld KB)", mem.rss_kb, mem.peak_rss_kb);
+
+    editor_del_row(0); //the empty row the buffer was opened with
+    e.active_buffer->cursor_y = 0;
+    e.active_buffer->dirty = 0;
+}
+
+//:mem dump [file] - the same numbers as json (in bytes), for comparing runs
+int editor_mem_dump(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) return -1;
+    struct EditorMemory mem;
+    editor_memory(&mem);
+
+    fprintf(fp, "{\n  \"buffers\": [");
+    for (int i = 0; i < e.buffer_count; i++) {
+        struct BufferMemory bm;
+        editor_buffer_memory(e.buffers[i], &bm);
+        fprintf(fp, "%s\n    {\"name\": \"", i ? "," : "");
+        for (char* c = e.buffers[i]->filename; c && *c; c++) {
+            if (*c == '"' || *c == '\\') fputc('\\', fp);
+            if ((unsigned char) *c >= ' ') fputc(*c, fp);
+        }
+        fprintf(fp, "\", \"rows\": %d, \"text\": %zu, \"text_reserved\": %zu, \"render\": %zu, \"render_reserved\": %zu, "
+                "\"highlight\": %zu, \"row_array\": %zu, \"index\": %zu}",
+                e.buffers[i]->num_rows, bm.text, bm.text_reserved, bm.render, bm.render_reserved, bm.highlight, bm.rows, bm.index);
+    }
+    fprintf(fp, "\n  ],\n");
+    fprintf(fp, "  \"highlight_cache\": %zu,\n  \"registers\": %zu,\n  \"frame\": %zu,\n  \"prompt\": %zu,\n  \"trace\": %zu,\n",
+            mem.hl_cache, mem.registers, mem.frame, mem.prompt, mem.tracing);
+    if (ACORN_COUNTS_ALLOCS) fprintf(fp, "  \"allocs_per_key\": %.1f,\n  \"max_allocs_per_key\": %llu,\n",
+            mem.allocs_per_key, (unsigned long long) mem.max_allocs_per_key);
+    else fprintf(fp, "  \"allocs_per_key\": null,\n  \"max_allocs_per_key\": null,\n");
+    fprintf(fp, "  \"rss_kb\": %ld,\n  \"peak_rss_kb\": %ld\n}\n", mem.rss_kb, mem.peak_rss_kb);
+    fclose(fp);
+    return 0;
+}
+
+void editor_set_option(char* option) {
+    char* value = strchr(option, '=');
+    if (value) *value++ = '\0';
+
+    if (!strcmp(option, "cachebudget") && value) {
+        e.cache_budget = (size_t) strtoul(value, NULL, 10) * 1024 * 1024;
+        editor_evict_buffers();
+    } else if (!strcmp(option, "hlcache") && value) {
+        hl_cache_resize(atoi(value));
+    } else if (!strcmp(option, "largefile") && value) {
+        e.large_file_size = (off_t) strtoul(value, NULL, 10) * 1024 * 1024;
+    } else if (!strcmp(option, "wrap")) {
+        e.wrap = 1; //each buffer's wrap index is built the first time it's drawn
+        if (e.active_buffer->paged) editor_set_status_message("Large files aren't wrapped");
+    } else if (!strcmp(option, "nowrap")) {
+        e.wrap = 0;
+        for (int i = 0; i < e.buffer_count; i++) editor_wrap_free(e.buffers[i]);
+    } else {
+        editor_set_status_message("Unknown option: %s", option);
+    }
+}
+
+void editor_run_command(char* command) {
+    int start, end;
+    char* rest;
+    if (!strcmp(command, "w") || !strcmp(command, "w!")) {
+        editor_save(command[1] == '!');
+    } else if (!strncmp(command, "w ", 2)) {
+        if (editor_read_only()) return;
+        free(e.active_buffer->filename);
+        e.active_buffer->filename = strdup(&command[2]);
+        e.active_buffer->compressor = editor_compressor_for_name(e.active_buffer->filename);
+        e.active_buffer->disk_changed = 0;
+        editor_save(0);
+    } else if (!strncmp(command, "e ", 2)) {
+        editor_open_buffer(&command[2]);
+    } else if (!strcmp(command, "e!")) {
+        editor_revert();
+    } else if (!strcmp(command, "mksession") || !strncmp(command, "mksession ", 10)) {
+        editor_mksession(command[9] ? &command[10] : editor_session_path());
+    } else if (!strcmp(command, "follow")) {
+        editor_follow(e.active_buffer);
+    } else if (!strcmp(command, "share") || !strncmp(command, "share ", 6)) {
+        editor_share(command[5] ? &command[6] : NULL);
+    } else if (!strcmp(command, "join") || !strncmp(command, "join ", 5)) {
+        editor_join(command[4] ? &command[5] : NULL);
+    } else if (!strcmp(command, "unshare")) {
+        editor_share_stop();
+    } else if (!strcmp(command, "q") || !strcmp(command, "q!")) {
+        editor_quit_buffer(command[1] == '!', 1);
+    } else if (!strcmp(command, "bd") || !strcmp(command, "bd!")) {
+        editor_quit_buffer(command[2] == '!', 0);
+    } else if (!strcmp(command, "Q") || !strcmp(command, "Q!")) {
+        //:Q closes acorn, but only if none of the buffers are dirty
+        for (int i = 0; i < e.buffer_count && command[1] != '!'; i++) {
+            if (e.buffers[i]->dirty) {
+                editor_set_status_message("%s has unsaved changes. (Add ! to override).",
+                        e.buffers[i]->filename ? e.buffers[i]->filename : "[No Name]");
+                return;
+            }
+        }
+        editor_quit();
+    } else if (!strncmp(command, "set ", 4)) {
+        editor_set_option(&command[4]);
+    } else if (!strcmp(command, "perf")) {
+        editor_perf_report();
+    } else if (!strcmp(command, "perf hud")) {
+        e.perf.hud = !e.perf.hud;
+    } else if (!strncmp(command, "g/", 2) || !strncmp(command, "g!/", 3) || !strncmp(command, "v/", 2)) {
+        editor_global(command);
+    } else if (!strcmp(command, "mem")) {
+        editor_mem_report();
+    } else if (!strcmp(command, "mem dump") || !strncmp(command, "mem dump ", 9)) {
+        char* path = command[8] ? &command[9] : "acorn-mem.json";
+        if (editor_mem_dump(path) == -1) editor_set_status_message("Can't write %s! I/O error: %s", path, strerror(errno));
+        else editor_set_status_message("Memory usage written to %s", path);
+    } else if (!strcmp(command, "trace start") || !strncmp(command, "trace start ", 12)) {
+        trace_start(command[11] ? &command[12] : "acorn-trace.json");
+        editor_set_status_message("Tracing to %s (:trace stop to write it)", e.trace.path);
+    } else if (!strcmp(command, "trace stop")) {
+        int written = trace_stop();
+        if (written == -1) editor_set_status_message("Can't write trace! I/O error: %s", strerror(errno));
+        else editor_set_status_message("%d trace events written to %s", written, e.trace.path ? e.trace.path : "");
+    } else if (strchr(command, '!') && (rest = editor_parse_range(command, &start, &end)) && *rest == '!') {
+        editor_filter(start, end, rest + 1);
+    } else if (isdigit(command[0])) {
+        editor_goto_line(atoi(command) - 1);
+    } else {
+        editor_set_status_message("Not an editor command: %s", command);
+    }
+}
+
+void editor_move_cursor(int key) {
+    struct EditorRow* row = (e.active_buffer->cursor_y >= e.active_buffer->num_rows) ? NULL : editor_row(e.active_buffer, e.active_buffer->cursor_y);
+
+    switch(key) {
+        case ARROW_LEFT:
+            if (e.active_buffer->cursor_x != 0) {
+                e.active_buffer->cursor_x = row ? utf8_char_start(row->chars, e.active_buffer->cursor_x - 1) : e.active_buffer->cursor_x - 1;
+            } 
+            break;
+        case ARROW_DOWN:
+            if (e.active_buffer->cursor_y == e.active_buffer->num_rows - 1) editor_index_wait(e.active_buffer, e.active_buffer->cursor_y + 1);
+            if (e.active_buffer->cursor_y < e.active_buffer->num_rows - 1) e.active_buffer->cursor_y++;
+            break;
+        case ARROW_UP:
+            if (e.active_buffer->cursor_y != 0) e.active_buffer->cursor_y--;
+            break;
+        case ARROW_RIGHT:
+            if (row) {
+                int next = e.active_buffer->cursor_x + utf8_char_len(row->chars, row->size, e.active_buffer->cursor_x);
+                if (next < row->size) e.active_buffer->cursor_x = next;
+            }
+            break;
+    }
+
+    //move cursor back if next line is shorter the the line we just came from
+    row = (e.active_buffer->cursor_y >= e.active_buffer->num_rows) ? NULL : editor_row(e.active_buffer, e.active_buffer->cursor_y);
+    int rowlen = row ? row->size : 0;
+    if (e.active_buffer->cursor_x >= rowlen) {
+        e.active_buffer->cursor_x = rowlen - 1 > 0 ? rowlen - 1 : 0;
+    }
+    //and onto the start of a character (rows are indexed by byte)
+    if (row) e.active_buffer->cursor_x = utf8_char_start(row->chars, e.active_buffer->cursor_x);
+}
+
+void editor_switch_mode(int mode) {
+    switch (mode) {
+        case MODE_COMMAND:
+            e.mode = MODE_COMMAND;
+            //check if cursor_x is on at end of row (possible in insert mode), and if so move back one space
+            if (e.active_buffer->cursor_x >= editor_row(e.active_buffer, e.active_buffer->cursor_y)->size)
+                e.active_buffer->cursor_x = editor_row(e.active_buffer, e.active_buffer->cursor_y)->size - 1;
+            if (e.active_buffer->cursor_x > 0)
+                e.active_buffer->cursor_x = utf8_char_start(editor_row(e.active_buffer, e.active_buffer->cursor_y)->chars, e.active_buffer->cursor_x);
+            break;
+        case MODE_INSERT:
+            if (editor_read_only()) break;
+            e.mode = MODE_INSERT;
+            break;
+        case MODE_VISUAL:
+            e.mode = MODE_VISUAL;
+            e.active_buffer->anchor_x = e.active_buffer->cursor_x;
+            e.active_buffer->anchor_y = e.active_buffer->cursor_y;
+            break;
+        case MODE_VISUAL_LINE:
+            e.mode = MODE_VISUAL_LINE;
+            e.active_buffer->anchor_x = e.active_buffer->cursor_x;
+            e.active_buffer->anchor_y = e.active_buffer->cursor_y;
+            break;
+        case MODE_VISUAL_BLOCK:
+            e.mode = MODE_VISUAL_BLOCK;
+            e.active_buffer->anchor_x = e.active_buffer->cursor_x;
+            e.active_buffer->anchor_y = e.active_buffer->cursor_y;
+            break;
+        default:
+            break;
+    }
+}
+
+int editor_process_command_key(int c, int* key_history, int history_ptr) {
+    int clear_flag = 0;
+
+    //if last char was 'r', then replace character with pressed key and set clear_flag
+    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
+    if (last_char == 'r') {
+        if (!editor_read_only()) editor_row_replace_char(&e.active_buffer->row[e.active_buffer->cursor_y], e.active_buffer->cursor_x, c);
+        clear_flag = 1;
+    } else if (last_char == '"') {
+        e.register_name = c;
+        clear_flag = 1;
+    } else {
+        switch (c) {
+            case 'A':
+                editor_switch_mode(MODE_INSERT);
+                if (e.mode != MODE_INSERT) break;
+                e.active_buffer->cursor_x = editor_row(e.active_buffer, e.active_buffer->cursor_y)->size;
+                break;
+            case 'G':
+                editor_goto_line(INT_MAX);
+                break;
+            case 'V':
+                editor_switch_mode(MODE_VISUAL_LINE);
+                break;
+            case 'H':
+                editor_switch_buffer(editor_buffer_index(e.active_buffer) - 1);
+                break;
+            case 'L':
+                editor_switch_buffer(editor_buffer_index(e.active_buffer) + 1);
+                break;
+            case 'P':
+                editor_put(1);
+                break;
+            case 'a':
+                editor_switch_mode(MODE_INSERT);
+                if (e.mode != MODE_INSERT) break;
+                int empty_line = editor_row(e.active_buffer, e.active_buffer->cursor_y)->size == 0 ? 1 : 0;
+                e.active_buffer->cursor_x = empty_line ? 0 : e.active_buffer->cursor_x + 1;
+                break;
+            case 'd':
+                {
+                    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
+                    if (last_char == 'd' && !editor_read_only()) {
+                        editor_yank_lines(e.active_buffer->cursor_y, e.active_buffer->cursor_y);
+                        editor_del_row(e.active_buffer->cursor_y);
+                        if (e.active_buffer->cursor_y >= e.active_buffer->num_rows)
+                            editor_move_cursor(ARROW_UP);
+                        clear_flag = 1;
+                    }
+                }
+                break;
+            case 'g':
+                {
+                    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
+                    if (last_char == 'g') {
+                        e.active_buffer->cursor_x = 0;
+                        editor_goto_line(0);
+                    }
+                }
+                break;
+            case 'i':
+                editor_switch_mode(MODE_INSERT);
+                break;
+            case 'h':
+                editor_move_cursor(ARROW_LEFT);
+                break;
+            case 'j':
+                editor_move_cursor(ARROW_DOWN);
+                break;
+            case 'k':
+                editor_move_cursor(ARROW_UP);
+                break;
+            case 'l':
+                editor_move_cursor(ARROW_RIGHT);
+                break;
+            case 'p':
+                editor_put(0);
+                break;
+            case 'v':
+                editor_switch_mode(MODE_VISUAL);
+                break;
+            case CTRL_KEY('v'):
+                editor_switch_mode(MODE_VISUAL_BLOCK);
+                break;
+            case 'x':
+                if (editor_read_only()) break;
+                {
+                    struct EditorRow* row = &e.active_buffer->row[e.active_buffer->cursor_y];
+                    e.active_buffer->cursor_x += utf8_char_len(row->chars, row->size, e.active_buffer->cursor_x);
+                }
+                editor_del_char();
+                if (e.active_buffer->cursor_x >= editor_row(e.active_buffer, e.active_buffer->cursor_y)->size)
+                    editor_move_cursor(ARROW_LEFT);
+                break;
+            case 'y':
+                {
+                    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
+                    if (last_char == 'y') {
+                        editor_yank_lines(e.active_buffer->cursor_y, e.active_buffer->cursor_y);
+                        clear_flag = 1;
+                    }
+                }
+                break;
+            case '0':
+                e.active_buffer->cursor_x = 0;
+                break;
+            case '$':
+                {
+                    struct EditorRow* row = editor_row(e.active_buffer, e.active_buffer->cursor_y);
+                    e.active_buffer->cursor_x = row->size > 0 ? utf8_char_start(row->chars, row->size - 1) : -1;
+                }
+                break;
+            case ':': {
+                char* command = editor_prompt(":%s", NULL);
+                if (command == NULL) break;
+                editor_run_command(command);
+                free(command);
+                break;
+            }
+            case '/':
+                //TODO: 'n' and 'N' to go forward/backward after the prompt is closed
+                editor_find();
+                break;
+            default:
+                break;
+        }
+    }
+
+    return clear_flag;
+}
+
+int editor_process_block_insert_key(int c) {
+    switch (c) {
+        case CTRL_KEY('l'):
+        case '\x1b':
+            editor_apply_block_insert();
+            editor_switch_mode(MODE_COMMAND);
+            break;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (e.block_insert.len > 0) e.block_insert.len--;
+            break;
+        case '\t':
+            for (int i = 0; i < ACORN_TAB_STOP; i++) editor_block_insert_char(' ');
+            break;
+        default:
+            //keys from editor_key (ARROW_*, DEL_KEY, ...) are >= 1000 and must not be truncated into text
+            //live utf-8 bytes come in as negative chars, so only the high side is bounded
+            if (c < 256 && (unsigned char) c >= ' ') editor_block_insert_char(c);
+            break;
+    }
+    return 0;
+}
+
+int editor_process_insert_key(int c, int* key_history, int history_ptr) {
+    if (e.block_insert.active) return editor_process_block_insert_key(c);
+
+    int clear_flag = 0;
+    switch(c) {
+        case '\r':
+            editor_insert_new_line();
+            break;
+        case HOME_KEY:
+            e.active_buffer->cursor_x = 0;
+            break;
+        case END_KEY:
+            if (e.active_buffer->cursor_y < e.active_buffer->num_rows)
+                e.active_buffer->cursor_x = editor_row(e.active_buffer, e.active_buffer->cursor_y)->size;
+            break;
+        case CTRL_KEY('f'):
+            editor_find();
+            break;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            if (c == DEL_KEY) editor_move_cursor(ARROW_RIGHT);
+            editor_del_char();
+            break;
+        case PAGE_UP:
+        case PAGE_DOWN: 
+            {
+                if (editor_wrapping(e.active_buffer)) {
+                    e.active_buffer->cursor_y = editor_wrap_page(e.active_buffer, c == PAGE_UP ? -1 : 1);
+                    editor_move_cursor(0); //only keeps cursor_x inside the row
+                    break;
+                }
+                if (c == PAGE_UP) {
+                    e.active_buffer->cursor_y = e.active_buffer->row_offset;
+                } else if (c == PAGE_DOWN) {
+                    e.active_buffer->cursor_y = e.active_buffer->row_offset + e.screenrows - 1;
+                    if (e.active_buffer->cursor_y > e.active_buffer->num_rows) e.active_buffer->cursor_y = e.active_buffer->num_rows;
+                }
+
+                int times = e.screenrows;
+                while (times--)
+                    editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            }
+            break;
+        case ARROW_LEFT:
+        case ARROW_DOWN:
+        case ARROW_UP:
+        case ARROW_RIGHT:
+            editor_move_cursor(c);
+            break;
+        case CTRL_KEY('l'):
+        case '\x1b':
+            editor_switch_mode(MODE_COMMAND);
+            break;
+        default:
+            editor_insert_char(c);
+            break;
+    }
+    return clear_flag;
+}
+
+int editor_process_visual_key(int c, int* key_history, int history_ptr) {
+    int clear_flag = 0;
+    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
+    if (last_char == '"') {
+        e.register_name = c;
+        return 1;
+    }
+
+    switch(c) {
+        case 'G':
+            editor_goto_line(INT_MAX);
+            break;
+        case 'g':
+            {
+                int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
+                if (last_char == 'g') {
+                    e.active_buffer->cursor_x = 0;
+                    editor_goto_line(0);
+                }
+            }
+            break;
+        case 'h':
+            editor_move_cursor(ARROW_LEFT);
+            break;
+        case 'j':
+            editor_move_cursor(ARROW_DOWN);
+            break;
+        case 'k':
+            editor_move_cursor(ARROW_UP);
+            break;
+        case 'l':
+            editor_move_cursor(ARROW_RIGHT);
+            break;
+        case 'v':
+            editor_switch_mode(MODE_COMMAND);
+            break;
+        case 'y':
+            editor_yank_selection();
+            editor_switch_mode(MODE_COMMAND);
+            break;
+        case 'I':
+        case 'A':
+        case 'c':
+            if (e.mode == MODE_VISUAL_BLOCK && !editor_read_only()) editor_begin_block_insert(c);
+            break;
+        case 'd':
+        case 'x':
+            if (e.mode == MODE_VISUAL_BLOCK && !editor_read_only()) editor_delete_block();
+            break;
+        case '\x1b':
+            editor_switch_mode(MODE_COMMAND);
+            break;
+        default:
+            break;
+    }
+    return clear_flag;
+}
+
+void editor_process_key(int c) {
+    static int key_history[MAX_KEY_HISTORY] = {'&'}; //'&' is unused in command mode
+    static int history_ptr = 0;
+    int clear_flag = 0;
+
+    switch (e.mode) {
+        case MODE_COMMAND:
+            clear_flag = editor_process_command_key(c, key_history, history_ptr);
+            break;
+        case MODE_INSERT:
+            clear_flag = editor_process_insert_key(c, key_history, history_ptr);
+            break;
+        case MODE_VISUAL:
+        case MODE_VISUAL_LINE:
+        case MODE_VISUAL_BLOCK:
+            clear_flag = editor_process_visual_key(c, key_history, history_ptr);
+        default:
+            break;
+    }
+
+
+    if (clear_flag) {
+        key_history[history_ptr] = '&';
+    } else {
+        key_history[history_ptr] = c;
+    }
+    history_ptr++;
+    history_ptr %= MAX_KEY_HISTORY;
+}
+
+void editor_process_keypress() {
+    int c = editor_read_key();
+    trace_key(c);
+    perf_end_key(); //the previous key has been drawn by now
+    perf_begin(PERF_KEYPRESS);
+
+    if (c == CTRL_KEY('c') && e.filter.pid) editor_filter_cancel();
+    else editor_process_key(c);
+
+    perf_end(PERF_KEYPRESS);
+    e.perf.current[PERF_KEYPRESS] -= e.perf.waited;
+}
+
+/*** server ***/
+char* editor_socket_path() {
+    static char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    if (getenv("ACORN_SOCKET")) snprintf(path, sizeof(path), "%s", getenv("ACORN_SOCKET"));
+    else if (getenv("XDG_RUNTIME_DIR")) snprintf(path, sizeof(path), "%s/acorn.sock", getenv("XDG_RUNTIME_DIR"));
+    else snprintf(path, sizeof(path), "/tmp/acorn-%d.sock", (int) getuid());
+    return path;
+}
+
+int editor_socket_address(struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", editor_socket_path());
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+int editor_message_send(int fd, char type, const void* data, int len) {
+    struct ServerMessage header = { type, len };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void*) data, len } };
+    size_t left = sizeof(header) + len;
+    struct iovec* v = iov;
+    int n = len > 0 ? 2 : 1;
+    while (left > 0) {
+        ssize_t written = writev(fd, v, n);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        left -= written;
+        while (n > 0 && (size_t) written >= v->iov_len) {
+            written -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char*) v->iov_base + written;
+            v->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+//reads exactly 'len' bytes, returns -1 if the other side went away first
+int editor_message_read(int fd, void* data, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, (char*) data + got, len - got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+void editor_server_unlink() {
+    unlink(editor_socket_path());
+}
+
+//removes a socket left behind by a process that didn't exit cleanly
+//anything else at 'path' (say, a file someone typed by mistake) is left alone and fails with EEXIST
+int unlink_stale_socket(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) == -1) return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return unlink(path);
+}
 
-        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buffer_len != 0) buffer[--buffer_len] = '\0';
-        } else if (c == '\x1b') {
-            editor_set_status_message("");
-            if (callback) callback(buffer, c);
-            free(buffer);
-            return NULL;
-        } else if (c == '\r') {
-            if (buffer_len != 0) {
-                editor_set_status_message("");
-                if (callback) callback(buffer, c);
-                return buffer;
+//binds the socket and goes into the background (the parent prints where the server is and exits)
+void editor_server_listen() {
+    struct sockaddr_un addr;
+    int probe = editor_socket_address(&addr);
+    if (connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "acorn: a server is already running on %s\n", addr.sun_path);
+        exit(1);
+    }
+    close(probe);
+    if (unlink_stale_socket(addr.sun_path) == -1) {
+        fprintf(stderr, "acorn: can't listen on %s: %s\n", addr.sun_path, strerror(errno));
+        exit(1);
+    }
+
+    int fd = editor_socket_address(&addr);
+    mode_t mask = umask(077); //only this user can attach
+    if (fd == -1 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, 8) == -1) {
+        perror("acorn: can't listen");
+        exit(1);
+    }
+    umask(mask);
+
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid > 0) {
+        printf("acorn server running on %s (acorn --client [file] attaches)\n", addr.sun_path);
+        fflush(stdout);
+        _exit(0);
+    }
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    if (null != -1) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    signal(SIGPIPE, SIG_IGN); //a client that vanishes shows up as EPIPE
+    atexit(editor_server_unlink);
+
+    e.server.running = 1;
+    e.server.listen_fd = fd;
+    e.server.client = -1;
+}
+
+//what a running filter should watch for input besides its pipes
+int editor_input_fd() {
+    if (e.headless) return -1;
+    if (e.server.running) return e.server.client != -1 ? e.server.client : e.server.listen_fd;
+    return STDIN_FILENO;
+}
+
+void editor_server_resize(int rows, int cols) {
+    e.screenrows = rows - 2; //for status bar and tabs
+    e.screencols = cols;
+    e.server.frame_len = 0; //the client gets a whole frame next
+}
+
+//takes in a client: its terminal size, and the file it wants (opened, or switched to if it's already loaded)
+void editor_server_attach() {
+    int fd = accept4(e.server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) return;
+
+    struct ServerMessage header;
+    int size[2];
+    if (editor_message_read(fd, &header, sizeof(header)) == -1 || header.type != 'h' || header.len < (int) sizeof(size) ||
+            header.len > PATH_MAX + (int) sizeof(size) || editor_message_read(fd, size, sizeof(size)) == -1) {
+        close(fd);
+        return;
+    }
+    int path_len = header.len - sizeof(size);
+    char* path = malloc(path_len + 1);
+    if (editor_message_read(fd, path, path_len) == -1) {
+        free(path);
+        close(fd);
+        return;
+    }
+    path[path_len] = '\0';
+
+    e.server.client = fd;
+    e.server.num_keys = e.server.next_key = 0;
+    editor_server_resize(size[0], size[1]);
+    if (path_len > 0) {
+        int found = -1;
+        for (int i = 0; i < e.buffer_count; i++)
+            if (e.buffers[i]->filename && !strcmp(e.buffers[i]->filename, path)) found = i;
+        if (found != -1) {
+            editor_switch_buffer(found);
+        } else {
+            //the empty buffer a server started without a file has isn't worth keeping a tab for
+            struct EditorBuffer* scratch = e.active_buffer;
+            int unused = scratch->filename == NULL && !scratch->dirty && scratch->num_rows <= 1 && scratch->row[0].size == 0;
+            editor_open_buffer(path);
+            if (unused && e.active_buffer != scratch) editor_close_buffer(editor_buffer_index(scratch));
+        }
+    }
+    free(path);
+    editor_refresh_screen();
+}
+
+//sends the client on its way with an exit status - its terminal is left however the last output left it
+void editor_server_detach(int status) {
+    if (e.server.client == -1) return;
+    editor_message_send(e.server.client, 'x', &status, sizeof(status));
+    close(e.server.client);
+    e.server.client = -1;
+    e.server.num_keys = e.server.next_key = 0;
+}
+
+int editor_server_key(char* c) {
+    if (e.server.next_key == e.server.num_keys) return 0;
+    *c = e.server.keys[e.server.next_key++];
+    return 1;
+}
+
+//waits (up to 100ms) for the client, or for a client to attach if there's none, and takes in what it sent
+//returns 1 if keys came in
+int editor_server_poll() {
+    struct Server* s = &e.server;
+    struct pollfd fds[1] = { { editor_input_fd(), POLLIN, 0 } };
+    if (poll(fds, 1, 100) <= 0) return 0;
+    if (s->client == -1) {
+        editor_server_attach();
+        return 0;
+    }
+
+    struct ServerMessage header;
+    //a client that went away (its terminal was closed) or sends garbage is dropped
+    if (editor_message_read(s->client, &header, sizeof(header)) == -1 || header.len < 0 || header.len > ACORN_SERVER_MESSAGE_MAX) {
+        editor_server_detach(1);
+        return 0;
+    }
+    if (header.len > s->key_capacity) {
+        s->key_capacity = header.len;
+        s->keys = realloc(s->keys, s->key_capacity);
+    }
+    if (editor_message_read(s->client, s->keys, header.len) == -1) {
+        editor_server_detach(1);
+        return 0;
+    }
+    if (header.type == 'k') {
+        s->num_keys = header.len;
+        s->next_key = 0;
+        return 1;
+    }
+    if (header.type == 'r' && header.len == 2 * sizeof(int)) {
+        int size[2];
+        memcpy(size, s->keys, sizeof(size));
+        editor_server_resize(size[0], size[1]);
+        editor_refresh_screen();
+    }
+    return 0;
+}
+
+//the client only gets the screen lines that differ from the frame it already has (the status line, which
+//ends with the cursor, always goes). Every line starts from the colors a full redraw would have there
+void editor_server_send_frame(const char* frame, int len) {
+    struct Server* s = &e.server;
+    if (s->client == -1) return;
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    int is_frame = len >= (int) strlen(HIDE_CURSOR) && !memcmp(frame, HIDE_CURSOR, strlen(HIDE_CURSOR));
+    if (!is_frame) {
+        append_buffer_append(&ab, frame, len); //clearing the screen and such
+        s->frame_len = 0;
+    } else {
+        append_buffer_append(&ab, HIDE_CURSOR, strlen(HIDE_CURSOR));
+        const char* p = frame;
+        const char* end = frame + len;
+        const char* old = s->frame;
+        const char* old_end = s->frame + s->frame_len;
+        for (int y = 1; p < end; y++) {
+            const char* newline = memmem(p, end - p, "\r\n", 2);
+            const char* line_end = newline ? newline + 2 : end;
+            const char* old_newline = old < old_end ? memmem(old, old_end - old, "\r\n", 2) : NULL;
+            const char* old_line_end = old_newline ? old_newline + 2 : old_end;
+
+            if (newline == NULL || line_end - p != old_line_end - old || memcmp(p, old, line_end - p)) {
+                char position[32];
+                int position_len = snprintf(position, sizeof(position), "\x1b[%d;1H\x1b[m", y);
+                append_buffer_append(&ab, position, position_len);
+                append_buffer_append(&ab, COLOR_FOREGROUND, strlen(COLOR_FOREGROUND));
+                append_buffer_append(&ab, COLOR_BACKGROUND, strlen(COLOR_BACKGROUND));
+                append_buffer_append(&ab, p, line_end - p);
             }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buffer_len == buffer_size - 1) {
-                buffer_size *= 2;
-                buffer = realloc(buffer, buffer_size);
+            p = line_end;
+            old = old_line_end;
+        }
+
+        if (len > s->frame_len) s->frame = realloc(s->frame, len);
+        memcpy(s->frame, frame, len);
+        s->frame_len = len;
+    }
+
+    if (is_frame) e.perf.current_bytes += (int64_t) ab.len - len; //:perf counts what actually went out, not the whole frame
+    if (editor_message_send(s->client, 'f', ab.buffer, ab.len) == -1) {
+        close(s->client);
+        s->client = -1;
+    }
+    append_buffer_free(&ab);
+}
+
+volatile sig_atomic_t client_resized;
+
+void editor_client_winch(int sig) {
+    (void) sig;
+    client_resized = 1;
+}
+
+int editor_client_send_size(int fd, char type, const char* path) {
+    int size[2];
+    if (get_window_size(&size[0], &size[1]) == -1) die("get_window_size");
+    int path_len = path ? strlen(path) : 0;
+    char* payload = malloc(sizeof(size) + path_len);
+    memcpy(payload, size, sizeof(size));
+    if (path_len) memcpy(payload + sizeof(size), path, path_len);
+    int result = editor_message_send(fd, type, payload, sizeof(size) + path_len);
+    free(payload);
+    return result;
+}
+
+//acorn --client [file]: a terminal for the server - keys go there, and whatever it draws comes back
+void editor_client(char* filename) {
+    struct sockaddr_un addr;
+    int fd = editor_socket_address(&addr);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "acorn: no server on %s (start one with acorn --server)\n", addr.sun_path);
+        exit(1);
+    }
+
+    //the server has its own working directory, so it gets a full path
+    char* path = NULL;
+    if (filename) {
+        path = realpath(filename, NULL);
+        if (path == NULL) {
+            char cwd[PATH_MAX];
+            path = malloc(PATH_MAX * 2);
+            snprintf(path, PATH_MAX * 2, "%s/%s", getcwd(cwd, sizeof(cwd)) ? cwd : ".", filename);
+        }
+    }
+
+    enable_raw_mode();
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = { 0 };
+    sa.sa_handler = editor_client_winch;
+    sigaction(SIGWINCH, &sa, NULL);
+    if (editor_client_send_size(fd, 'h', path) == -1) die("send");
+    free(path);
+
+    char* data = NULL;
+    int capacity = 0;
+    while (1) {
+        if (client_resized) {
+            client_resized = 0;
+            editor_client_send_size(fd, 'r', NULL);
+        }
+        struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+
+        if (fds[0].revents) {
+            char keys[256];
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n > 0 && editor_message_send(fd, 'k', keys, n) == -1) break;
+        }
+        if (fds[1].revents) {
+            struct ServerMessage header;
+            if (editor_message_read(fd, &header, sizeof(header)) == -1 || header.len < 0) break;
+            if (header.len > capacity) {
+                capacity = header.len;
+                data = realloc(data, capacity);
+            }
+            if (editor_message_read(fd, data, header.len) == -1) break;
+            if (header.type == 'f') {
+                write(STDOUT_FILENO, data, header.len);
+            } else if (header.type == 'x') {
+                int status = 0;
+                if (header.len == sizeof(status)) memcpy(&status, data, sizeof(status));
+                exit(status);
             }
-            buffer[buffer_len++] = c;
-            buffer[buffer_len] = '\0';
         }
+    }
+    write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
+    fprintf(stderr, "acorn: lost the server\r\n");
+    exit(1);
+}
 
-        if (callback) callback(buffer, c);
+/*** shared editing ***/
+
+//:share and :join take a port on 127.0.0.1 or the path of a unix socket (by default $XDG_RUNTIME_DIR/acorn-share.sock)
+int editor_share_socket(char* address, int host) {
+    int on = 1;
+    int fd;
+    if (address && *address && strspn(address, "0123456789") == strlen(address)) {
+        struct sockaddr_in in;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(atoi(address));
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+        if (host) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (host ? bind(fd, (struct sockaddr*) &in, sizeof(in)) == -1 || listen(fd, 8) == -1 :
+                connect(fd, (struct sockaddr*) &in, sizeof(in)) == -1) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); //batches are small and shouldn't wait for each other
+        return fd;
+    }
+
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    if (address && *address) snprintf(un.sun_path, sizeof(un.sun_path), "%s", address);
+    else if (getenv("XDG_RUNTIME_DIR")) snprintf(un.sun_path, sizeof(un.sun_path), "%s/acorn-share.sock", getenv("XDG_RUNTIME_DIR"));
+    else snprintf(un.sun_path, sizeof(un.sun_path), "/tmp/acorn-share-%d.sock", (int) getuid());
+
+    if (host) {
+        //a socket nobody answers on is left over from a host that didn't stop cleanly
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int taken = probe != -1 && connect(probe, (struct sockaddr*) &un, sizeof(un)) == 0;
+        if (probe != -1) close(probe);
+        if (taken) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if (unlink_stale_socket(un.sun_path) == -1) return -1;
     }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    mode_t mask = umask(077); //only this user can join
+    int failed = host ? bind(fd, (struct sockaddr*) &un, sizeof(un)) == -1 || listen(fd, 8) == -1 :
+            connect(fd, (struct sockaddr*) &un, sizeof(un)) == -1;
+    int saved = errno;
+    umask(mask);
+    if (failed) {
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if (host) e.share.socket_path = strdup(un.sun_path);
+    return fd;
 }
 
-void editor_move_cursor(int key) {
-    struct EditorRow* row = (e.active_buffer->cursor_y >= e.active_buffer->num_rows) ? NULL : &e.active_buffer->row[e.active_buffer->cursor_y];
+struct ShareOp* editor_share_push(struct ShareBatch* batch) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 8;
+        batch->ops = realloc(batch->ops, sizeof(struct ShareOp) * batch->capacity);
+    }
+    return &batch->ops[batch->count++];
+}
 
-    switch(key) {
-        case ARROW_LEFT:
-            if (e.active_buffer->cursor_x != 0) {
-                e.active_buffer->cursor_x--;
-            } 
-            break;
-        case ARROW_DOWN:
-            if (e.active_buffer->cursor_y < e.active_buffer->num_rows - 1) e.active_buffer->cursor_y++;
-            break;
-        case ARROW_UP:
-            if (e.active_buffer->cursor_y != 0) e.active_buffer->cursor_y--;
-            break;
-        case ARROW_RIGHT:
-            if (row && e.active_buffer->cursor_x < row->size - 1) {
-                e.active_buffer->cursor_x++;
+void editor_share_insert_op(struct ShareBatch* batch, int row, int col, const char* text, int len) {
+    struct ShareOp* op = editor_share_push(batch);
+    *op = (struct ShareOp) { 'i', row, col, row, col + len, malloc(len), len };
+    memcpy(op->text, text, len);
+    for (int j = 0; j < len; j++) {
+        if (text[j] != '\n') continue;
+        op->end_row++;
+        op->end_col = len - j - 1;
+    }
+}
+
+void editor_share_delete_op(struct ShareBatch* batch, int row, int col, int end_row, int end_col) {
+    *editor_share_push(batch) = (struct ShareOp) { 'd', row, col, end_row, end_col, NULL, 0 };
+}
+
+void editor_share_free_batch(struct ShareBatch* batch) {
+    for (int j = 0; j < batch->count; j++) free(batch->ops[j].text);
+    free(batch->ops);
+    memset(batch, 0, sizeof(*batch));
+}
+
+int editor_share_compare(int row, int col, int other_row, int other_col) {
+    return row != other_row ? (row > other_row) - (row < other_row) : (col > other_col) - (col < other_col);
+}
+
+//moves a position in the text to where it is after 'op'. A position right where text is inserted stays in front of it if 'stay'
+void editor_share_move(int* row, int* col, struct ShareOp* op, int stay) {
+    if (op->kind == 'i') {
+        int order = editor_share_compare(*row, *col, op->row, op->col);
+        if (order < 0 || (order == 0 && stay)) return;
+        if (*row == op->row) *col = op->end_col + *col - op->col;
+        *row += op->end_row - op->row;
+    } else if (op->kind == 'd') {
+        if (editor_share_compare(*row, *col, op->row, op->col) <= 0) return;
+        if (editor_share_compare(*row, *col, op->end_row, op->end_col) < 0) {
+            *row = op->row;
+            *col = op->col;
+            return;
+        }
+        if (*row == op->end_row) *col = op->col + *col - op->end_col;
+        *row -= op->end_row - op->row;
+    }
+}
+
+void editor_share_move_insert(struct ShareOp* op, int row, int col) {
+    if (op->end_row == op->row) op->end_col += col - op->col;
+    op->end_row += row - op->row;
+    op->row = row;
+    op->col = col;
+}
+
+void editor_share_transform_insert(struct ShareOp* insert, struct ShareOp* del) {
+    struct ShareOp old_insert = *insert;
+    struct ShareOp old_del = *del;
+    //text inserted into a range someone else deleted goes with the range
+    if (editor_share_compare(del->row, del->col, insert->row, insert->col) < 0 &&
+            editor_share_compare(insert->row, insert->col, del->end_row, del->end_col) < 0) {
+        insert->kind = 0;
+        editor_share_move(&del->end_row, &del->end_col, &old_insert, 0);
+        return;
+    }
+    int row = insert->row, col = insert->col;
+    editor_share_move(&row, &col, &old_del, 0);
+    editor_share_move_insert(insert, row, col);
+    editor_share_move(&del->row, &del->col, &old_insert, 0);
+    editor_share_move(&del->end_row, &del->end_col, &old_insert, 1);
+}
+
+//'a' and 'b' were made on the same text: afterwards 'a' applies after 'b' and 'b' after 'a', and both orders give the
+//same text. Inserts at the same place go in with 'a' first if 'a_first'
+void editor_share_transform(struct ShareOp* a, struct ShareOp* b, int a_first) {
+    if (a->kind == 0 || b->kind == 0) return;
+    struct ShareOp old_a = *a;
+    struct ShareOp old_b = *b;
+    if (a->kind == 'i' && b->kind == 'i') {
+        int row = a->row, col = a->col;
+        editor_share_move(&row, &col, &old_b, a_first);
+        editor_share_move_insert(a, row, col);
+        row = b->row;
+        col = b->col;
+        editor_share_move(&row, &col, &old_a, !a_first);
+        editor_share_move_insert(b, row, col);
+    } else if (a->kind == 'i') {
+        editor_share_transform_insert(a, b);
+    } else if (b->kind == 'i') {
+        editor_share_transform_insert(b, a);
+    } else {
+        editor_share_move(&a->row, &a->col, &old_b, 0);
+        editor_share_move(&a->end_row, &a->end_col, &old_b, 0);
+        editor_share_move(&b->row, &b->col, &old_a, 0);
+        editor_share_move(&b->end_row, &b->end_col, &old_a, 0);
+        if (a->row == a->end_row && a->col == a->end_col) a->kind = 0;
+        if (b->row == b->end_row && b->col == b->end_col) b->kind = 0;
+    }
+}
+
+void editor_share_transform_batches(struct ShareBatch* a, struct ShareBatch* b, int a_first) {
+    for (int i = 0; i < b->count; i++)
+        for (int j = 0; j < a->count; j++) editor_share_transform(&a->ops[j], &b->ops[i], a_first);
+}
+
+void editor_share_encode(struct AppendBuffer* ab, struct ShareBatch* batch) {
+    for (int j = 0; j < batch->count; j++) {
+        struct ShareOp* op = &batch->ops[j];
+        if (op->kind == 0) continue;
+        int fields[4] = { op->row, op->col, op->end_row, op->end_col };
+        append_buffer_append(ab, &op->kind, 1);
+        append_buffer_append(ab, (char*) fields, sizeof(fields));
+        if (op->kind != 'i') continue;
+        append_buffer_append(ab, (char*) &op->len, sizeof(op->len));
+        append_buffer_append(ab, op->text, op->len);
+    }
+}
+
+int editor_share_decode(char* data, int len, struct ShareBatch* batch) {
+    int at = 0;
+    while (at < len) {
+        char kind = data[at++];
+        int fields[4];
+        if ((kind != 'i' && kind != 'd') || len - at < (int) sizeof(fields)) return -1;
+        memcpy(fields, &data[at], sizeof(fields));
+        at += sizeof(fields);
+        struct ShareOp* op = editor_share_push(batch);
+        *op = (struct ShareOp) { kind, fields[0], fields[1], fields[2], fields[3], NULL, 0 };
+        if (kind != 'i') continue;
+
+        int text_len;
+        if (len - at < (int) sizeof(text_len)) return -1;
+        memcpy(&text_len, &data[at], sizeof(text_len));
+        at += sizeof(text_len);
+        if (text_len < 0 || len - at < text_len) return -1;
+        op->text = malloc(text_len);
+        op->len = text_len;
+        memcpy(op->text, &data[at], text_len);
+        at += text_len;
+    }
+    return 0;
+}
+
+//writes as much of the queue as the socket takes - the rest goes when poll says it can
+void editor_share_write(struct ShareConnection* c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return; //EAGAIN, or an error that reading will notice too
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+}
+
+void editor_share_send(struct ShareConnection* c, char type, const char* data, int len) {
+    struct ServerMessage header = { type, len };
+    if (c->out_len + sizeof(header) + len > c->out_capacity) {
+        if (c->out_sent > 0) {
+            memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+            c->out_len -= c->out_sent;
+            c->out_sent = 0;
+        }
+        while (c->out_len + sizeof(header) + len > c->out_capacity) c->out_capacity = c->out_capacity ? c->out_capacity * 2 : 4096;
+        c->out = realloc(c->out, c->out_capacity);
+    }
+    memcpy(c->out + c->out_len, &header, sizeof(header));
+    memcpy(c->out + c->out_len + sizeof(header), data, len);
+    c->out_len += sizeof(header) + len;
+    editor_share_write(c);
+}
+
+void editor_share_send_batch(struct ShareConnection* c, int revision, struct ShareBatch* batch) {
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    append_buffer_append(&ab, (char*) &revision, sizeof(revision));
+    editor_share_encode(&ab, batch);
+    editor_share_send(c, 'o', ab.buffer, ab.len);
+    append_buffer_free(&ab);
+}
+
+void editor_share_release_shadow() {
+    struct Share* s = &e.share;
+    for (int j = 0; j < s->shadow_rows; j++) row_text_release(s->buffer->text_arena, s->shadow[j].text);
+    s->shadow_rows = 0;
+}
+
+void editor_share_reserve_shadow(int rows) {
+    struct Share* s = &e.share;
+    if (rows <= s->shadow_capacity) return;
+    while (s->shadow_capacity < rows) s->shadow_capacity = s->shadow_capacity ? s->shadow_capacity * 2 : 64;
+    s->shadow = realloc(s->shadow, sizeof(struct RegisterSlice) * s->shadow_capacity);
+}
+
+void editor_share_snapshot() {
+    struct Share* s = &e.share;
+    struct EditorBuffer* b = s->buffer;
+    editor_share_release_shadow();
+    editor_share_reserve_shadow(b->num_rows);
+    for (int j = 0; j < b->num_rows; j++) s->shadow[j] = (struct RegisterSlice) { row_text_retain(b->row[j].chars), 0, b->row[j].size };
+    s->shadow_rows = b->num_rows;
+    s->shadow_edits = b->edits;
+    s->last_batch = perf_now();
+}
+
+//rows whose text was written to since the shadow took it have been copied, so this is usually a pointer compare
+int editor_share_same(int at, struct EditorRow* row) {
+    struct RegisterSlice* line = &e.share.shadow[at];
+    if (line->text == row->chars) return 1;
+    if (line->len != row->size || memcmp(line->text, row->chars, row->size)) return 0;
+    //the same text in a new copy - the shadow moves to it, so next time it's a pointer compare again
+    row_text_release(e.share.buffer->text_arena, line->text);
+    line->text = row_text_retain(row->chars);
+    return 1;
+}
+
+//the edits that turn shadow rows [start, end) into 'rows' [0, count)
+void editor_share_hunk(struct ShareBatch* batch, int start, int end, struct EditorRow* rows, int count) {
+    struct RegisterSlice* shadow = e.share.shadow;
+    int n = e.share.shadow_rows;
+    if (end - start == 1 && count == 1) {
+        //one row changed (typing): just the characters between what's the same at both ends
+        char* old = shadow[start].text;
+        int old_len = shadow[start].len;
+        int prefix = 0;
+        while (prefix < old_len && prefix < rows->size && old[prefix] == rows->chars[prefix]) prefix++;
+        int suffix = 0;
+        while (suffix < old_len - prefix && suffix < rows->size - prefix &&
+                old[old_len - 1 - suffix] == rows->chars[rows->size - 1 - suffix]) suffix++;
+        if (old_len - prefix - suffix > 0) editor_share_delete_op(batch, start, prefix, start, old_len - suffix);
+        if (rows->size - prefix - suffix > 0) editor_share_insert_op(batch, start, prefix, &rows->chars[prefix], rows->size - prefix - suffix);
+        return;
+    }
+
+    //whole rows, with the newline after them - or before them at the end of the text, which has no newline
+    struct AppendBuffer text = APPEND_BUFFER_INIT;
+    int row = 0, col = 0;
+    if (end < n) {
+        if (end > start) editor_share_delete_op(batch, start, 0, end, 0);
+        for (int j = 0; j < count; j++) {
+            append_buffer_append(&text, rows[j].chars, rows[j].size);
+            append_buffer_append(&text, "\n", 1);
+        }
+        row = start;
+    } else if (start > 0) {
+        if (end > start) editor_share_delete_op(batch, start - 1, shadow[start - 1].len, n - 1, shadow[n - 1].len);
+        for (int j = 0; j < count; j++) {
+            append_buffer_append(&text, "\n", 1);
+            append_buffer_append(&text, rows[j].chars, rows[j].size);
+        }
+        row = start - 1;
+        col = shadow[start - 1].len;
+    } else {
+        if (n > 1 || shadow[0].len > 0) editor_share_delete_op(batch, 0, 0, n - 1, shadow[n - 1].len);
+        for (int j = 0; j < count; j++) {
+            if (j > 0) append_buffer_append(&text, "\n", 1);
+            append_buffer_append(&text, rows[j].chars, rows[j].size);
+        }
+    }
+    if (text.len > 0) editor_share_insert_op(batch, row, col, text.buffer, text.len);
+    append_buffer_free(&text);
+}
+
+//brings the shadow up to date with the shared buffer, adding the edits that takes to 'batch' (if not NULL)
+//everything outside the changed region in the middle is found with pointer compares, so this is cheap on any size of file
+void editor_share_capture(struct ShareBatch* batch) {
+    struct Share* s = &e.share;
+    struct EditorBuffer* b = s->buffer;
+    if (b == NULL || b->edits == s->shadow_edits) return;
+    uint64_t trace = trace_begin();
+    if (b->num_rows == 0) {
+        //the text is never less than one (empty) row
+        struct EditorBuffer* active = e.active_buffer;
+        e.active_buffer = b;
+        editor_insert_row(0, "", 0);
+        e.active_buffer = active;
+    }
+
+    int n = s->shadow_rows, m = b->num_rows;
+    int prefix = 0;
+    while (prefix < n && prefix < m && editor_share_same(prefix, &b->row[prefix])) prefix++;
+    int suffix = 0;
+    while (suffix < n - prefix && suffix < m - prefix && editor_share_same(n - 1 - suffix, &b->row[m - 1 - suffix])) suffix++;
+    int old_count = n - prefix - suffix;
+    int new_count = m - prefix - suffix;
+    struct EditorRow* rows = &b->row[prefix];
+
+    if (batch && (old_count > 1 || new_count > 1) && old_count > 0 && new_count > 0) {
+        //hunks go from the bottom up, so each one is at the same place in the text as in the shadow
+        int* match = malloc(sizeof(int) * new_count);
+        editor_diff_rows(rows, new_count, &s->shadow[prefix], old_count, match);
+        int i = new_count, j = old_count;
+        for (int x = new_count - 1; x >= -1; x--) {
+            if (x >= 0 && match[x] == -1) continue;
+            int y = x >= 0 ? match[x] : -1;
+            if (x + 1 < i || y + 1 < j) editor_share_hunk(batch, prefix + y + 1, prefix + j, &rows[x + 1], i - x - 1);
+            i = x;
+            j = y;
+        }
+        free(match);
+    } else if (batch && (old_count > 0 || new_count > 0)) {
+        editor_share_hunk(batch, prefix, prefix + old_count, rows, new_count);
+    }
+
+    for (int j = prefix; j < prefix + old_count; j++) row_text_release(b->text_arena, s->shadow[j].text);
+    editor_share_reserve_shadow(m);
+    memmove(&s->shadow[prefix + new_count], &s->shadow[prefix + old_count], sizeof(struct RegisterSlice) * suffix);
+    for (int j = 0; j < new_count; j++) s->shadow[prefix + j] = (struct RegisterSlice) { row_text_retain(rows[j].chars), 0, rows[j].size };
+    s->shadow_rows = m;
+    s->shadow_edits = b->edits;
+    trace_end("share_capture", trace);
+}
+
+void editor_share_del_rows(int at, int count) {
+    struct EditorBuffer* b = e.active_buffer;
+    for (int j = at; j < at + count; j++) editor_free_row(&b->row[j]);
+    memmove(&b->row[at], &b->row[at + count], sizeof(struct EditorRow) * (b->num_rows - at - count));
+    b->num_rows -= count;
+    editor_wrap_moved(b, at);
+    b->dirty++;
+    b->edits++;
+    if (at < b->num_rows) editor_update_syntax(b, &b->row[at], editor_prev_open_comment(b, &b->row[at]));
+}
+
+//applies someone else's edit to the active buffer through the usual row operations
+void editor_share_apply(struct ShareOp* op) {
+    struct EditorBuffer* b = e.active_buffer;
+    if (op->kind == 0) return;
+    //a bad edit mustn't take the editor down, so everything is clamped to the text
+    int row = op->row < 0 ? 0 : op->row >= b->num_rows ? b->num_rows - 1 : op->row;
+    int col = op->col < 0 ? 0 : op->col > b->row[row].size ? b->row[row].size : op->col;
+
+    if (op->kind == 'i') {
+        char* newline = memchr(op->text, '\n', op->len);
+        if (newline == NULL) {
+            editor_row_insert_string(&b->row[row], col, op->text, op->len);
+        } else {
+            //the row is split where the text goes in, and its end moves to the last inserted row
+            struct EditorRow* split = &b->row[row];
+            int first = newline - op->text;
+            int rest_len = op->len - first - 1;
+            int tail_len = split->size - col;
+            char* rest = malloc(rest_len + tail_len + 1);
+            memcpy(rest, newline + 1, rest_len);
+            memcpy(rest + rest_len, &split->chars[col], tail_len);
+            editor_row_truncate(split, col);
+            if (first > 0) editor_row_append_string(split, op->text, first);
+
+            int count = 1;
+            for (int j = 0; j < rest_len; j++) count += rest[j] == '\n';
+            struct RegisterSlice* slices = malloc(sizeof(struct RegisterSlice) * count);
+            int start = 0, k = 0;
+            for (int j = 0; j < rest_len; j++) {
+                if (rest[j] != '\n') continue;
+                slices[k++] = (struct RegisterSlice) { rest, start, j - start };
+                start = j + 1;
             }
-            break;
+            slices[k] = (struct RegisterSlice) { rest, start, rest_len + tail_len - start };
+            editor_insert_rows(row + 1, NULL, slices, count);
+            free(slices);
+            free(rest);
+        }
+    } else {
+        int end_row = op->end_row < row ? row : op->end_row >= b->num_rows ? b->num_rows - 1 : op->end_row;
+        int end_col = op->end_col < 0 ? 0 : op->end_col > b->row[end_row].size ? b->row[end_row].size : op->end_col;
+        if (end_row == row && end_col < col) end_col = col;
+        //what's left of the last row joins the first
+        int tail_len = b->row[end_row].size - end_col;
+        char* tail = malloc(tail_len + 1);
+        memcpy(tail, &b->row[end_row].chars[end_col], tail_len);
+        editor_row_truncate(&b->row[row], col);
+        if (end_row > row) editor_share_del_rows(row + 1, end_row - row);
+        if (tail_len > 0) editor_row_append_string(&b->row[row], tail, tail_len);
+        free(tail);
     }
 
-    //move cursor back if next line is shorter the the line we just came from
-    row = (e.active_buffer->cursor_y >= e.active_buffer->num_rows) ? NULL : &e.active_buffer->row[e.active_buffer->cursor_y];
-    int rowlen = row ? row->size : 0;
-    if (e.active_buffer->cursor_x >= rowlen) {
-        e.active_buffer->cursor_x = rowlen - 1 > 0 ? rowlen - 1 : 0;
+    editor_share_move(&b->cursor_y, &b->cursor_x, op, 1);
+    int offset_col = 0;
+    editor_share_move(&b->row_offset, &offset_col, op, 1);
+}
+
+//applies a batch from someone else to the shared buffer (active or not), with the cursor staying put in the text around it
+void editor_share_apply_batch(struct ShareBatch* batch) {
+    struct EditorBuffer* active = e.active_buffer;
+    struct EditorBuffer* b = e.share.buffer;
+    uint64_t trace = trace_begin();
+    e.active_buffer = b;
+    for (int j = 0; j < batch->count; j++) editor_share_apply(&batch->ops[j]);
+    if (b->cursor_y >= b->num_rows) b->cursor_y = b->num_rows - 1;
+    if (b->cursor_y < 0) b->cursor_y = 0;
+    struct EditorRow* row = &b->row[b->cursor_y];
+    if (b->cursor_x > row->size) b->cursor_x = row->size;
+    b->cursor_x = utf8_char_start(row->chars, b->cursor_x);
+    e.active_buffer = active;
+
+    editor_share_capture(NULL); //the shadow already knows about these
+    trace_end("share_apply", trace);
+}
+
+//host: the oldest revision any guest may still build on - the history before it can go
+void editor_share_trim_history() {
+    struct Share* s = &e.share;
+    int oldest = s->revision;
+    for (int i = 0; i < s->num_connections; i++)
+        if (s->connections[i].revision < oldest) oldest = s->connections[i].revision;
+    int drop = oldest - s->history_start;
+    if (drop <= 0) return;
+    for (int j = 0; j < drop; j++) editor_share_free_batch(&s->history[j]);
+    memmove(s->history, s->history + drop, sizeof(struct ShareBatch) * (s->history_count - drop));
+    s->history_count -= drop;
+    s->history_start = oldest;
+}
+
+//host: 'batch' (already in the buffer) becomes the next revision. Its guest ('from', or -1 for the host's own edits)
+//gets an acknowledgement and everyone else the batch
+void editor_share_record(struct ShareBatch* batch, int from) {
+    struct Share* s = &e.share;
+    s->history = realloc(s->history, sizeof(struct ShareBatch) * (s->history_count + 1));
+    s->history[s->history_count++] = *batch;
+    s->revision++;
+
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    append_buffer_append(&ab, (char*) &s->revision, sizeof(s->revision));
+    editor_share_encode(&ab, batch);
+    for (int i = 0; i < s->num_connections; i++) {
+        if (i == from) editor_share_send(&s->connections[i], 'a', NULL, 0);
+        else editor_share_send(&s->connections[i], 'o', ab.buffer, ab.len);
+    }
+    append_buffer_free(&ab);
+    editor_share_trim_history();
+}
+
+//host: whatever was typed since the last batch becomes a revision of its own
+void editor_share_host_batch() {
+    struct ShareBatch batch = { 0 };
+    editor_share_capture(&batch);
+    e.share.last_batch = perf_now();
+    if (batch.count > 0) editor_share_record(&batch, -1);
+    else editor_share_free_batch(&batch);
+}
+
+//guest: only one batch is out at a time - what's typed meanwhile waits (and grows) until the host acknowledges it
+void editor_share_guest_batch() {
+    struct Share* s = &e.share;
+    if (s->sent.count > 0) return;
+    editor_share_capture(&s->waiting);
+    s->last_batch = perf_now();
+    if (s->waiting.count == 0) return;
+    editor_share_send_batch(&s->connections[0], s->revision, &s->waiting);
+    s->sent = s->waiting;
+    memset(&s->waiting, 0, sizeof(s->waiting));
+    s->reported = s->revision;
+}
+
+//:share hosts the active buffer
+void editor_share(char* address) {
+    struct Share* s = &e.share;
+    if (s->role) {
+        editor_set_status_message("Already in a shared session (:unshare leaves it)");
+        return;
+    }
+    if (editor_read_only()) return;
+    int fd = editor_share_socket(address, 1);
+    if (fd == -1) {
+        editor_set_status_message("Can't share: %s", strerror(errno));
+        return;
+    }
+    s->role = 'h';
+    s->listen_fd = fd;
+    s->buffer = e.active_buffer;
+    s->revision = s->history_start = 0;
+    editor_share_snapshot();
+    editor_set_status_message("Sharing on %s (:join %s edits it from another acorn)",
+            s->socket_path ? s->socket_path : address, s->socket_path ? s->socket_path : address);
+}
+
+//:join edits a buffer someone is sharing - it shows up as a new buffer once the host has sent it
+void editor_join(char* address) {
+    struct Share* s = &e.share;
+    if (s->role) {
+        editor_set_status_message("Already in a shared session (:unshare leaves it)");
+        return;
+    }
+    int fd = editor_share_socket(address, 0);
+    if (fd == -1) {
+        editor_set_status_message("Can't join: %s", strerror(errno));
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    s->role = 'g';
+    s->buffer = NULL;
+    s->connections = calloc(1, sizeof(struct ShareConnection));
+    s->connections[0].fd = fd;
+    s->num_connections = 1;
+    editor_set_status_message("Joining...");
+}
+
+void editor_share_close(struct ShareConnection* c) {
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+}
+
+//:unshare, or the host went away, or the shared buffer was closed. The buffer stays as it is
+void editor_share_stop() {
+    struct Share* s = &e.share;
+    if (!s->role) return;
+    for (int i = 0; i < s->num_connections; i++) editor_share_close(&s->connections[i]);
+    free(s->connections);
+    if (s->role == 'h') close(s->listen_fd);
+    if (s->socket_path) unlink(s->socket_path);
+    free(s->socket_path);
+    if (s->buffer) editor_share_release_shadow();
+    free(s->shadow);
+    for (int j = 0; j < s->history_count; j++) editor_share_free_batch(&s->history[j]);
+    free(s->history);
+    editor_share_free_batch(&s->sent);
+    editor_share_free_batch(&s->waiting);
+    memset(s, 0, sizeof(*s));
+    editor_set_status_message("Left the shared session");
+}
+
+void editor_share_accept() {
+    struct Share* s = &e.share;
+    int fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd == -1) return;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); //fails harmlessly on unix sockets
+
+    //the guest starts from a revision with everything typed so far in it, so the shadow is the text it gets
+    editor_share_host_batch();
+    s->connections = realloc(s->connections, sizeof(struct ShareConnection) * (s->num_connections + 1));
+    struct ShareConnection* c = &s->connections[s->num_connections++];
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->revision = s->revision;
+
+    char* name = s->buffer->filename ? s->buffer->filename : "";
+    int name_len = strlen(name);
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    append_buffer_append(&ab, (char*) &s->revision, sizeof(s->revision));
+    append_buffer_append(&ab, (char*) &name_len, sizeof(name_len));
+    append_buffer_append(&ab, name, name_len);
+    for (int j = 0; j < s->shadow_rows; j++) {
+        if (j > 0) append_buffer_append(&ab, "\n", 1);
+        append_buffer_append(&ab, s->shadow[j].text, s->shadow[j].len);
+    }
+    editor_share_send(c, 'w', ab.buffer, ab.len);
+    append_buffer_free(&ab);
+    editor_set_status_message("Someone joined (%d editing)", s->num_connections + 1);
+}
+
+//guest: the host's welcome is the text as of a revision, and the name of its file (for highlighting)
+int editor_share_welcome(char* data, int len) {
+    struct Share* s = &e.share;
+    int revision, name_len;
+    if (s->buffer || len < (int) (2 * sizeof(int))) return -1;
+    memcpy(&revision, data, sizeof(int));
+    memcpy(&name_len, data + sizeof(int), sizeof(int));
+    if (name_len < 0 || name_len > len - (int) (2 * sizeof(int))) return -1;
+    char* name = strndup(data + 2 * sizeof(int), name_len);
+    char* text = data + 2 * sizeof(int) + name_len;
+    int text_len = len - 2 * sizeof(int) - name_len;
+
+    editor_open_buffer(NULL);
+    struct EditorBuffer* b = e.active_buffer;
+    b->filename = name_len ? name : NULL;
+    editor_select_syntax_highlight();
+    b->filename = NULL; //saving it is up to the host
+    free(name);
+
+    int count = 1;
+    for (int j = 0; j < text_len; j++) count += text[j] == '\n';
+    struct RegisterSlice* slices = malloc(sizeof(struct RegisterSlice) * count);
+    int start = 0, k = 0;
+    for (int j = 0; j < text_len; j++) {
+        if (text[j] != '\n') continue;
+        slices[k++] = (struct RegisterSlice) { text, start, j - start };
+        start = j + 1;
+    }
+    slices[k] = (struct RegisterSlice) { text, start, text_len - start };
+    editor_insert_rows(0, NULL, slices, count);
+    editor_del_row(count); //the empty row a new buffer starts with
+    free(slices);
+    b->dirty = 0;
+
+    s->buffer = b;
+    s->revision = s->reported = revision;
+    editor_share_snapshot();
+    editor_set_status_message("Joined");
+    return 0;
+}
+
+//handles a complete message from connection 'index', returns -1 if it doesn't make sense
+int editor_share_message(int index, char type, char* data, int len) {
+    struct Share* s = &e.share;
+    struct ShareBatch batch = { 0 };
+    int revision = 0;
+    if (type == 'o' || type == 'v') {
+        if (len < (int) sizeof(revision)) return -1;
+        memcpy(&revision, data, sizeof(revision));
+    }
+
+    if (s->role == 'h' && type == 'o') {
+        //a guest's batch was made on 'revision' - it goes over everything that got in since
+        if (revision < s->history_start || revision > s->revision ||
+                editor_share_decode(data + sizeof(revision), len - sizeof(revision), &batch) == -1) {
+            editor_share_free_batch(&batch);
+            return -1;
+        }
+        editor_share_host_batch();
+        for (int r = revision; r < s->revision; r++) {
+            struct ShareBatch* h = &s->history[r - s->history_start];
+            struct ShareBatch before = { malloc(sizeof(struct ShareOp) * (h->count ? h->count : 1)), h->count, h->count };
+            memcpy(before.ops, h->ops, sizeof(struct ShareOp) * h->count);
+            editor_share_transform_batches(&batch, &before, 0);
+            free(before.ops); //the texts are still the history's
+        }
+        editor_share_apply_batch(&batch);
+        s->connections[index].revision = revision;
+        editor_share_record(&batch, index);
+        return 1;
+    }
+    if (s->role == 'h' && type == 'v') {
+        if (revision < s->connections[index].revision || revision > s->revision) return -1;
+        s->connections[index].revision = revision;
+        editor_share_trim_history();
+        return 0;
+    }
+
+    if (s->role == 'g' && type == 'w') return editor_share_welcome(data, len) == -1 ? -1 : 1;
+    if (s->role == 'g' && s->buffer && type == 'o') {
+        //someone else's batch came first: it goes over what's ours and not acknowledged yet, and ours over it
+        if (editor_share_decode(data + sizeof(revision), len - sizeof(revision), &batch) == -1) {
+            editor_share_free_batch(&batch);
+            return -1;
+        }
+        editor_share_capture(&s->waiting);
+        editor_share_transform_batches(&batch, &s->sent, 1);
+        editor_share_transform_batches(&batch, &s->waiting, 1);
+        editor_share_apply_batch(&batch);
+        editor_share_free_batch(&batch);
+        s->revision = revision;
+        if (s->revision - s->reported >= 256) {
+            //so the host can forget history this guest won't build on
+            editor_share_send(&s->connections[0], 'v', (char*) &s->revision, sizeof(s->revision));
+            s->reported = s->revision;
+        }
+        return 1;
+    }
+    if (s->role == 'g' && s->buffer && type == 'a') {
+        s->revision++;
+        editor_share_free_batch(&s->sent);
+        editor_share_guest_batch();
+        return 0;
+    }
+    return -1;
+}
+
+//reads what's arrived on connection 'index' and handles every complete message
+//returns -1 if the other side went away, otherwise whether the buffer changed
+int editor_share_read(int index) {
+    struct ShareConnection* c = &e.share.connections[index];
+    while (1) {
+        if (c->in_capacity - c->in_len < 65536) {
+            c->in_capacity = c->in_capacity ? c->in_capacity * 2 : 65536 * 2;
+            c->in = realloc(c->in, c->in_capacity);
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_capacity - c->in_len);
+        if (n == 0) return -1;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        if (n == -1) return -1;
+        c->in_len += n;
+    }
+
+    int changed = 0;
+    size_t used = 0;
+    struct ServerMessage header;
+    while (c->in_len - used >= sizeof(header)) {
+        memcpy(&header, c->in + used, sizeof(header));
+        if (header.len < 0) return -1;
+        if (c->in_len - used - sizeof(header) < (size_t) header.len) break;
+        int result = editor_share_message(index, header.type, c->in + used + sizeof(header), header.len);
+        if (result == -1) return -1;
+        changed |= result;
+        used += sizeof(header) + header.len;
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    return changed;
+}
+
+//sends the next batch if it's due, or returns how long editor_poll can wait until it is
+//edits go out a frame's worth of time apart, so a burst of typing or a paste is a few batches instead of one per key
+int editor_share_timeout() {
+    struct Share* s = &e.share;
+    int timeout = 100;
+    if (s->buffer && (s->buffer->edits != s->shadow_edits || s->waiting.count > 0) && s->sent.count == 0) {
+        uint64_t due = s->last_batch + ACORN_SHARE_INTERVAL * 1000000ULL;
+        uint64_t now = perf_now();
+        if (now < due) {
+            timeout = (due - now) / 1000000 + 1;
+        } else if (s->role == 'h') {
+            editor_share_host_batch();
+        } else {
+            editor_share_guest_batch();
+        }
     }
+    return timeout;
 }
 
-void editor_switch_mode(int mode) {
-    switch (mode) {
-        case MODE_COMMAND:
-            e.mode = MODE_COMMAND;
-            //check if cursor_x is on at end of row (possible in insert mode), and if so move back one space
-            if (e.active_buffer->cursor_x >= e.active_buffer->row[e.active_buffer->cursor_y].size)
-                e.active_buffer->cursor_x = e.active_buffer->row[e.active_buffer->cursor_y].size - 1;
-            break;
-        case MODE_INSERT:
-            e.mode = MODE_INSERT;
-            break;
-        case MODE_VISUAL:
-            e.mode = MODE_VISUAL;
-            e.active_buffer->anchor_x = e.active_buffer->cursor_x;
-            e.active_buffer->anchor_y = e.active_buffer->cursor_y;
-            break;
-        case MODE_VISUAL_LINE:
-            e.mode = MODE_VISUAL_LINE;
-            e.active_buffer->anchor_x = e.active_buffer->cursor_x;
-            e.active_buffer->anchor_y = e.active_buffer->cursor_y;
-            break;
-        case MODE_VISUAL_BLOCK:
-            e.mode = MODE_VISUAL_BLOCK;
-            e.active_buffer->anchor_x = e.active_buffer->cursor_x;
-            e.active_buffer->anchor_y = e.active_buffer->cursor_y;
-            break;
-        default:
-            break;
+//the session's sockets for editor_poll (1 + num_connections of them)
+void editor_share_fds(struct pollfd* fds) {
+    struct Share* s = &e.share;
+    fds[0] = (struct pollfd) { s->role == 'h' ? s->listen_fd : -1, POLLIN, 0 };
+    for (int i = 0; i < s->num_connections; i++) {
+        struct ShareConnection* c = &s->connections[i];
+        fds[1 + i] = (struct pollfd) { c->fd, POLLIN | (c->out_len > c->out_sent ? POLLOUT : 0), 0 };
     }
 }
 
-int editor_process_command_key(int c, int* key_history, int history_ptr) {
-    int clear_flag = 0;
+//reads and writes the sockets that editor_poll found ready ('count' of them were handed out by editor_share_fds)
+void editor_share_pump(struct pollfd* fds, int count) {
+    struct Share* s = &e.share;
+    int changed = 0;
+    //backwards, so a guest that leaves doesn't move the ones still to be looked at
+    for (int i = count - 2; i >= 0 && e.share.role; i--) {
+        if (fds[1 + i].revents & POLLOUT) editor_share_write(&s->connections[i]);
+        if (!(fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        int result = editor_share_read(i);
+        if (result != -1) {
+            changed |= result;
+        } else if (s->role == 'g') {
+            editor_share_stop();
+            editor_set_status_message("The shared session ended");
+            changed = 1;
+        } else {
+            editor_share_close(&s->connections[i]);
+            memmove(&s->connections[i], &s->connections[i + 1], sizeof(struct ShareConnection) * (s->num_connections - i - 1));
+            s->num_connections--;
+            editor_share_trim_history();
+            editor_set_status_message("Someone left (%d editing)", s->num_connections + 1);
+            changed = 1;
+        }
+    }
+    if (e.share.role == 'h' && fds[0].revents) {
+        editor_share_accept();
+        changed = 1;
+    }
 
-    //if last char was 'r', then replace character with pressed key and set clear_flag
-    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
-    if (last_char == 'r') {
-        editor_row_replace_char(&e.active_buffer->row[e.active_buffer->cursor_y], e.active_buffer->cursor_x, c);
-        clear_flag = 1;
-    } else {
-        switch (c) {
-            case 'A':
-                editor_switch_mode(MODE_INSERT);
-                e.active_buffer->cursor_x = e.active_buffer->row[e.active_buffer->cursor_y].size;
-                break;
-            case 'G':
-                {
-                    int times = e.active_buffer->num_rows;
-                    while (times--)
-                        editor_move_cursor(ARROW_DOWN);
-                }
-                break;
-            case 'V':
-                editor_switch_mode(MODE_VISUAL_LINE);
-                break;
-            case 'H':
-                if (e.active_buffer - e.buffers > 0) e.active_buffer--;
-                break;
-            case 'L':
-                if (e.active_buffer - e.buffers < e.buffer_count - 1) e.active_buffer++;
-                break;
-            case 'a':
-                editor_switch_mode(MODE_INSERT);
-                int empty_line = e.active_buffer->row[e.active_buffer->cursor_y].size == 0 ? 1 : 0;
-                e.active_buffer->cursor_x = empty_line ? 0 : e.active_buffer->cursor_x + 1;
-                break;
-            case 'd':
-                {
-                    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
-                    if (last_char == 'd') {
-                        editor_del_row(e.active_buffer->cursor_y);
-                        if (e.active_buffer->cursor_y >= e.active_buffer->num_rows)
-                            editor_move_cursor(ARROW_UP);
-                        clear_flag = 1;
-                    }
-                }
-                break;
-            case 'g':
-                {
-                    int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
-                    if (last_char == 'g') {
-                        e.active_buffer->cursor_x = 0;
-                        e.active_buffer->cursor_y = 0;
-                    }
-                }
-                break;
-            case 'i':
-                editor_switch_mode(MODE_INSERT);
-                break;
-            case 'h':
-                editor_move_cursor(ARROW_LEFT);
-                break;
-            case 'j':
-                editor_move_cursor(ARROW_DOWN);
-                break;
-            case 'k':
-                editor_move_cursor(ARROW_UP);
-                break;
-            case 'l':
-                editor_move_cursor(ARROW_RIGHT);
-                break;
-            case 'v':
-                editor_switch_mode(MODE_VISUAL);
-                break;
-            case CTRL_KEY('v'):
-                editor_switch_mode(MODE_VISUAL_BLOCK);
-                break;
+    if (changed) editor_refresh_screen();
+}
+
+//waits (up to 100ms, or until the next shared batch is due) for the terminal, a running filter's pipes and the
+//shared session's sockets all at once, so neither holds the other up
+//returns 1 when a key is waiting to be read
+int editor_poll() {
+    int timeout = e.share.role ? editor_share_timeout() : 100;
+    int num_shared = e.share.role ? 1 + e.share.num_connections : 0;
+    struct pollfd* fds = malloc(sizeof(struct pollfd) * (3 + num_shared));
+    fds[0] = (struct pollfd) { editor_input_fd(), POLLIN, 0 };
+    editor_filter_fds(&fds[1]);
+    if (num_shared) editor_share_fds(&fds[3]);
+    if (poll(fds, 3 + num_shared, timeout) == -1 && errno != EINTR) die("poll");
+
+    if (e.filter.pid) editor_filter_pump(&fds[1]);
+    if (num_shared) editor_share_pump(&fds[3], num_shared);
+    int key = fds[0].revents != 0;
+    free(fds);
+    return key;
+}
+
+/*** replay ***/
+double editor_elapsed_ms(struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+//unescapes 'text' onto the end of the key list - \e, \r, \n, \t, \\ and \xNN are understood
+void editor_replay_add_keys(char* text, int times) {
+    struct Replay* r = &e.replay;
+    char* keys = malloc(strlen(text) + 1);
+    int len = 0;
+    for (char* p = text; *p; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            keys[len++] = *p;
+            continue;
+        }
+        switch (*++p) {
+            case 'e': keys[len++] = '\x1b'; break;
+            case 'r': keys[len++] = '\r'; break;
+            case 'n': keys[len++] = '\n'; break;
+            case 't': keys[len++] = '\t'; break;
             case 'x':
-                e.active_buffer->cursor_x++;
-                editor_del_char();
-                if (e.active_buffer->cursor_x >= e.active_buffer->row[e.active_buffer->cursor_y].size)
-                    editor_move_cursor(ARROW_LEFT);
-                break;
-            case '0':
-                e.active_buffer->cursor_x = 0;
-                break;
-            case '$':
-                e.active_buffer->cursor_x = e.active_buffer->row[e.active_buffer->cursor_y].size - 1;
-                break;
-            case ':': { //TODO: should really move all ':' commands to own function
-                char* command = editor_prompt(":%s", NULL);
-                if (command == NULL) break;
-                int clen = strlen(command);
-                if (clen == 1) {
-                    switch (command[0]) {
-                        case 'w':
-                            editor_save();
-                            break;
-                        case 'q':
-                            if (e.active_buffer->dirty) {
-                                editor_set_status_message("No write since last change. (Add ! to override).");
-                                break;
-                            }
-                            write(STDOUT_FILENO, "\x1b[2J", 4);
-                            write(STDOUT_FILENO, "\x1b[H", 3);
-                            exit(0);
-                            break;
-                        default:
-                            break;
-                    }
-                } else if (clen == 2) {
-                    if (command[0] == 'q' && command[1] == '!') {
-                        write(STDOUT_FILENO, "\x1b[2J", 4);
-                        write(STDOUT_FILENO, "\x1b[H", 3);
-                        exit(0);
-                        break;
-                    }
-                } else if (clen >= 3) {
-                    switch (command[0]) {
-                        case 'e':
-                            {
-                                char filename[128];
-                                int str_len = clen - 2 < 128 ? clen - 2 : 127;
-                                memcpy(&filename[0], &command[2], str_len);
-                                filename[str_len] = '\0';
-                                editor_open_buffer(filename);
-                            }
-                            break;
-                        case 'w':
-                            {
-                                int str_len = clen - 2 < 128 ? clen - 2 : 127;
-                                e.active_buffer->filename = malloc(str_len + 1);
-                                memcpy(&e.active_buffer->filename[0], &command[2], str_len);
-                                e.active_buffer->filename[str_len] = '\0';
-                                editor_save();
-                            }
-                            break;
-                        default:
-                            break;
-                    }
+                if (isxdigit(p[1]) && isxdigit(p[2])) {
+                    char hex[3] = { p[1], p[2], '\0' };
+                    keys[len++] = (char) strtol(hex, NULL, 16);
+                    p += 2;
                 }
-                //TODO: quit, save, open buffer, swap buffer
-                break;
-            }
-            case '/': {
-                char* prompt = editor_prompt("/%s", NULL);
-                //TODO: incremental search with 'n' and 'N' to go forward/backward
-                break;
-            }
-            default:
                 break;
+            default: keys[len++] = *p; break;
         }
     }
 
-    return clear_flag;
+    r->keys = realloc(r->keys, r->num_keys + (size_t) len * times);
+    for (int i = 0; i < times; i++) {
+        memcpy(&r->keys[r->num_keys], keys, len);
+        r->num_keys += len;
+    }
+    free(keys);
 }
 
-int editor_process_insert_key(int c, int* key_history, int history_ptr) {
-    int clear_flag = 0;
-    switch(c) {
-        case '\r':
-            editor_insert_new_line();
-            break;
-        case HOME_KEY:
-            e.active_buffer->cursor_x = 0;
-            break;
-        case END_KEY:
-            if (e.active_buffer->cursor_y < e.active_buffer->num_rows)
-                e.active_buffer->cursor_x = e.active_buffer->row[e.active_buffer->cursor_y].size;
-            break;
-        case CTRL_KEY('f'):
-            editor_find();
-            break;
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DEL_KEY:
-            if (c == DEL_KEY) editor_move_cursor(ARROW_RIGHT);
-            editor_del_char();
-            break;
-        case PAGE_UP:
-        case PAGE_DOWN: 
-            {
-                if (c == PAGE_UP) {
-                    e.active_buffer->cursor_y = e.active_buffer->row_offset;
-                } else if (c == PAGE_DOWN) {
-                    e.active_buffer->cursor_y = e.active_buffer->row_offset + e.screenrows - 1;
-                    if (e.active_buffer->cursor_y > e.active_buffer->num_rows) e.active_buffer->cursor_y = e.active_buffer->num_rows;
-                }
+//writes 'lines' lines of C (functions with comments, tabs, strings and numbers) to the script's name with .c added,
+//next to the script - so the name in the status bar (and the frame hash) is the same every run
+void editor_replay_generate_c(int lines) {
+    char* path = malloc(strlen(e.replay.script) + 3);
+    sprintf(path, "%s.c", e.replay.script);
+    FILE* fp = fopen(path, "w");
+    if (!fp) die(path);
+    static const char* body[] = {
+        "/* function %d: adds a and b */\n",
+        "static int func_%d(int a, int b) {\n",
+        "\tint total = a + b; // running sum\n",
+        "\tif (total > %d) return total * 2;\n",
+        "\tprintf(\"value %%d\\n\", total);\n",
+        "\treturn 0;\n",
+        "}\n",
+        "\n",
+    };
+    for (int i = 0; i < lines; i++) fprintf(fp, body[i % 8], i / 8);
+    fclose(fp);
+    e.replay.temp_file = path;
+}
 
-                int times = e.screenrows;
-                while (times--)
-                    editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-            }
-            break;
-        case ARROW_LEFT:
-        case ARROW_DOWN:
-        case ARROW_UP:
-        case ARROW_RIGHT:
-            editor_move_cursor(c);
-            break;
-        case CTRL_KEY('l'):
-        case '\x1b':
-            editor_switch_mode(MODE_COMMAND);
-            break;
-        default:
-            editor_insert_char(c);
-            break;
-    }
-    return clear_flag;
+void editor_replay_remove_temp_file() {
+    unlink(e.replay.temp_file);
 }
 
-int editor_process_visual_key(int c, int* key_history, int history_ptr) {
-    int clear_flag = 0;
-    switch(c) {
-        case 'G':
-            {
-                int times = e.active_buffer->num_rows;
-                while (times--)
-                    editor_move_cursor(ARROW_DOWN);
-            }
-            break;
-        case 'g':
-            {
-                int last_char = key_history[(history_ptr - 1 + MAX_KEY_HISTORY) % MAX_KEY_HISTORY];
-                if (last_char == 'g') {
-                    e.active_buffer->cursor_x = 0;
-                    e.active_buffer->cursor_y = 0;
-                }
-            }
-            break;
-        case 'h':
-            editor_move_cursor(ARROW_LEFT);
-            break;
-        case 'j':
-            editor_move_cursor(ARROW_DOWN);
-            break;
-        case 'k':
-            editor_move_cursor(ARROW_UP);
-            break;
-        case 'l':
-            editor_move_cursor(ARROW_RIGHT);
-            break;
-        case 'v':
-            editor_switch_mode(MODE_COMMAND);
-            break;
-        case 'd':
-        case 'x':
-            //TOOD: delete ALL highlighted characters (depending on single, line or block)
-            break;
-        case '\x1b':
-            editor_switch_mode(MODE_COMMAND);
-            break;
-        default:
-            break;
+//a script is a list of lines:
+//  # comment
+//  size ROWS COLS      terminal size (24x80 by default)
+//  file c LINES        edit a generated C file instead of the one on the command line
+//  keys TEXT           keystrokes, one per byte (see editor_replay_add_keys for escapes)
+//  repeat N TEXT       the same keystrokes N times
+void editor_replay_load(const char* script) {
+    struct Replay* r = &e.replay;
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    r->script = script;
+    r->rows = ACORN_REPLAY_ROWS;
+    r->cols = ACORN_REPLAY_COLS;
+
+    FILE* fp = fopen(script, "r");
+    if (!fp) die("fopen");
+
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_len;
+    int line_number = 0;
+    while ((line_len = getline(&line, &line_capacity, fp)) != -1) {
+        line_number++;
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) line[--line_len] = '\0';
+
+        int times, lines, consumed = 0;
+        if (line_len == 0 || line[0] == '#') {
+            continue;
+        } else if (sscanf(line, "size %d %d", &r->rows, &r->cols) == 2) {
+            continue;
+        } else if (sscanf(line, "file c %d", &lines) == 1 && !r->temp_file) {
+            editor_replay_generate_c(lines);
+            atexit(editor_replay_remove_temp_file);
+        } else if (!strncmp(line, "keys ", 5)) {
+            editor_replay_add_keys(&line[5], 1);
+        } else if (sscanf(line, "repeat %d %n", &times, &consumed) == 1 && consumed > 0) {
+            editor_replay_add_keys(&line[consumed], times);
+        } else {
+            fprintf(stderr, "%s:%d: unknown replay command: %s\n", script, line_number, line);
+            exit(1);
+        }
     }
-    return clear_flag;
+    free(line);
+    fclose(fp);
+
+    r->latency = malloc(sizeof(double) * (r->num_keys + 1));
+    r->allocs = malloc(sizeof(unsigned long) * (r->num_keys + 1));
+    r->output = malloc(sizeof(size_t) * (r->num_keys + 1));
 }
 
-void editor_process_keypress() {
-    static int key_history[MAX_KEY_HISTORY] = {'&'}; //'&' is unused in command mode
-    static int history_ptr = 0;
-    int clear_flag = 0;
+//closes the measurement of the previous key (everything since it was handed out, redraw included)
+void editor_replay_end_key() {
+    struct Replay* r = &e.replay;
+    if (r->key_open) {
+        r->latency[r->next_key - 1] = editor_elapsed_ms(&r->key_time);
+        r->allocs[r->next_key - 1] = editor_alloc_count() - r->key_allocs;
+        r->output[r->next_key - 1] = r->output_bytes;
+        r->key_open = 0;
+    } else if (r->next_key == 0) {
+        r->load_ms = editor_elapsed_ms(&r->start);
+    }
+    r->output_bytes = 0;
+}
 
-    int c = editor_read_key();
+int editor_replay_next_key() {
+    struct Replay* r = &e.replay;
+    while (e.filter.pid) editor_poll(); //scripts see filters finish before their next key
+    editor_replay_end_key();
+    if (r->next_key == r->num_keys) editor_replay_finish();
 
-    switch (e.mode) {
-        case MODE_COMMAND:
-            clear_flag = editor_process_command_key(c, key_history, history_ptr);
-            break;
-        case MODE_INSERT:
-            clear_flag = editor_process_insert_key(c, key_history, history_ptr);
-            break;
-        case MODE_VISUAL:
-        case MODE_VISUAL_LINE:
-        case MODE_VISUAL_BLOCK:
-            clear_flag = editor_process_visual_key(c, key_history, history_ptr);
-        default:
-            break;
-    }
+    r->key_open = 1;
+    r->key_allocs = editor_alloc_count();
+    clock_gettime(CLOCK_MONOTONIC, &r->key_time);
+    return (unsigned char) r->keys[r->next_key++];
+}
 
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
 
-    if (clear_flag) {
-        key_history[history_ptr] = '&';
-    } else {
-        key_history[history_ptr] = c;
+//prints the report for the keys replayed so far and exits
+void editor_replay_finish() {
+    struct Replay* r = &e.replay;
+    editor_replay_end_key(); //in case acorn quit in the middle of a key
+    int n = r->next_key;
+
+    double total_ms = 0;
+    unsigned long total_allocs = 0;
+    size_t total_output = 0;
+    for (int i = 0; i < n; i++) {
+        total_ms += r->latency[i];
+        total_allocs += r->allocs[i];
+        total_output += r->output[i];
     }
-    history_ptr++;
-    history_ptr %= MAX_KEY_HISTORY;
+    qsort(r->latency, n, sizeof(double), compare_doubles);
+
+    //hash of the final frame, so two versions can be checked for drawing the same thing
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < r->frame_len; i++) hash = (hash ^ (unsigned char) r->frame[i]) * 16777619u;
+
+    int divisor = n > 0 ? n : 1;
+    printf("script        %s\n", r->script);
+    printf("keys          %d\n", n);
+    printf("load_ms       %.3f\n", r->load_ms);
+    printf("total_ms      %.3f\n", total_ms);
+    printf("latency_ms    p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+            n ? r->latency[n / 2] : 0.0, n ? r->latency[n * 90 / 100] : 0.0, n ? r->latency[n * 99 / 100] : 0.0,
+            n ? r->latency[n * 999 / 1000] : 0.0, n ? r->latency[n - 1] : 0.0);
+    if (ACORN_COUNTS_ALLOCS) printf("allocs        %lu (%.1f per key)\n", total_allocs, (double) total_allocs / divisor);
+    else printf("allocs        not counted (run acorn_replay instead of acorn)\n");
+    printf("output_bytes  %zu (%.1f per key)\n", total_output, (double) total_output / divisor);
+    printf("frame_hash    %08x\n", hash);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) printf("peak_rss_kb   %ld\n", usage.ru_maxrss);
+    fflush(stdout);
+    exit(0);
 }
 
 /*** init ***/
@@ -1450,30 +7565,84 @@ void init_editor() {
     e.status_msg_time = 0;
     e.mode = MODE_COMMAND;
     e.active_buffer = NULL;
-    e.buffers = malloc(sizeof(struct EditorBuffer) * 16);
+    e.buffers = NULL;
     e.buffer_count = 0;
-
-    if (get_window_size(&e.screenrows, &e.screencols) == -1) {
+    e.buffer_capacity = 0;
+    e.buffer_clock = 0;
+    e.cache_budget = ACORN_CACHE_BUDGET;
+    e.large_file_size = ACORN_LARGE_FILE_SIZE;
+    e.register_name = '"';
+    e.last_register = 0;
+    e.filter.pid = 0;
+    e.filter.to_child = -1;
+    e.filter.from_child = -1;
+    e.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    hl_cache_init(ACORN_HL_CACHE_ENTRIES);
+
+    //ACORN_TRACE=file traces the whole session (the file is written on exit)
+    if (getenv("ACORN_TRACE")) trace_start(getenv("ACORN_TRACE"));
+    atexit(trace_stop_at_exit);
+
+    if (e.headless) {
+        e.screenrows = e.replay.rows;
+        e.screencols = e.replay.cols;
+    } else if (e.server.running) {
+        e.screenrows = ACORN_SERVER_ROWS;
+        e.screencols = ACORN_SERVER_COLS;
+    } else if (get_window_size(&e.screenrows, &e.screencols) == -1) {
         die("get_window_size");
     }
 
     e.screenrows -= 2; //for status bar and tabs
 }
 
+//acorn_bench includes this file for the editor core and brings its own main
+#ifndef ACORN_NO_MAIN
 int main(int argc, char* argv[]) {
-    enable_raw_mode();
-    init_editor();
-    if (argc >= 2) {
-        editor_open_buffer(argv[1]);
+    //checked before the terminal goes raw, otherwise '-S' would be opened as a file
+    if (argc == 2 && !strcmp(argv[1], "-S")) {
+        fprintf(stderr, "usage: acorn -S session\n");
+        return 1;
+    }
+    if (argc >= 3 && !strcmp(argv[1], "--replay")) {
+        //acorn --replay script [file] runs the script headless and prints a report instead of editing
+        //(acorn_replay is the same editor built to count allocations as well)
+        e.headless = 1;
+        editor_replay_load(argv[2]);
+        argv += 2;
+        argc -= 2;
+        if (e.replay.temp_file) {
+            argv[1] = e.replay.temp_file;
+            argc = 2;
+        }
+    } else if (argc >= 2 && !strcmp(argv[1], "--client")) {
+        editor_client(argc >= 3 ? argv[2] : NULL); //doesn't return
+    } else if (argc >= 2 && !strcmp(argv[1], "--server")) {
+        //acorn --server [file] goes into the background and waits for clients
+        editor_server_listen();
+        argv++;
+        argc--;
     } else {
+        enable_raw_mode();
+    }
+    init_editor();
+    //acorn -S file restores that session, acorn on its own the one written when it last quit
+    int restored = -1;
+    if (argc >= 3 && !strcmp(argv[1], "-S")) {
+        restored = editor_restore_session(argv[2]);
+        if (restored == -1) die(argv[2]);
+    } else if (argc < 2 && !e.headless && !e.server.running) {
+        restored = editor_restore_session(editor_session_path());
+    }
+    if (restored == -1) {
         editor_open_buffer(argv[1]);
+        editor_set_status_message("Acorn Editor");
     }
 
-    editor_set_status_message("Acorn Editor");
-
     while (1) {
         editor_refresh_screen();
         editor_process_keypress();
     }
     return 0;
 }
+#endif
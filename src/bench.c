@@ -0,0 +1,147 @@
+//microbenchmarks for the editor's hot paths (the acorn_bench target)
+//usage: acorn_bench [filter] - only benchmarks whose name contains 'filter' are run
+//every result is printed as one line of JSON so runs of two versions can be diffed or loaded into a script:
+//  {"bench": "update_row", "input": "tabs", "rows": 100000, "ops": 262144, "ns_per_op": 412.7}
+#define ACORN_NO_MAIN
+#include "acorn.c"
+
+#define BENCH_MIN_MS 200.0 //each benchmark is repeated until it has run at least this long
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+
+struct BenchInput {
+    const char* name;
+    const char* lines[8]; //repeated to fill the buffer, NULL terminated
+};
+
+struct BenchInput inputs[] = {
+    { "short", { "int x = y + 1;", "}", "", "return total;", NULL } },
+    { "long", {
+        "static const char* table[] = { \"alpha\", \"beta\", \"gamma\", \"delta\", \"epsilon\", \"zeta\", \"eta\", \"theta\", \"iota\", \"kappa\", \"lambda\", \"mu\", \"nu\", \"xi\", \"omicron\", \"pi\", \"rho\", \"sigma\", \"tau\", \"upsilon\", \"phi\", \"chi\", \"psi\", \"omega\" }; int values[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32 }; // lookup tables for the greek alphabet and the first thirty two integers, kept on one line",
+        NULL } },
+    { "tabs", { "\t\tif (a > b)\t{\treturn a;\t}", "\t\t\tcount\t+= 1;\t// tally", "\tcase 'x':\t\tbreak;", NULL } },
+    { "comments", { "/* a block comment that", " * goes on for a while", " * with 42 numbers and \"strings\" in it", " */", "int x = 0; // trailing comment", NULL } },
+};
+
+int sizes[] = { 1000, 100000 };
+
+const char* bench_filter;
+const char* bench_input;
+int bench_rows;
+
+double bench_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+//opens a fresh buffer named bench.c (so it gets C highlighting) filled with 'rows' lines of 'input'
+//the name is only set after opening, so a bench.c in the working directory isn't read
+void bench_load(struct BenchInput* input, int rows) {
+    while (e.buffer_count > 0) editor_close_buffer(editor_buffer_index(e.active_buffer));
+    editor_open_buffer(NULL);
+    e.active_buffer->filename = strdup("bench.c");
+    editor_select_syntax_highlight();
+
+    int num_lines = 0;
+    while (input->lines[num_lines]) num_lines++;
+    struct RegisterSlice* slices = malloc(sizeof(struct RegisterSlice) * rows);
+    for (int j = 0; j < rows; j++) {
+        slices[j].text = (char*) input->lines[j % num_lines];
+        slices[j].start = 0;
+        slices[j].len = strlen(slices[j].text);
+    }
+    editor_insert_rows(0, NULL, slices, rows);
+    editor_del_row(rows); //the empty row every new buffer starts with
+    free(slices);
+
+    bench_input = input->name;
+    bench_rows = rows;
+}
+
+//runs 'op' (with an increasing counter) until BENCH_MIN_MS have passed and prints the time per call
+void bench_run(const char* name, void (*op)(int)) {
+    if (bench_filter && !strstr(name, bench_filter)) return;
+
+    int ops = 0;
+    double start = bench_now_ms();
+    double elapsed = 0;
+    for (int batch = 1; elapsed < BENCH_MIN_MS; batch *= 2) {
+        for (int i = 0; i < batch; i++) op(ops++);
+        elapsed = bench_now_ms() - start;
+    }
+    printf("{\"bench\": \"%s\", \"input\": \"%s\", \"rows\": %d, \"ops\": %d, \"ns_per_op\": %.1f}\n",
+            name, bench_input, bench_rows, ops, elapsed * 1000000.0 / ops);
+    fflush(stdout);
+}
+
+void bench_update_row(int i) {
+    editor_update_row(&e.active_buffer->row[i % e.active_buffer->num_rows]);
+}
+
+void bench_update_syntax(int i) {
+    struct EditorRow* row = &e.active_buffer->row[i % e.active_buffer->num_rows];
+    editor_update_syntax(e.active_buffer, row, editor_prev_open_comment(e.active_buffer, row));
+}
+
+//the lexer behind editor_update_syntax without the highlight cache in front of it
+void bench_lex_row(int i) {
+    static unsigned char* hl = NULL;
+    static int hl_capacity = 0;
+    struct EditorRow* row = &e.active_buffer->row[i % e.active_buffer->num_rows];
+    if (row->render_size + 1 > hl_capacity) {
+        hl_capacity = row->render_size + 1;
+        hl = realloc(hl, hl_capacity);
+    }
+    editor_lex_row(e.active_buffer->syntax, row, editor_prev_open_comment(e.active_buffer, row), hl);
+}
+
+void bench_insert_del_row(int i) {
+    int at = e.active_buffer->num_rows / 2;
+    editor_insert_row(at, "int inserted = 1;", 17);
+    editor_del_row(at + (i & 1)); //alternate so both neighbours get moved around
+}
+
+void bench_draw_rows(int i) {
+    struct EditorBuffer* b = e.active_buffer;
+    b->row_offset = (i * e.screenrows) % b->num_rows;
+    b->cursor_y = b->row_offset;
+    struct AppendBuffer ab = APPEND_BUFFER_INIT;
+    editor_draw_rows(&ab);
+    append_buffer_free(&ab);
+}
+
+void bench_find_callback(int i) {
+    //the query is nowhere in the buffer, so every call scans all rows
+    editor_find_callback("not_in_the_buffer", i == 0 ? 'x' : ARROW_DOWN);
+}
+
+void bench_rows_to_string(int i) {
+    (void) i;
+    int len;
+    free(editor_rows_to_string(&len));
+}
+
+int main(int argc, char* argv[]) {
+    bench_filter = argc >= 2 ? argv[1] : NULL;
+
+    //same headless setup as --replay, so nothing touches the terminal
+    e.headless = 1;
+    e.replay.rows = BENCH_ROWS;
+    e.replay.cols = BENCH_COLS;
+    init_editor();
+
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (unsigned int j = 0; j < sizeof(inputs) / sizeof(inputs[0]); j++) {
+            bench_load(&inputs[j], sizes[s]);
+            bench_run("update_row", bench_update_row);
+            bench_run("update_syntax", bench_update_syntax);
+            bench_run("lex_row", bench_lex_row);
+            bench_run("insert_del_row", bench_insert_del_row);
+            bench_run("draw_rows", bench_draw_rows);
+            bench_run("find_callback", bench_find_callback);
+            bench_run("rows_to_string", bench_rows_to_string);
+        }
+    }
+    return 0;
+}